@@ -0,0 +1,89 @@
+#pragma once
+
+#include "ray.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+
+// Axis-aligned bounding box in single precision, the empty box by default.
+struct aabb {
+    float min[3] = {std::numeric_limits<float>::infinity(), std::numeric_limits<float>::infinity(), std::numeric_limits<float>::infinity()};
+    float max[3] = {-std::numeric_limits<float>::infinity(), -std::numeric_limits<float>::infinity(), -std::numeric_limits<float>::infinity()};
+
+    void grow(const aabb &box) {
+        for (int axis = 0; axis < 3; ++axis) {
+            min[axis] = std::min(min[axis], box.min[axis]);
+            max[axis] = std::max(max[axis], box.max[axis]);
+        }
+    }
+
+    void grow(const float point[3]) {
+        for (int axis = 0; axis < 3; ++axis) {
+            min[axis] = std::min(min[axis], point[axis]);
+            max[axis] = std::max(max[axis], point[axis]);
+        }
+    }
+
+    bool empty() const { return min[0] > max[0]; }
+
+    float surface_area() const {
+        if (empty()) { return 0.0f; }
+        const float x = max[0] - min[0], y = max[1] - min[1], z = max[2] - min[2];
+        return 2.0f * (x*y + y*z + z*x);
+    }
+
+    // The box at time t in [0, 1] of something that moves linearly from this box to end.
+    aabb lerp(const aabb &end, float t) const {
+        aabb box;
+        for (int axis = 0; axis < 3; ++axis) {
+            box.min[axis] = min[axis] + t * (end.min[axis] - min[axis]);
+            box.max[axis] = max[axis] + t * (end.max[axis] - max[axis]);
+        }
+        return box;
+    }
+
+    int longest_axis() const {
+        const float x = max[0] - min[0], y = max[1] - min[1], z = max[2] - min[2];
+        return x >= y && x >= z ? 0 : (y >= z ? 1 : 2);
+    }
+};
+
+// Bounds of a sphere, rounded outwards to single precision.
+inline aabb sphere_box(const point3 &center, double radius) {
+    constexpr auto inf = std::numeric_limits<float>::infinity();
+    const double c[3] = {center.x, center.y, center.z};
+    aabb box;
+    for (int axis = 0; axis < 3; ++axis) {
+        box.min[axis] = std::nextafter(static_cast<float>(c[axis] - radius), -inf);
+        box.max[axis] = std::nextafter(static_cast<float>(c[axis] + radius), inf);
+    }
+    return box;
+}
+
+// A ray prepared for slab tests against many boxes.
+struct box_ray {
+    float origin[3];
+    float inverse_direction[3];
+    float time;
+
+    explicit box_ray(const ray &r)
+        : origin{static_cast<float>(r.origin.x), static_cast<float>(r.origin.y), static_cast<float>(r.origin.z)},
+          inverse_direction{static_cast<float>(1.0 / r.direction.x), static_cast<float>(1.0 / r.direction.y), static_cast<float>(1.0 / r.direction.z)},
+          time(static_cast<float>(r.time)) { }
+
+    // Distance at which the ray enters box within [t_min, t_max], or infinity
+    // if it misses it. The exit distance is widened by a few ulps so rounding
+    // never culls a grazing hit.
+    float entry(const float box_min[3], const float box_max[3], float t_min, float t_max) const {
+        for (int axis = 0; axis < 3; ++axis) {
+            float t0 = (box_min[axis] - origin[axis]) * inverse_direction[axis];
+            float t1 = (box_max[axis] - origin[axis]) * inverse_direction[axis];
+            if (t0 > t1) { std::swap(t0, t1); }
+            // NaN, from a zero direction component on the slab plane, keeps the bound.
+            t_min = t0 > t_min ? t0 : t_min;
+            t_max = t1 * 1.0000004f < t_max ? t1 * 1.0000004f : t_max;
+        }
+        return t_min <= t_max ? t_min : std::numeric_limits<float>::infinity();
+    }
+};
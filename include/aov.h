@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstdint>
+#include <initializer_list>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+
+// Arbitrary output variables: per-pixel planes rendered in the same pass as the
+// color and written as extra layers of the OpenEXR outputs.
+enum class aov : uint32_t {
+    depth,          // Distance to the closest hit among the samples of the pixel.
+    normal,         // Average normal of the first non-specular hit, like the denoiser guides.
+    albedo,         // Average albedo of the first non-specular hit.
+    material_id,    // Ids of the closest hit, 0 where the samples hit nothing.
+    object_id,
+    sample_count,
+    time,           // Seconds spent rendering the pixel, summed over the passes.
+};
+
+inline constexpr std::string_view aov_names[] = {"depth", "normal", "albedo", "material_id", "object_id", "samples", "time"};
+
+inline std::string_view aov_name(aov a) {
+    return aov_names[static_cast<uint32_t>(a)];
+}
+
+inline aov parse_aov(std::string_view name) {
+    for (uint32_t i = 0; i < std::size(aov_names); ++i) {
+        if (aov_names[i] == name) { return static_cast<aov>(i); }
+    }
+    throw std::invalid_argument("Unknown AOV: " + std::string(name));
+}
+
+class aov_set {
+    public:
+        constexpr aov_set() {}
+        constexpr aov_set(std::initializer_list<aov> aovs) {
+            for (const auto a : aovs) { add(a); }
+        }
+        constexpr explicit aov_set(uint32_t bits) : bits(bits) { }
+
+        constexpr bool has(aov a) const { return bits & (1u << static_cast<uint32_t>(a)); }
+        constexpr bool empty() const { return bits == 0; }
+        constexpr void add(aov a) { bits |= 1u << static_cast<uint32_t>(a); }
+        constexpr void add(aov_set other) { bits |= other.bits; }
+
+        constexpr bool operator == (const aov_set &) const = default;
+
+    public:
+        uint32_t bits = 0;
+};
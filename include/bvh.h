@@ -0,0 +1,422 @@
+#pragma once
+
+#include "aabb.h"
+#include "mapped_file.h"
+#include "rtweekend.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+
+struct bvh_build_settings {
+    uint32_t max_leaf_size = 4;
+    uint32_t bins = 16;         // Candidate split planes per axis of the binned SAH.
+};
+
+// Node of a flattened bounding volume hierarchy, in depth-first order: the left
+// child of an inner node follows it, first is the index of its right child.
+struct bvh_node {
+    float min[3];
+    uint32_t first;     // First entry of the leaf in the primitive indices, or the right child.
+    float max[3];
+    uint32_t count;     // Primitives of a leaf, 0 for inner nodes.
+};
+
+// Hierarchy over primitives given by index. The arrays are views of the storage,
+// built vectors or a mapped cache file. A hierarchy over moving primitives keeps
+// the boxes of its nodes at time 0 in the nodes and those at time 1 in
+// end_bounds, and traversals interpolate them at the time of the ray.
+struct bvh {
+    std::span<const bvh_node> nodes;
+    std::span<const uint32_t> indices;
+    std::span<const aabb> end_bounds;   // Empty for still primitives.
+    std::shared_ptr<const void> storage;
+
+    aabb node_box(uint32_t node) const {
+        aabb box;
+        std::copy(nodes[node].min, nodes[node].min + 3, box.min);
+        std::copy(nodes[node].max, nodes[node].max + 3, box.max);
+        return box;
+    }
+
+    // Of the root over the whole frame, empty without primitives.
+    aabb bounds() const {
+        aabb box;
+        if (!nodes.empty()) {
+            box = node_box(0);
+            if (!end_bounds.empty()) { box.grow(end_bounds[0]); }
+        }
+        return box;
+    }
+
+    // Deepest hierarchy the builder produces, traversal stacks hold this many
+    // nodes: surface area splits down to depth 64, then median splits.
+    static constexpr uint32_t max_depth = 96;
+};
+
+namespace bvh_detail {
+    struct owned_arrays {
+        std::vector<bvh_node> nodes;
+        std::vector<uint32_t> indices;
+        std::vector<aabb> end_bounds;
+    };
+
+    // Binned surface area heuristic. Past a depth the splits fall back to the
+    // object median, which bounds the depth for any input.
+    class builder {
+        public:
+            builder(std::span<const aabb> bounds, const bvh_build_settings &settings) : bounds(bounds), settings(settings) {
+                centroids.resize(bounds.size() * 3);
+                for (size_t i = 0; i < bounds.size(); ++i) {
+                    for (int axis = 0; axis < 3; ++axis) {
+                        centroids[i * 3 + axis] = 0.5f * (bounds[i].min[axis] + bounds[i].max[axis]);
+                    }
+                }
+                arrays.indices.resize(bounds.size());
+                for (uint32_t i = 0; i < arrays.indices.size(); ++i) { arrays.indices[i] = i; }
+            }
+
+            owned_arrays build() {
+                if (!bounds.empty()) {
+                    arrays.nodes.reserve(bounds.size() * 2 / std::max(1u, settings.max_leaf_size) + 1);
+                    build_node(0, static_cast<uint32_t>(bounds.size()), 0);
+                }
+                return std::move(arrays);
+            }
+
+        private:
+            static constexpr int sah_depth = 64;
+
+            uint32_t build_node(uint32_t first, uint32_t count, int depth) {
+                const auto index = static_cast<uint32_t>(arrays.nodes.size());
+                arrays.nodes.emplace_back();
+
+                aabb box, centroid_box;
+                for (uint32_t i = first; i < first + count; ++i) {
+                    box.grow(bounds[arrays.indices[i]]);
+                    centroid_box.grow(&centroids[arrays.indices[i] * 3]);
+                }
+                std::copy(box.min, box.min + 3, arrays.nodes[index].min);
+                std::copy(box.max, box.max + 3, arrays.nodes[index].max);
+
+                const auto middle = count <= settings.max_leaf_size ? first : split(first, count, box, centroid_box, depth);
+                if (middle == first) {
+                    arrays.nodes[index].first = first;
+                    arrays.nodes[index].count = count;
+                    return index;
+                }
+
+                build_node(first, middle - first, depth + 1);
+                const auto right = build_node(middle, first + count - middle, depth + 1);
+                arrays.nodes[index].first = right;
+                arrays.nodes[index].count = 0;
+                return index;
+            }
+
+            // Partitions the primitives and returns where the right child starts,
+            // first when they stay together in a leaf.
+            uint32_t split(uint32_t first, uint32_t count, const aabb &box, const aabb &centroid_box, int depth) {
+                auto *begin = arrays.indices.data() + first, *end = begin + count;
+                const auto axis = centroid_box.longest_axis();
+                const auto lo = centroid_box.min[axis], extent = centroid_box.max[axis] - lo;
+
+                // Coincident centroids can't be separated by a plane.
+                if (!(extent > 0.0f)) {
+                    if (count <= 4 * settings.max_leaf_size) { return first; }
+                    return first + count / 2;
+                }
+                if (depth >= sah_depth) {
+                    std::nth_element(begin, begin + count / 2, end, [&](uint32_t a, uint32_t b) {
+                        return centroids[a * 3 + axis] < centroids[b * 3 + axis];
+                    });
+                    return first + count / 2;
+                }
+
+                const auto bin_count = std::max(2u, settings.bins);
+                const auto scale = bin_count / extent;
+                auto bin_of = [&](uint32_t primitive) {
+                    return std::min(bin_count - 1, static_cast<uint32_t>((centroids[primitive * 3 + axis] - lo) * scale));
+                };
+
+                std::vector<aabb> bin_boxes(bin_count);
+                std::vector<uint32_t> bin_counts(bin_count, 0);
+                for (auto *p = begin; p != end; ++p) {
+                    const auto bin = bin_of(*p);
+                    bin_boxes[bin].grow(bounds[*p]);
+                    ++bin_counts[bin];
+                }
+
+                // Cost of the split after each bin, from a sweep in both directions.
+                std::vector<float> left_cost(bin_count - 1);
+                aabb left;
+                uint32_t left_count = 0;
+                for (uint32_t bin = 0; bin + 1 < bin_count; ++bin) {
+                    left.grow(bin_boxes[bin]);
+                    left_count += bin_counts[bin];
+                    left_cost[bin] = left.surface_area() * left_count;
+                }
+                aabb right;
+                uint32_t right_count = 0;
+                float best_cost = std::numeric_limits<float>::infinity();
+                uint32_t best_bin = 0;
+                for (uint32_t bin = bin_count - 1; bin > 0; --bin) {
+                    right.grow(bin_boxes[bin]);
+                    right_count += bin_counts[bin];
+                    const auto cost = left_cost[bin - 1] + right.surface_area() * right_count;
+                    if (cost < best_cost) {
+                        best_cost = cost;
+                        best_bin = bin;
+                    }
+                }
+
+                // A leaf is cheaper than the best split, in units of primitive tests.
+                const auto leaf_cost = box.surface_area() * count;
+                if (best_cost >= leaf_cost && count <= 4 * settings.max_leaf_size) { return first; }
+
+                const auto *middle = std::partition(begin, end, [&](uint32_t p) { return bin_of(p) < best_bin; });
+                if (middle == begin || middle == end) { return first + count / 2; }
+                return first + static_cast<uint32_t>(middle - begin);
+            }
+
+        private:
+            std::span<const aabb> bounds;
+            bvh_build_settings settings;
+            std::vector<float> centroids;
+            owned_arrays arrays;
+    };
+
+    // Fast 64-bit hash of bytes, eight at a time.
+    inline uint64_t hash_bytes(const void *data, size_t size, uint64_t seed) {
+        const auto *bytes = static_cast<const unsigned char *>(data);
+        auto h = seed ^ (size * 0x9e3779b97f4a7c15ULL);
+        size_t i = 0;
+        for (; i + 8 <= size; i += 8) {
+            uint64_t word;
+            std::memcpy(&word, bytes + i, sizeof(word));
+            h = (h ^ mix64(word)) * 0xff51afd7ed558ccdULL;
+        }
+        uint64_t tail = 0;
+        std::memcpy(&tail, bytes + i, size - i);
+        return mix64(h ^ tail);
+    }
+}
+
+namespace bvh_detail {
+    template <bool Moving, typename T, typename Leaf>
+    void traverse(const bvh &tree, const box_ray &r, float t_min, const T &closest_t, Leaf &&leaf) {
+        auto entry = [&tree, &r, t_min](uint32_t node, float t_max) {
+            if constexpr (Moving) {
+                const auto &start = tree.nodes[node];
+                const auto &end = tree.end_bounds[node];
+                float box_min[3], box_max[3];
+                for (int axis = 0; axis < 3; ++axis) {
+                    box_min[axis] = start.min[axis] + r.time * (end.min[axis] - start.min[axis]);
+                    box_max[axis] = start.max[axis] + r.time * (end.max[axis] - start.max[axis]);
+                }
+                return r.entry(box_min, box_max, t_min, t_max);
+            } else {
+                return r.entry(tree.nodes[node].min, tree.nodes[node].max, t_min, t_max);
+            }
+        };
+        if (entry(0, static_cast<float>(closest_t)) == infinity) { return; }
+
+        uint32_t stack[bvh::max_depth];
+        int top = 0;
+        uint32_t node = 0;
+        while (true) {
+            const auto &n = tree.nodes[node];
+            if (n.count > 0) {
+                leaf(n);
+                if (top == 0) { return; }
+                node = stack[--top];
+                continue;
+            }
+
+            // Nearer child first, the other one waits on the stack.
+            const auto far_t = static_cast<float>(closest_t);
+            const auto left = node + 1, right = n.first;
+            const auto left_t = entry(left, far_t);
+            const auto right_t = entry(right, far_t);
+            if (left_t == infinity && right_t == infinity) {
+                if (top == 0) { return; }
+                node = stack[--top];
+            } else if (right_t == infinity) {
+                node = left;
+            } else if (left_t == infinity) {
+                node = right;
+            } else {
+                node = left_t <= right_t ? left : right;
+                stack[top++] = left_t <= right_t ? right : left;
+            }
+        }
+    }
+}
+
+// Calls leaf(node) for the leaves of tree the ray may hit before closest_t,
+// nearer children first. The leaf function tests the primitives and lowers
+// closest_t, which culls the boxes behind the hits found so far. Boxes of a
+// hierarchy over moving primitives are interpolated at the time of the ray.
+template <typename T, typename Leaf>
+void traverse_bvh(const bvh &tree, const box_ray &r, float t_min, const T &closest_t, Leaf &&leaf) {
+    if (tree.nodes.empty()) { return; }
+    if (tree.end_bounds.empty()) {
+        bvh_detail::traverse<false>(tree, r, t_min, closest_t, leaf);
+    } else {
+        bvh_detail::traverse<true>(tree, r, t_min, closest_t, leaf);
+    }
+}
+
+inline bvh build_bvh(std::span<const aabb> bounds, const bvh_build_settings &settings = {}) {
+    auto arrays = std::make_shared<bvh_detail::owned_arrays>(bvh_detail::builder(bounds, settings).build());
+    bvh tree;
+    tree.nodes = arrays->nodes;
+    tree.indices = arrays->indices;
+    tree.storage = std::move(arrays);
+    return tree;
+}
+
+// Cache file of a built hierarchy (.bvh): a fixed header, then the nodes, the
+// primitive indices and the end bounds in their in-memory layout and host byte
+// order, each on a 64 byte boundary. The key identifies the geometry and build settings it was
+// built for, a cache with another key is stale.
+struct bvh_file_header {
+    char magic[4] = {'R', 'T', 'B', 'V'};
+    uint32_t version = 2;
+    uint64_t key = 0;
+    uint64_t node_count = 0;
+    uint64_t index_count = 0;
+    uint64_t end_bounds_count = 0;  // The node count for moving primitives, otherwise 0.
+};
+
+namespace bvh_detail {
+    constexpr size_t alignment = 64;
+
+    constexpr size_t align(size_t offset) { return (offset + alignment - 1) / alignment * alignment; }
+
+    inline size_t nodes_offset() { return align(sizeof(bvh_file_header)); }
+
+    inline size_t indices_offset(uint64_t node_count) { return align(nodes_offset() + node_count * sizeof(bvh_node)); }
+
+    inline size_t end_bounds_offset(uint64_t node_count, uint64_t index_count) {
+        return align(indices_offset(node_count) + index_count * sizeof(uint32_t));
+    }
+}
+
+// Key of a hierarchy over the given geometry arrays built with settings.
+inline uint64_t bvh_key(std::initializer_list<std::span<const float>> geometry, const bvh_build_settings &settings) {
+    const bvh_file_header format;
+    auto key = hash_combine(format.version, hash_combine(settings.max_leaf_size, settings.bins));
+    for (const auto &array : geometry) { key = bvh_detail::hash_bytes(array.data(), array.size_bytes(), key); }
+    return key;
+}
+
+// Writes the cache through a file of the process, so concurrent writers can't mix.
+inline void save_bvh(const std::string &path, const bvh &tree, uint64_t key) {
+    using namespace bvh_detail;
+
+    bvh_file_header header;
+    header.key = key;
+    header.node_count = tree.nodes.size();
+    header.index_count = tree.indices.size();
+    header.end_bounds_count = tree.end_bounds.size();
+
+    const auto temp_path = path + ".tmp" + std::to_string(getpid());
+    {
+        std::ofstream out(temp_path, std::ios::binary | std::ios::trunc);
+        auto write_at = [&out](size_t offset, const void *data, size_t size) {
+            static const char padding[alignment] = {};
+            out.write(padding, static_cast<std::streamsize>(offset - static_cast<size_t>(out.tellp())));
+            out.write(static_cast<const char *>(data), static_cast<std::streamsize>(size));
+        };
+        out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        write_at(nodes_offset(), tree.nodes.data(), tree.nodes.size_bytes());
+        write_at(indices_offset(header.node_count), tree.indices.data(), tree.indices.size_bytes());
+        write_at(end_bounds_offset(header.node_count, header.index_count), tree.end_bounds.data(), tree.end_bounds.size_bytes());
+        if (!out) {
+            std::remove(temp_path.c_str());
+            throw std::runtime_error("Unable to write the BVH cache: " + path);
+        }
+    }
+    if (std::rename(temp_path.c_str(), path.c_str()) != 0) {
+        std::remove(temp_path.c_str());
+        throw std::runtime_error("Unable to write the BVH cache: " + path);
+    }
+}
+
+// Maps the cache at path, nothing if it is missing, stale or corrupt.
+inline std::optional<bvh> map_bvh(const std::string &path, uint64_t key, size_t primitive_count) {
+    using namespace bvh_detail;
+
+    std::shared_ptr<const mapped_file> file;
+    try {
+        file = std::make_shared<const mapped_file>(path);
+    } catch (const std::runtime_error &) {
+        return std::nullopt;
+    }
+
+    const bvh_file_header expected;
+    bvh_file_header header;
+    if (file->size() < sizeof(header)) { return std::nullopt; }
+    std::memcpy(&header, file->data(), sizeof(header));
+    if (std::memcmp(header.magic, expected.magic, sizeof(header.magic)) != 0 || header.version != expected.version
+            || header.key != key || header.index_count != primitive_count || header.node_count > file->size()
+            || (header.end_bounds_count != 0 && header.end_bounds_count != header.node_count)
+            || end_bounds_offset(header.node_count, header.index_count) + header.end_bounds_count * sizeof(aabb) > file->size()) {
+        return std::nullopt;
+    }
+
+    bvh tree;
+    tree.nodes = std::span(reinterpret_cast<const bvh_node *>(file->data() + nodes_offset()), header.node_count);
+    tree.indices = std::span(reinterpret_cast<const uint32_t *>(file->data() + indices_offset(header.node_count)), header.index_count);
+    tree.end_bounds = std::span(reinterpret_cast<const aabb *>(file->data() + end_bounds_offset(header.node_count, header.index_count)),
+                                header.end_bounds_count);
+
+    // The key only vouches for the geometry, the links must keep traversals in bounds.
+    std::vector<uint32_t> depth(tree.nodes.size(), 0);
+    for (size_t i = 0; i < tree.nodes.size(); ++i) {
+        const auto &node = tree.nodes[i];
+        const auto in_bounds = node.count > 0
+            ? node.first <= tree.indices.size() && node.count <= tree.indices.size() - node.first
+            : node.first > i + 1 && node.first < tree.nodes.size();
+        if (!in_bounds || depth[i] >= bvh::max_depth) { return std::nullopt; }
+        if (node.count == 0) { depth[i + 1] = depth[node.first] = depth[i] + 1; }
+    }
+    if (std::ranges::any_of(tree.indices, [primitive_count](uint32_t index) { return index >= primitive_count; })) {
+        return std::nullopt;
+    }
+
+    tree.storage = std::move(file);
+    return tree;
+}
+
+struct cached_bvh {
+    bvh tree;
+    bool from_cache = false;
+};
+
+// Maps the hierarchy cached at cache_path if it was built for key, otherwise
+// builds it and stores it there for the next runs. A cache that can't be
+// written only costs the next run a build.
+template <typename Build>
+cached_bvh load_or_build_bvh(const std::string &cache_path, uint64_t key, size_t primitive_count, Build &&build) {
+    if (auto tree = map_bvh(cache_path, key, primitive_count)) { return {std::move(*tree), true}; }
+
+    cached_bvh result{build(), false};
+    try {
+        save_bvh(cache_path, result.tree, key);
+    } catch (const std::runtime_error &e) {
+        std::cerr << e.what() << '\n';
+    }
+    return result;
+}
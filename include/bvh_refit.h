@@ -0,0 +1,180 @@
+#pragma once
+
+#include "aabb.h"
+#include "bvh.h"
+#include "thread_pool.h"
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <vector>
+
+
+// Expected cost of a ray through the hierarchy under the surface area heuristic,
+// in units of one node or primitive test, for rays that hit the root box. That
+// of a hierarchy over moving primitives is the mean of its costs at times 0 and 1.
+inline double bvh_sah_cost(const bvh &tree) {
+    if (tree.nodes.empty()) { return 0.0; }
+    auto cost_at = [&tree](auto &&box_of) {
+        double cost = 0.0;
+        for (uint32_t i = 0; i < tree.nodes.size(); ++i) {
+            cost += box_of(i).surface_area() * static_cast<double>(tree.nodes[i].count > 0 ? tree.nodes[i].count : 1);
+        }
+        const double root_area = box_of(0).surface_area();
+        return root_area > 0.0 ? cost / root_area : static_cast<double>(tree.nodes.size());
+    };
+
+    const auto open = cost_at([&tree](uint32_t i) { return tree.node_box(i); });
+    if (tree.end_bounds.empty()) { return open; }
+    return 0.5 * (open + cost_at([&tree](uint32_t i) { return tree.end_bounds[i]; }));
+}
+
+namespace bvh_detail {
+    // One past the last node of the subtree at root, subtrees are contiguous.
+    inline uint32_t subtree_end(std::span<const bvh_node> nodes, uint32_t root) {
+        while (nodes[root].count == 0) { root = nodes[root].first; }
+        return root + 1;
+    }
+
+    // Children follow their parent, so a reverse sweep meets them first.
+    inline void refit_range(std::span<const bvh_node> nodes, std::span<const uint32_t> indices, std::span<const aabb> bounds,
+                            std::span<aabb> boxes, uint32_t first, uint32_t end) {
+        for (auto i = end; i-- > first;) {
+            const auto &node = nodes[i];
+            aabb box;
+            if (node.count > 0) {
+                for (uint32_t p = node.first; p < node.first + node.count; ++p) { box.grow(bounds[indices[p]]); }
+            } else {
+                box = boxes[i + 1];
+                box.grow(boxes[node.first]);
+            }
+            boxes[i] = box;
+        }
+    }
+
+    inline void store_boxes(std::span<bvh_node> nodes, std::span<const aabb> boxes) {
+        for (size_t i = 0; i < nodes.size(); ++i) {
+            std::copy(boxes[i].min, boxes[i].min + 3, nodes[i].min);
+            std::copy(boxes[i].max, boxes[i].max + 3, nodes[i].max);
+        }
+    }
+}
+
+// A hierarchy over primitives moving linearly from the open to the close bounds
+// during the frame. Its topology is built for the middle of the frame, then
+// its boxes are fit at both ends, so a ray at any time tests the interpolated
+// boxes rather than ones that cover the whole motion.
+inline bvh build_motion_bvh(std::span<const aabb> open, std::span<const aabb> close, const bvh_build_settings &settings = {}) {
+    using namespace bvh_detail;
+
+    std::vector<aabb> middle(open.size());
+    for (size_t i = 0; i < middle.size(); ++i) { middle[i] = open[i].lerp(close[i], 0.5f); }
+    auto arrays = std::make_shared<owned_arrays>(builder(middle, settings).build());
+
+    const auto node_count = static_cast<uint32_t>(arrays->nodes.size());
+    std::vector<aabb> boxes(node_count);
+    refit_range(arrays->nodes, arrays->indices, open, boxes, 0, node_count);
+    store_boxes(arrays->nodes, boxes);
+    arrays->end_bounds.resize(node_count);
+    refit_range(arrays->nodes, arrays->indices, close, arrays->end_bounds, 0, node_count);
+
+    bvh tree;
+    tree.nodes = arrays->nodes;
+    tree.indices = arrays->indices;
+    tree.end_bounds = arrays->end_bounds;
+    tree.storage = std::move(arrays);
+    return tree;
+}
+
+// The hierarchy of tree with its boxes recomputed for the new primitive bounds,
+// keeping its topology. Subtrees below the top levels are refit in parallel,
+// then the top levels on the calling thread. Close bounds make it a hierarchy
+// over moving primitives, see build_motion_bvh.
+inline bvh refit_bvh(const bvh &tree, std::span<const aabb> open, thread_pool &pool, std::span<const aabb> close = {}) {
+    using namespace bvh_detail;
+
+    auto arrays = std::make_shared<owned_arrays>();
+    arrays->nodes.assign(tree.nodes.begin(), tree.nodes.end());
+    arrays->indices.assign(tree.indices.begin(), tree.indices.end());
+    std::span<const bvh_node> nodes(arrays->nodes);
+
+    // Cut the tree where it has enough subtrees to balance the threads.
+    std::vector<uint32_t> top, subtrees;
+    if (!nodes.empty()) {
+        const size_t wanted = 8 * static_cast<size_t>(pool.size());
+        std::vector<uint32_t> level = {0};
+        while (!level.empty() && level.size() + subtrees.size() < wanted) {
+            std::vector<uint32_t> next;
+            for (const auto node : level) {
+                if (nodes[node].count > 0) {
+                    subtrees.push_back(node);
+                } else {
+                    top.push_back(node);
+                    next.push_back(node + 1);
+                    next.push_back(nodes[node].first);
+                }
+            }
+            level = std::move(next);
+        }
+        subtrees.insert(subtrees.end(), level.begin(), level.end());
+    }
+    std::sort(top.begin(), top.end(), std::greater<>());
+
+    auto refit = [&](std::span<const aabb> bounds, std::span<aabb> boxes) {
+        pool.parallel_for(subtrees.size(), [&](size_t i) {
+            refit_range(nodes, arrays->indices, bounds, boxes, subtrees[i], subtree_end(nodes, subtrees[i]));
+        });
+        for (const auto node : top) { refit_range(nodes, arrays->indices, bounds, boxes, node, node + 1); }
+    };
+
+    std::vector<aabb> boxes(nodes.size());
+    refit(open, boxes);
+    store_boxes(arrays->nodes, boxes);
+    if (!close.empty()) {
+        arrays->end_bounds.resize(nodes.size());
+        refit(close, arrays->end_bounds);
+    }
+
+    bvh result;
+    result.nodes = arrays->nodes;
+    result.indices = arrays->indices;
+    result.end_bounds = arrays->end_bounds;
+    result.storage = std::move(arrays);
+    return result;
+}
+
+// Hierarchy over moving primitives. Updates refit it while its cost stays
+// within rebuild_ratio of the cost it had when it was last built, past that
+// it is built again. Close bounds give primitives that move within the frame.
+class dynamic_bvh {
+    public:
+        explicit dynamic_bvh(double rebuild_ratio = 1.5, const bvh_build_settings &settings = {})
+            : rebuild_ratio(rebuild_ratio), settings(settings) { }
+
+        const bvh &hierarchy() const { return tree; }
+        double cost() const { return current_cost; }
+        double built_cost() const { return reference_cost; }
+
+        // True when the hierarchy was rebuilt rather than refit.
+        bool update(std::span<const aabb> open, thread_pool &pool, std::span<const aabb> close = {}) {
+            if (tree.indices.size() == open.size() && !tree.nodes.empty() && tree.end_bounds.empty() == close.empty()) {
+                tree = refit_bvh(tree, open, pool, close);
+                current_cost = bvh_sah_cost(tree);
+                if (current_cost <= rebuild_ratio * reference_cost) { return false; }
+            }
+            rebuild(open, close);
+            return true;
+        }
+
+        void rebuild(std::span<const aabb> open, std::span<const aabb> close = {}) {
+            tree = close.empty() ? build_bvh(open, settings) : build_motion_bvh(open, close, settings);
+            current_cost = reference_cost = bvh_sah_cost(tree);
+        }
+
+    private:
+        double rebuild_ratio;
+        bvh_build_settings settings;
+        bvh tree;
+        double current_cost = 0.0;
+        double reference_cost = 0.0;
+};
@@ -10,12 +10,15 @@ class camera {
                 const double vfov, // vertical field-of-view in degrees
                 const double aspect_ratio,
                 const double aperture,
-                const double depth_of_field
-            ) {
+                const double depth_of_field,
+                const double shutter_open = 0.0,
+                const double shutter_close = 0.0
+            ) : shutter_open(shutter_open), shutter_close(shutter_close) {
 
             const auto theta = degree_to_radians(vfov);
             const auto h = tan(theta / 2.0); 
             const auto viewport_height = 2.0 * h;
+            view_height = viewport_height;
             const auto viewport_width = viewport_height * aspect_ratio;
 
             w = normalized(lookfrom - lookat);
@@ -30,11 +33,17 @@ class camera {
             lens_radius = aperture / 2.0;
         }
 
+        // Angle between the rays of neighboring pixels, for an image of that many rows.
+        double pixel_spread(int rows) const { return view_height / rows; }
+
         ray get_ray(double s, double t) const {
             const vec3 rd = lens_radius * random_in_unit_disk_full();
             const vec3 offset = u*rd.x + v*rd.y;
 
-            return ray(origin + offset, lower_left_corner + s*horizontal + t*vertical - origin - offset);
+            // An instant shutter takes no random number, which keeps still frames as they were.
+            const auto time = shutter_open == shutter_close ? shutter_open : random_double(shutter_open, shutter_close);
+
+            return ray(origin + offset, lower_left_corner + s*horizontal + t*vertical - origin - offset, time);
         }
     
     private:
@@ -44,4 +53,23 @@ class camera {
         vec3 vertical;
         vec3 u, v, w;
         double lens_radius;
-};
\ No newline at end of file
+        double view_height;     // At unit distance.
+        double shutter_open, shutter_close;
+};
+
+// Placement and lens of the camera, the default frames the final scene of the first book.
+struct camera_settings {
+    point3 lookfrom = point3(13.0, 2.0, 3.0);
+    point3 lookat = point3(0.0);
+    vec3 vup = vec3(0.0, 1.0, 0.0);
+    double vfov = 20.0;
+    double aperture = 0.1;
+    double focus_distance = 10.0;
+    double shutter_open = 0.0;      // Times within the frame, objects move from time 0 to 1.
+    double shutter_close = 0.0;
+};
+
+inline camera make_camera(const camera_settings &settings, double aspect_ratio) {
+    return camera(settings.lookfrom, settings.lookat, settings.vup, settings.vfov, aspect_ratio, settings.aperture, settings.focus_distance,
+                  settings.shutter_open, settings.shutter_close);
+}
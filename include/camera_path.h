@@ -0,0 +1,124 @@
+#pragma once
+
+#include "camera.h"
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+
+// Camera keyframes of a sequence, one per line, # starts a comment:
+//   key 0 lookfrom 13 2 3 lookat 0 0 0 fov 20
+//   key 120 lookfrom 0 2 13
+//   key 240 lookfrom -13 2 3 fov 30 aperture 0
+// The keys take the camera keys of the scene format, shutter excepted. A key
+// starts from the camera of the previous one, the first from the camera of the
+// command line. Frames must increase, the sequence runs from the first key to
+// the last.
+struct camera_key {
+    int frame = 0;
+    camera_settings camera;
+};
+
+inline std::vector<camera_key> load_camera_path(const std::string &path, const camera_settings &base) {
+    std::ifstream in(path);
+    if (!in) { throw std::runtime_error("Unable to open the camera path: " + path); }
+
+    std::vector<camera_key> keys;
+    std::string line;
+    for (int line_number = 1; std::getline(in, line); ++line_number) {
+        auto fail = [&](const std::string &message) {
+            throw std::runtime_error(path + ':' + std::to_string(line_number) + ": " + message);
+        };
+        line = line.substr(0, line.find('#'));
+        std::istringstream tokens(line);
+        std::string keyword;
+        if (!(tokens >> keyword)) { continue; }
+        if (keyword != "key") { fail("unknown statement " + keyword); }
+
+        camera_key key{0, keys.empty() ? base : keys.back().camera};
+        if (!(tokens >> key.frame)) { fail("expected the frame of the key"); }
+        if (!keys.empty() && key.frame <= keys.back().frame) { fail("the frames of the keys must increase"); }
+
+        auto &camera = key.camera;
+        for (std::string name; tokens >> name;) {
+            auto number = [&](double &value) {
+                if (!(tokens >> value)) { fail("expected a number after " + name); }
+            };
+            auto point = [&](point3 &value) {
+                number(value.x);
+                number(value.y);
+                number(value.z);
+            };
+            if (name == "lookfrom") { point(camera.lookfrom); }
+            else if (name == "lookat") { point(camera.lookat); }
+            else if (name == "vup") { point(camera.vup); }
+            else if (name == "fov") { number(camera.vfov); }
+            else if (name == "aperture") { number(camera.aperture); }
+            else if (name == "focus_distance") { number(camera.focus_distance); }
+            else { fail("unknown camera key " + name); }
+        }
+
+        if ((camera.lookfrom - camera.lookat).length_squared() == 0.0) { fail("lookfrom and lookat must differ"); }
+        if (camera.vfov <= 0.0 || camera.vfov >= 180.0) { fail("fov must be between 0 and 180 degrees"); }
+        if (camera.aperture < 0.0 || camera.focus_distance <= 0.0) { fail("aperture must not be negative and focus_distance must be positive"); }
+        keys.push_back(key);
+    }
+    if (keys.empty()) { throw std::runtime_error("The camera path " + path + " has no keys"); }
+    return keys;
+}
+
+namespace camera_path_detail {
+    // Cubic Hermite curve through p1 at u = 0 and p2 at u = 1, whose tangents are
+    // the Catmull-Rom ones scaled to keys at any frame distances. Missing outer
+    // keys repeat the inner ones, which eases the path in and out.
+    template <typename T>
+    T interpolate(const T &p0, const T &p1, const T &p2, const T &p3, double f0, double f1, double f2, double f3, double u) {
+        const auto span = f2 - f1;
+        const T m1 = (p2 - p0) * (span / std::max(f2 - f0, 1e-9));
+        const T m2 = (p3 - p1) * (span / std::max(f3 - f1, 1e-9));
+        const auto u2 = u * u, u3 = u2 * u;
+        return p1 * (2.0*u3 - 3.0*u2 + 1.0) + m1 * (u3 - 2.0*u2 + u) + p2 * (-2.0*u3 + 3.0*u2) + m2 * (u3 - u2);
+    }
+}
+
+// The camera of a frame, keys are hit exactly and frames between them follow a
+// smooth curve. Frames outside the keys keep the nearest one.
+inline camera_settings camera_at(const std::vector<camera_key> &keys, int frame) {
+    using camera_path_detail::interpolate;
+
+    const auto next = std::upper_bound(keys.begin(), keys.end(), frame, [](int f, const camera_key &key) { return f < key.frame; });
+    if (next == keys.begin()) { return keys.front().camera; }
+    if (next == keys.end()) { return keys.back().camera; }
+
+    const auto &k1 = *(next - 1), &k2 = *next;
+    const auto &k0 = next - 1 == keys.begin() ? k1 : *(next - 2);
+    const auto &k3 = next + 1 == keys.end() ? k2 : *(next + 1);
+    const double f0 = k0.frame, f1 = k1.frame, f2 = k2.frame, f3 = k3.frame;
+    const auto u = (frame - f1) / (f2 - f1);
+
+    auto lerp = [&](auto member) {
+        return interpolate(k0.camera.*member, k1.camera.*member, k2.camera.*member, k3.camera.*member, f0, f1, f2, f3, u);
+    };
+    auto camera = k1.camera;
+    camera.lookfrom = lerp(&camera_settings::lookfrom);
+    camera.lookat = lerp(&camera_settings::lookat);
+    camera.vup = lerp(&camera_settings::vup);
+    camera.vfov = std::clamp(lerp(&camera_settings::vfov), 1e-3, 180.0 - 1e-3);
+    camera.aperture = std::max(0.0, lerp(&camera_settings::aperture));
+    camera.focus_distance = std::max(1e-3, lerp(&camera_settings::focus_distance));
+    return camera;
+}
+
+// Path of a frame, the last run of # in pattern replaced by the zero padded
+// frame number: frame_####.png becomes frame_0042.png.
+inline std::string frame_path(const std::string &pattern, int frame) {
+    const auto last = pattern.find_last_of('#');
+    const auto first = pattern.find_last_not_of('#', last);
+    const auto start = first == std::string::npos ? 0 : first + 1;
+    auto number = std::to_string(frame);
+    if (number.size() < last + 1 - start) { number.insert(0, last + 1 - start - number.size(), '0'); }
+    return pattern.substr(0, start) + number + pattern.substr(last + 1);
+}
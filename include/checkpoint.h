@@ -0,0 +1,136 @@
+#pragma once
+
+#include "framebuffer.h"
+#include "renderer.h"
+#include <bit>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+
+
+// Binary snapshot of a progressive render: a fixed header followed by the raw
+// accumulation sums and per-pixel sample counts, then the AOV planes the render
+// has, all in host byte order. Sample seeds are derived from (seed, pixel,
+// sample index), so the seed together with the per-pixel counts is the whole
+// random number state of the render. The same files hold the slices of a frame
+// rendered with --crop or --slice, for merging. A key of the scene and the
+// camera keeps samples of another render out of them.
+struct checkpoint_header {
+    char magic[4] = {'R', 'T', 'C', 'P'};
+    uint32_t version = 5;
+    uint32_t width = 0;         // Of the whole image.
+    uint32_t height = 0;
+    uint32_t origin_x = 0;      // Rectangle of the image the file covers.
+    uint32_t origin_y = 0;
+    uint32_t region_width = 0;
+    uint32_t region_height = 0;
+    uint64_t seed = 0;
+    uint64_t key = 0;           // Of the scene and the camera, see render_key.
+    uint32_t max_depth = 0;
+    uint32_t samples_done = 0;  // Pass boundary reached by every pixel.
+    uint32_t aovs = 0;          // aov_set bits, their planes follow the sample counts.
+};
+
+// Key of a render, from the scene_key of its scene file, 0 for the random
+// scene, and its camera.
+inline uint64_t render_key(uint64_t scene, const camera_settings &camera) {
+    auto key = scene;
+    for (const auto &point : {camera.lookfrom, camera.lookat, camera.vup}) {
+        for (int axis = 0; axis < 3; ++axis) { key = hash_combine(key, std::bit_cast<uint64_t>(point[axis])); }
+    }
+    for (const auto value : {camera.vfov, camera.aperture, camera.focus_distance, camera.shutter_open, camera.shutter_close}) {
+        key = hash_combine(key, std::bit_cast<uint64_t>(value));
+    }
+    return key;
+}
+
+namespace checkpoint_detail {
+    // Calls io(pointer to the values, size in bytes) for every plane of fb, in file order.
+    template <typename Framebuffer, typename Io>
+    void for_each_plane(Framebuffer &fb, Io &&io) {
+        auto plane = [&](auto &values) { io(values.data(), values.size() * sizeof(values[0])); };
+        plane(fb.sum);
+        plane(fb.samples);
+        plane(fb.albedo);
+        plane(fb.normal);
+        plane(fb.depth);
+        plane(fb.material_id);
+        plane(fb.object_id);
+        plane(fb.render_time);
+    }
+}
+
+inline void save_checkpoint(const std::string &path, const framebuffer &fb, const render_settings &settings, int samples_done) {
+    checkpoint_header header;
+    header.width = settings.image_width;
+    header.height = settings.image_height;
+    header.origin_x = fb.origin_x;
+    header.origin_y = fb.origin_y;
+    header.region_width = fb.width;
+    header.region_height = fb.height;
+    header.seed = settings.seed;
+    header.key = settings.key;
+    header.max_depth = settings.max_depth;
+    header.samples_done = samples_done;
+    header.aovs = fb.aovs.bits;
+
+    // A preempted write must never destroy the previous checkpoint.
+    const auto temp_path = path + ".tmp";
+    {
+        std::ofstream out(temp_path, std::ios::binary | std::ios::trunc);
+        out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        checkpoint_detail::for_each_plane(fb, [&out](const auto *data, size_t size) {
+            out.write(reinterpret_cast<const char *>(data), size);
+        });
+        if (!out) { throw std::runtime_error("Unable to write the checkpoint: " + temp_path); }
+    }
+    if (std::rename(temp_path.c_str(), path.c_str()) != 0) {
+        throw std::runtime_error("Unable to write the checkpoint: " + path);
+    }
+}
+
+// Reads any checkpoint, filling header and returning its framebuffer.
+inline framebuffer read_checkpoint(const std::string &path, checkpoint_header &header) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) { throw std::runtime_error("Unable to open the checkpoint: " + path); }
+
+    const checkpoint_header expected;
+    in.read(reinterpret_cast<char *>(&header), sizeof(header));
+    if (!in || std::memcmp(header.magic, expected.magic, sizeof(header.magic)) != 0 || header.version != expected.version) {
+        throw std::runtime_error("Not a checkpoint file: " + path);
+    }
+    if (header.region_width == 0 || header.region_height == 0
+            || header.origin_x + header.region_width > header.width || header.origin_y + header.region_height > header.height) {
+        throw std::runtime_error("The checkpoint " + path + " is corrupt");
+    }
+
+    framebuffer fb(header.region_width, header.region_height, header.origin_x, header.origin_y, aov_set(header.aovs));
+    checkpoint_detail::for_each_plane(fb, [&in](auto *data, size_t size) {
+        in.read(reinterpret_cast<char *>(data), size);
+    });
+    if (!in) { throw std::runtime_error("The checkpoint is truncated: " + path); }
+    return fb;
+}
+
+// Loads a checkpoint into fb and returns the samples per pixel it holds. Throws if
+// the file is unreadable or was rendered with different settings, including
+// another scene, camera, region or other AOVs than fb.
+inline int load_checkpoint(const std::string &path, framebuffer &fb, const render_settings &settings) {
+    checkpoint_header header;
+    auto loaded = read_checkpoint(path, header);
+    if (header.width != static_cast<uint32_t>(settings.image_width) || header.height != static_cast<uint32_t>(settings.image_height)
+            || header.seed != settings.seed || header.key != settings.key || header.max_depth != static_cast<uint32_t>(settings.max_depth)
+            || loaded.origin_x != fb.origin_x || loaded.origin_y != fb.origin_y || loaded.width != fb.width || loaded.height != fb.height
+            || loaded.aovs != fb.aovs) {
+        throw std::runtime_error("The checkpoint " + path + " was rendered with different settings");
+    }
+    if (header.samples_done > static_cast<uint32_t>(settings.sample_per_pixel)) {
+        throw std::runtime_error("The checkpoint " + path + " already holds more samples than --spp");
+    }
+
+    fb = std::move(loaded);
+    return static_cast<int>(header.samples_done);
+}
@@ -1,21 +1,141 @@
 #pragma once
 
 #include "rtweekend.h"
-#include <iostream>
-
-constexpr void write_color(char img[], int index, const color &pixel_color, int sample_per_pixel) {
-    auto r = pixel_color.x;
-    auto g = pixel_color.y;
-    auto b = pixel_color.z;
-
-    // Divide the color by the number of samples and gamma-correct for gamma=2.0.
-    auto scale = 1.0 / sample_per_pixel;
-    r = sqrt(scale * r);
-    g = sqrt(scale * g);
-    b = sqrt(scale * b);
-
-    // Write the translated [0,255] value of each color component.
-    img[index    ] = static_cast<char>(256 * clamp(r, 0.0, 0.999));
-    img[index + 1] = static_cast<char>(256 * clamp(g, 0.0, 0.999));
-    img[index + 2] = static_cast<char>(256 * clamp(b, 0.0, 0.999));
-}
\ No newline at end of file
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+
+enum class tonemap_operator {
+    none,       // Clip at 1.
+    reinhard,   // x / (1 + x)
+    aces,       // Narkowicz's fit of the ACES filmic curve.
+};
+
+enum class transfer_function {
+    gamma2,     // sqrt, the curve this renderer always used.
+    srgb,
+};
+
+struct tonemap_settings {
+    double exposure = 0.0;  // In stops.
+    tonemap_operator tonemap = tonemap_operator::none;
+    transfer_function transfer = transfer_function::gamma2;
+    int bit_depth = 8;      // 8 or 16.
+
+    int bytes_per_sample() const { return bit_depth / 8; }
+};
+
+inline float srgb_encode(float x) {
+    return x <= 0.0031308f ? 12.92f * x : 1.055f * std::pow(x, 1.0f / 2.4f) - 0.055f;
+}
+
+// Linear [0, 1] to sRGB, sampled finely enough that linear interpolation stays
+// well below the 16-bit quantization step.
+inline const std::array<float, 4098> &srgb_table() {
+    static const auto table = [] {
+        std::array<float, 4098> result{};
+        for (size_t i = 0; i < 4097; ++i) {
+            result[i] = srgb_encode(static_cast<float>(i) / 4096.0f);
+        }
+        result[4097] = result[4096];
+        return result;
+    }();
+    return table;
+}
+
+inline float srgb_lookup(float x) {
+    const auto &table = srgb_table();
+    const auto position = x * 4096.0f;
+    const auto index = static_cast<int>(position);
+    return table[index] + (position - index) * (table[index + 1] - table[index]);
+}
+
+// Scalar reference of the display transform: exposure, tone curve, clip and
+// transfer function. Returns a value in [0, 1].
+inline float display_value(float x, const tonemap_settings &settings, float scale) {
+    x *= scale;
+    x = x > 0.0f ? x : 0.0f;    // Also maps NaN to black.
+    switch (settings.tonemap) {
+        case tonemap_operator::reinhard: x = x / (1.0f + x); break;
+        case tonemap_operator::aces: x = (x * (2.51f * x + 0.03f)) / (x * (2.43f * x + 0.59f) + 0.14f); break;
+        default: break;
+    }
+    x = x < 1.0f ? x : 1.0f;    // Inf / Inf of an infinite input is NaN, it becomes white as in the SSE2 path.
+    return settings.transfer == transfer_function::srgb ? srgb_lookup(x) : std::sqrt(x);
+}
+
+inline void store_sample(uint8_t *out, float value, int bit_depth) {
+    if (bit_depth == 16) {
+        const auto q = static_cast<uint16_t>(std::min(value * 65536.0f, 65535.0f));
+        out[0] = static_cast<uint8_t>(q >> 8);
+        out[1] = static_cast<uint8_t>(q);
+    } else {
+        out[0] = static_cast<uint8_t>(std::min(value * 256.0f, 255.0f));
+    }
+}
+
+// Converts count linear floats to display samples of settings.bit_depth bits,
+// 16-bit samples are big-endian as PNG stores them. Four values at a time with
+// SSE2 when available; the sRGB table lookup is the only per-lane step.
+inline void encode_display(const float *linear, size_t count, const tonemap_settings &settings, uint8_t *out) {
+    const auto scale = static_cast<float>(std::exp2(settings.exposure));
+    const auto bytes = settings.bytes_per_sample();
+    size_t i = 0;
+
+#if defined(__SSE2__)
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 exposure_scale = _mm_set1_ps(scale);
+    const __m128 quantize_scale = _mm_set1_ps(settings.bit_depth == 16 ? 65536.0f : 256.0f);
+    const __m128 quantize_max = _mm_set1_ps(settings.bit_depth == 16 ? 65535.0f : 255.0f);
+
+    for (; i + 4 <= count; i += 4) {
+        // max(x, 0) returns the second operand for NaN, so NaN becomes black.
+        __m128 x = _mm_max_ps(_mm_mul_ps(_mm_loadu_ps(linear + i), exposure_scale), zero);
+
+        if (settings.tonemap == tonemap_operator::reinhard) {
+            x = _mm_div_ps(x, _mm_add_ps(one, x));
+        } else if (settings.tonemap == tonemap_operator::aces) {
+            const __m128 numerator = _mm_mul_ps(x, _mm_add_ps(_mm_mul_ps(_mm_set1_ps(2.51f), x), _mm_set1_ps(0.03f)));
+            const __m128 denominator = _mm_add_ps(_mm_mul_ps(x, _mm_add_ps(_mm_mul_ps(_mm_set1_ps(2.43f), x), _mm_set1_ps(0.59f))), _mm_set1_ps(0.14f));
+            x = _mm_div_ps(numerator, denominator);
+        }
+        x = _mm_min_ps(x, one);
+
+        if (settings.transfer == transfer_function::srgb) {
+            alignas(16) float lanes[4];
+            _mm_store_ps(lanes, x);
+            for (auto &lane : lanes) { lane = srgb_lookup(lane); }
+            x = _mm_load_ps(lanes);
+        } else {
+            x = _mm_sqrt_ps(x);
+        }
+
+        const __m128i q = _mm_cvttps_epi32(_mm_min_ps(_mm_mul_ps(x, quantize_scale), quantize_max));
+        if (bytes == 1) {
+            const __m128i packed = _mm_packus_epi16(_mm_packs_epi32(q, q), _mm_setzero_si128());
+            const auto four = static_cast<uint32_t>(_mm_cvtsi128_si32(packed));
+            std::memcpy(out + i, &four, sizeof(four));
+        } else {
+            alignas(16) int32_t lanes[4];
+            _mm_store_si128(reinterpret_cast<__m128i *>(lanes), q);
+            for (int lane = 0; lane < 4; ++lane) {
+                out[(i + lane) * 2    ] = static_cast<uint8_t>(lanes[lane] >> 8);
+                out[(i + lane) * 2 + 1] = static_cast<uint8_t>(lanes[lane]);
+            }
+        }
+    }
+#endif
+
+    for (; i < count; ++i) {
+        store_sample(out + i * bytes, display_value(linear[i], settings, scale), settings.bit_depth);
+    }
+}
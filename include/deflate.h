@@ -0,0 +1,221 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+
+inline const std::array<uint32_t, 256> &crc32_table() {
+    static const auto table = [] {
+        std::array<uint32_t, 256> result{};
+        for (uint32_t n = 0; n < 256; ++n) {
+            uint32_t c = n;
+            for (int k = 0; k < 8; ++k) {
+                c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            }
+            result[n] = c;
+        }
+        return result;
+    }();
+    return table;
+}
+
+// CRC-32 used by PNG chunks, start with crc = 0.
+inline uint32_t crc32(uint32_t crc, const uint8_t *data, size_t size) {
+    const auto &table = crc32_table();
+    crc = ~crc;
+    for (size_t i = 0; i < size; ++i) {
+        crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+// Adler-32 checksum of a zlib stream, start with adler = 1.
+inline uint32_t adler32(uint32_t adler, const uint8_t *data, size_t size) {
+    constexpr uint32_t base = 65521;
+    constexpr size_t block = 5552; // Largest run that can't overflow before the modulo.
+    uint32_t a = adler & 0xffff;
+    uint32_t b = adler >> 16;
+
+    while (size > 0) {
+        const auto n = std::min(size, block);
+        for (size_t i = 0; i < n; ++i) {
+            a += data[i];
+            b += a;
+        }
+        a %= base;
+        b %= base;
+        data += n;
+        size -= n;
+    }
+    return (b << 16) | a;
+}
+
+// Adler-32 of the concatenation of two pieces, given the checksum of each and the
+// length of the second one.
+inline uint32_t adler32_combine(uint32_t adler1, uint32_t adler2, size_t length2) {
+    constexpr uint64_t base = 65521;
+    const uint64_t remainder = length2 % base;
+    uint64_t sum1 = adler1 & 0xffff;
+    uint64_t sum2 = (remainder * sum1) % base;
+    sum1 += (adler2 & 0xffff) + base - 1;
+    sum2 += (adler1 >> 16) + (adler2 >> 16) + base - remainder;
+    if (sum1 >= base) { sum1 -= base; }
+    if (sum1 >= base) { sum1 -= base; }
+    if (sum2 >= (base << 1)) { sum2 -= (base << 1); }
+    if (sum2 >= base) { sum2 -= base; }
+    return static_cast<uint32_t>(sum1 | (sum2 << 16));
+}
+
+// Writes deflate's LSB first bit stream.
+class bit_writer {
+    public:
+        explicit bit_writer(std::vector<uint8_t> &out) : out(out) { }
+
+        void put(uint32_t bits, int count) {
+            buffer |= static_cast<uint64_t>(bits) << used;
+            used += count;
+            while (used >= 8) {
+                out.push_back(static_cast<uint8_t>(buffer));
+                buffer >>= 8;
+                used -= 8;
+            }
+        }
+
+        void align() {
+            if (used > 0) { put(0, 8 - used); }
+        }
+
+    private:
+        std::vector<uint8_t> &out;
+        uint64_t buffer = 0;
+        int used = 0;
+};
+
+namespace deflate_detail {
+    constexpr int window_size = 32768;
+    constexpr int min_match = 3;
+    constexpr int max_match = 258;
+    constexpr int max_chain = 32;
+    constexpr int hash_bits = 15;
+
+    constexpr uint16_t length_base[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+    constexpr uint8_t length_extra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+    constexpr uint16_t distance_base[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+    constexpr uint8_t distance_extra[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+    constexpr uint32_t reverse_bits(uint32_t code, int length) {
+        uint32_t result = 0;
+        for (int i = 0; i < length; ++i) {
+            result = (result << 1) | ((code >> i) & 1);
+        }
+        return result;
+    }
+
+    struct huffman_code {
+        uint16_t bits;  // Already reversed for the LSB first writer.
+        uint8_t length;
+    };
+
+    // Fixed literal/length codes of RFC 1951 section 3.2.6.
+    inline const std::array<huffman_code, 288> &fixed_literal_codes() {
+        static const auto codes = [] {
+            std::array<huffman_code, 288> result{};
+            for (uint32_t symbol = 0; symbol < 288; ++symbol) {
+                if (symbol < 144) { result[symbol] = {static_cast<uint16_t>(reverse_bits(0x30 + symbol, 8)), 8}; }
+                else if (symbol < 256) { result[symbol] = {static_cast<uint16_t>(reverse_bits(0x190 + symbol - 144, 9)), 9}; }
+                else if (symbol < 280) { result[symbol] = {static_cast<uint16_t>(reverse_bits(symbol - 256, 7)), 7}; }
+                else { result[symbol] = {static_cast<uint16_t>(reverse_bits(0xc0 + symbol - 280, 8)), 8}; }
+            }
+            return result;
+        }();
+        return codes;
+    }
+
+    inline void put_symbol(bit_writer &writer, int symbol) {
+        const auto code = fixed_literal_codes()[symbol];
+        writer.put(code.bits, code.length);
+    }
+
+    inline void put_match(bit_writer &writer, int length, int distance) {
+        const int l = static_cast<int>(std::upper_bound(std::begin(length_base), std::end(length_base), length) - std::begin(length_base)) - 1;
+        put_symbol(writer, 257 + l);
+        writer.put(length - length_base[l], length_extra[l]);
+
+        const int d = static_cast<int>(std::upper_bound(std::begin(distance_base), std::end(distance_base), distance) - std::begin(distance_base)) - 1;
+        writer.put(reverse_bits(d, 5), 5);
+        writer.put(distance - distance_base[d], distance_extra[d]);
+    }
+
+    inline uint32_t hash(const uint8_t *p) {
+        const uint32_t v = p[0] | (p[1] << 8) | (p[2] << 16);
+        return (v * 2654435761u) >> (32 - hash_bits);
+    }
+}
+
+// Compresses data as one fixed Huffman deflate block with greedy LZ77 matching.
+// Matches never reach before data, so independently compressed pieces can be
+// concatenated: unless final is set, the block is followed by an empty stored
+// block that realigns the stream to a byte boundary (a zlib sync flush).
+inline void deflate_block(const uint8_t *data, size_t size, bool final, std::vector<uint8_t> &out) {
+    using namespace deflate_detail;
+
+    bit_writer writer(out);
+    writer.put(final ? 1 : 0, 1);
+    writer.put(1, 2);   // Fixed Huffman codes.
+
+    std::vector<int32_t> head(size_t(1) << hash_bits, -1);
+    std::vector<int32_t> previous(window_size, -1);
+    auto insert = [&](size_t position) {
+        const auto h = hash(data + position);
+        previous[position & (window_size - 1)] = head[h];
+        head[h] = static_cast<int32_t>(position);
+    };
+
+    size_t i = 0;
+    while (i < size) {
+        int best_length = 0;
+        int best_distance = 0;
+
+        if (i + min_match <= size) {
+            const auto limit = static_cast<int>(std::min<size_t>(max_match, size - i));
+            auto candidate = head[hash(data + i)];
+            for (int chain = 0; chain < max_chain && candidate >= 0; ++chain) {
+                const auto distance = static_cast<int>(i - candidate);
+                if (distance > window_size) { break; }
+
+                int length = 0;
+                while (length < limit && data[candidate + length] == data[i + length]) { ++length; }
+                if (length > best_length) {
+                    best_length = length;
+                    best_distance = distance;
+                    if (length == limit) { break; }
+                }
+                candidate = previous[candidate & (window_size - 1)];
+            }
+            insert(i);
+        }
+
+        if (best_length >= min_match) {
+            put_match(writer, best_length, best_distance);
+            for (size_t j = i + 1; j < i + best_length && j + min_match <= size; ++j) {
+                insert(j);
+            }
+            i += best_length;
+        } else {
+            put_symbol(writer, data[i]);
+            ++i;
+        }
+    }
+    put_symbol(writer, 256);   // End of block.
+
+    if (!final) {
+        writer.put(0, 3);       // Non-final stored block...
+        writer.align();
+        writer.put(0x0000, 16); // ...of length zero.
+        writer.put(0xffff, 16);
+    }
+    writer.align();
+}
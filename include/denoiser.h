@@ -0,0 +1,213 @@
+#pragma once
+
+#include "framebuffer.h"
+#include "thread_pool.h"
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+
+struct denoise_settings {
+    int iterations = 5;         // The filter radius doubles with every iteration.
+    float sigma_color = 0.1f;   // On compressed illumination, halved every iteration.
+    float sigma_normal = 0.3f;
+    float sigma_albedo = 0.1f;
+};
+
+namespace denoise_detail {
+    constexpr float kernel[5] = {1.0f / 16.0f, 1.0f / 4.0f, 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f};
+
+    // Lowest albedo the illumination is divided by, darker surfaces keep their noise
+    // instead of having it amplified.
+    constexpr float min_albedo = 0.02f;
+
+    struct rgb_planes {
+        std::array<std::vector<float>, 3> channel;
+
+        explicit rgb_planes(size_t size = 0) {
+            for (auto &plane : channel) { plane.assign(size, 0.0f); }
+        }
+    };
+
+    // Edge stopping inputs of one iteration, all planar so rows can be read four
+    // pixels at a time.
+    struct guides {
+        const rgb_planes &compressed;
+        const rgb_planes &normal;
+        const rgb_planes &albedo;
+        float inverse_color;
+        float inverse_normal;
+        float inverse_albedo;
+    };
+
+    inline float squared_distance(const rgb_planes &planes, size_t p, size_t q) {
+        float sum = 0.0f;
+        for (const auto &plane : planes.channel) {
+            const auto d = plane[p] - plane[q];
+            sum += d * d;
+        }
+        return sum;
+    }
+
+#if defined(__SSE2__)
+    // exp(x) for x <= 0, relative error around 1e-6.
+    inline __m128 exp_negative(__m128 x) {
+        const __m128 one = _mm_set1_ps(1.0f);
+        x = _mm_max_ps(x, _mm_set1_ps(-87.0f));
+        const __m128 t = _mm_mul_ps(x, _mm_set1_ps(1.44269504f));
+
+        __m128 whole = _mm_cvtepi32_ps(_mm_cvttps_epi32(t));
+        whole = _mm_sub_ps(whole, _mm_and_ps(_mm_cmpgt_ps(whole, t), one)); // floor
+        const __m128 f = _mm_sub_ps(t, whole);
+
+        __m128 p = _mm_set1_ps(1.333355e-3f);
+        p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(9.618129e-3f));
+        p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(5.550357e-2f));
+        p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(2.402265e-1f));
+        p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(6.931472e-1f));
+        p = _mm_add_ps(_mm_mul_ps(p, f), one);
+
+        const __m128i exponent = _mm_slli_epi32(_mm_add_epi32(_mm_cvttps_epi32(whole), _mm_set1_epi32(127)), 23);
+        return _mm_mul_ps(p, _mm_castsi128_ps(exponent));
+    }
+
+    inline __m128 squared_distance4(const rgb_planes &planes, size_t p, size_t q) {
+        __m128 sum = _mm_setzero_ps();
+        for (const auto &plane : planes.channel) {
+            const __m128 d = _mm_sub_ps(_mm_loadu_ps(&plane[p]), _mm_loadu_ps(&plane[q]));
+            sum = _mm_add_ps(sum, _mm_mul_ps(d, d));
+        }
+        return sum;
+    }
+#endif
+
+    // One a-trous iteration over row y: a 5x5 B3 spline kernel with holes of size
+    // step, weighted by the similarity of illumination, normal and albedo.
+    inline void filter_row(const rgb_planes &in, rgb_planes &out, const guides &g, int width, int height, int y, int step) {
+        std::vector<float> weight_sum(width, 0.0f);
+        rgb_planes value_sum(width);
+
+        for (int ky = 0; ky < 5; ++ky) {
+            const int yy = y + (ky - 2) * step;
+            if (yy < 0 || yy >= height) { continue; }
+
+            for (int kx = 0; kx < 5; ++kx) {
+                const int offset = (kx - 2) * step;
+                const float kernel_weight = kernel[kx] * kernel[ky];
+                const int x_begin = std::max(0, -offset);
+                const int x_end = std::min(width, width - offset);
+                const auto row = static_cast<size_t>(y) * width;
+                const auto tap_row = static_cast<size_t>(yy) * width + offset;
+                int x = x_begin;
+
+#if defined(__SSE2__)
+                const __m128 kw = _mm_set1_ps(kernel_weight);
+                const __m128 inverse_color = _mm_set1_ps(-g.inverse_color);
+                const __m128 inverse_normal = _mm_set1_ps(-g.inverse_normal);
+                const __m128 inverse_albedo = _mm_set1_ps(-g.inverse_albedo);
+                for (; x + 4 <= x_end; x += 4) {
+                    const auto p = row + x;
+                    const auto q = tap_row + x;
+                    __m128 exponent = _mm_mul_ps(squared_distance4(g.compressed, p, q), inverse_color);
+                    exponent = _mm_add_ps(exponent, _mm_mul_ps(squared_distance4(g.normal, p, q), inverse_normal));
+                    exponent = _mm_add_ps(exponent, _mm_mul_ps(squared_distance4(g.albedo, p, q), inverse_albedo));
+                    const __m128 w = _mm_mul_ps(kw, exp_negative(exponent));
+
+                    _mm_storeu_ps(&weight_sum[x], _mm_add_ps(_mm_loadu_ps(&weight_sum[x]), w));
+                    for (int c = 0; c < 3; ++c) {
+                        auto *sum = &value_sum.channel[c][x];
+                        _mm_storeu_ps(sum, _mm_add_ps(_mm_loadu_ps(sum), _mm_mul_ps(w, _mm_loadu_ps(&in.channel[c][q]))));
+                    }
+                }
+#endif
+
+                for (; x < x_end; ++x) {
+                    const auto p = row + x;
+                    const auto q = tap_row + x;
+                    const auto exponent = squared_distance(g.compressed, p, q) * g.inverse_color
+                                        + squared_distance(g.normal, p, q) * g.inverse_normal
+                                        + squared_distance(g.albedo, p, q) * g.inverse_albedo;
+                    const auto w = kernel_weight * std::exp(-exponent);
+
+                    weight_sum[x] += w;
+                    for (int c = 0; c < 3; ++c) {
+                        value_sum.channel[c][x] += w * in.channel[c][q];
+                    }
+                }
+            }
+        }
+
+        // The center tap always has a positive weight.
+        for (int x = 0; x < width; ++x) {
+            for (int c = 0; c < 3; ++c) {
+                out.channel[c][static_cast<size_t>(y) * width + x] = value_sum.channel[c][x] / weight_sum[x];
+            }
+        }
+    }
+}
+
+// Edge-avoiding a-trous wavelet filter (Dammertz et al. 2010) guided by the first
+// hit albedo and normal buffers. The albedo is divided out before filtering and
+// multiplied back afterwards, so texture detail isn't blurred with the noise.
+// fb must have the albedo and normal AOVs. Returns a copy of fb whose color sums
+// hold the filtered result.
+inline framebuffer denoise(const framebuffer &fb, const denoise_settings &settings, thread_pool &pool) {
+    using namespace denoise_detail;
+
+    const auto width = fb.width;
+    const auto height = fb.height;
+    const auto size = static_cast<size_t>(width) * height;
+
+    // Calls body(index) for every pixel, a row per task.
+    auto for_each_pixel = [&](auto &&body) {
+        pool.parallel_for(height, [&](size_t y) {
+            for (size_t index = y * width; index < (y + 1) * width; ++index) { body(index); }
+        });
+    };
+
+    rgb_planes illumination(size), albedo(size), normal(size);
+    for_each_pixel([&](size_t index) {
+        const auto scale = fb.samples[index] ? 1.0f / fb.samples[index] : 0.0f;
+        for (int c = 0; c < 3; ++c) {
+            albedo.channel[c][index] = fb.albedo[index*3 + c] * scale;
+            normal.channel[c][index] = fb.normal[index*3 + c] * scale;
+            illumination.channel[c][index] = fb.sum[index*3 + c] * scale / std::max(albedo.channel[c][index], min_albedo);
+        }
+    });
+
+    rgb_planes filtered(size), compressed(size);
+    for (int iteration = 0; iteration < settings.iterations; ++iteration) {
+        // Color distances are taken on x / (1 + x) so highlights don't dominate.
+        for_each_pixel([&](size_t index) {
+            for (int c = 0; c < 3; ++c) {
+                const auto value = illumination.channel[c][index];
+                compressed.channel[c][index] = value / (1.0f + value);
+            }
+        });
+
+        const auto sigma_color = settings.sigma_color / static_cast<float>(1 << iteration);
+        const guides g{compressed, normal, albedo,
+                       1.0f / (sigma_color * sigma_color),
+                       1.0f / (settings.sigma_normal * settings.sigma_normal),
+                       1.0f / (settings.sigma_albedo * settings.sigma_albedo)};
+
+        pool.parallel_for(height, [&](size_t y) {
+            filter_row(illumination, filtered, g, width, height, static_cast<int>(y), 1 << iteration);
+        });
+        std::swap(illumination, filtered);
+    }
+
+    framebuffer result = fb;
+    for_each_pixel([&](size_t index) {
+        for (int c = 0; c < 3; ++c) {
+            const auto value = illumination.channel[c][index] * std::max(albedo.channel[c][index], min_albedo);
+            result.sum[index*3 + c] = value * fb.samples[index];
+        }
+    });
+    return result;
+}
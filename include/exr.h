@@ -0,0 +1,163 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+
+// IEEE 754 binary32 to binary16 conversion with round to nearest even, used for
+// OpenEXR HALF channels.
+inline uint16_t float_to_half(float value) {
+    const auto bits = std::bit_cast<uint32_t>(value);
+    const uint16_t sign = (bits >> 16) & 0x8000;
+    const int exponent = static_cast<int>((bits >> 23) & 0xff) - 127 + 15;
+    uint32_t mantissa = bits & 0x7fffff;
+
+    if (((bits >> 23) & 0xff) == 0xff) {
+        // Infinity stays infinity, NaN keeps a non-zero mantissa.
+        return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+    }
+    if (exponent >= 0x1f) {
+        return sign | 0x7c00;
+    }
+    if (exponent <= 0) {
+        if (exponent < -10) { return sign; }
+        // Subnormal half: shift the mantissa, with its implicit bit, into place.
+        mantissa |= 0x800000;
+        const int shift = 14 - exponent;
+        uint32_t half_mantissa = mantissa >> shift;
+        const uint32_t remainder = mantissa & ((1u << shift) - 1);
+        const uint32_t halfway = 1u << (shift - 1);
+        if (remainder > halfway || (remainder == halfway && (half_mantissa & 1))) { ++half_mantissa; }
+        return sign | static_cast<uint16_t>(half_mantissa);
+    }
+
+    uint32_t half = (static_cast<uint32_t>(exponent) << 10) | (mantissa >> 13);
+    const uint32_t remainder = mantissa & 0x1fff;
+    if (remainder > 0x1000 || (remainder == 0x1000 && (half & 1))) {
+        ++half; // A carry into the exponent is still the correctly rounded value.
+    }
+    return sign | static_cast<uint16_t>(half);
+}
+
+enum class exr_pixel_type : int32_t {
+    uint32 = 0,
+    half = 1,
+    float32 = 2,
+};
+
+// One image plane, read as data[(y * width + x) * stride]. The data are floats,
+// or uint32_t for exr_pixel_type::uint32 channels.
+struct exr_channel {
+    std::string name;
+    const void *data;
+    int stride;
+    exr_pixel_type type = exr_pixel_type::half;
+};
+
+// Writes an uncompressed scanline OpenEXR file holding the given channels.
+inline void write_exr(const std::string &path, int width, int height, std::vector<exr_channel> channels) {
+    // The channel list must be sorted by name, and the pixel data follows that order.
+    std::sort(channels.begin(), channels.end(), [](const auto &a, const auto &b) { return a.name < b.name; });
+
+    std::vector<char> header;
+    auto put = [&header](const auto &value) {
+        const auto *bytes = reinterpret_cast<const char *>(&value);
+        header.insert(header.end(), bytes, bytes + sizeof(value));
+    };
+    auto put_string = [&header](const std::string &text) {
+        header.insert(header.end(), text.begin(), text.end());
+        header.push_back('\0');
+    };
+    auto attribute = [&](const std::string &name, const std::string &type, int32_t size) {
+        put_string(name);
+        put_string(type);
+        put(size);
+    };
+
+    put(int32_t(20000630)); // Magic number.
+    put(int32_t(2));        // Version 2, single part scanline file.
+
+    int32_t channel_list_size = 1;
+    for (const auto &channel : channels) {
+        channel_list_size += static_cast<int32_t>(channel.name.size()) + 1 + 16;
+    }
+    attribute("channels", "chlist", channel_list_size);
+    for (const auto &channel : channels) {
+        put_string(channel.name);
+        put(static_cast<int32_t>(channel.type));
+        put(int32_t(0));    // pLinear and reserved bytes.
+        put(int32_t(1));    // x sampling.
+        put(int32_t(1));    // y sampling.
+    }
+    header.push_back('\0');
+
+    attribute("compression", "compression", 1);
+    header.push_back(0);    // NO_COMPRESSION
+    const int32_t window[4] = {0, 0, width - 1, height - 1};
+    attribute("dataWindow", "box2i", 16);
+    put(window);
+    attribute("displayWindow", "box2i", 16);
+    put(window);
+    attribute("lineOrder", "lineOrder", 1);
+    header.push_back(0);    // INCREASING_Y
+    attribute("pixelAspectRatio", "float", 4);
+    put(1.0f);
+    attribute("screenWindowCenter", "v2f", 8);
+    put(0.0f);
+    put(0.0f);
+    attribute("screenWindowWidth", "float", 4);
+    put(1.0f);
+    header.push_back('\0');
+
+    size_t line_size = 0;
+    for (const auto &channel : channels) {
+        line_size += static_cast<size_t>(width) * (channel.type == exr_pixel_type::half ? 2 : 4);
+    }
+
+    // Every scanline is a block of its own: y, payload size and the channel rows.
+    const uint64_t first_block = header.size() + static_cast<uint64_t>(height) * sizeof(uint64_t);
+    for (int y = 0; y < height; ++y) {
+        put(first_block + static_cast<uint64_t>(y) * (8 + line_size));
+    }
+
+    const auto temp_path = path + ".tmp";
+    std::ofstream out(temp_path, std::ios::binary | std::ios::trunc);
+    out.write(header.data(), header.size());
+
+    std::vector<char> line(8 + line_size);
+    for (int y = 0; y < height; ++y) {
+        const int32_t block_header[2] = {y, static_cast<int32_t>(line_size)};
+        std::memcpy(line.data(), block_header, sizeof(block_header));
+
+        auto *cursor = line.data() + sizeof(block_header);
+        for (const auto &channel : channels) {
+            // Both value types are 4 bytes, so they share the addressing.
+            const auto *row = static_cast<const char *>(channel.data) + static_cast<size_t>(y) * width * channel.stride * 4;
+            for (int x = 0; x < width; ++x) {
+                const auto *value = row + static_cast<size_t>(x) * channel.stride * 4;
+                if (channel.type == exr_pixel_type::half) {
+                    float single;
+                    std::memcpy(&single, value, sizeof(single));
+                    const auto half = float_to_half(single);
+                    std::memcpy(cursor, &half, sizeof(half));
+                    cursor += sizeof(half);
+                } else {
+                    std::memcpy(cursor, value, 4);
+                    cursor += 4;
+                }
+            }
+        }
+        out.write(line.data(), line.size());
+    }
+
+    out.close();
+    if (!out || std::rename(temp_path.c_str(), path.c_str()) != 0) {
+        throw std::runtime_error("Unable to write the image: " + path);
+    }
+}
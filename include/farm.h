@@ -0,0 +1,299 @@
+#pragma once
+
+#include "checkpoint.h"
+#include "framebuffer.h"
+#include "renderer.h"
+#include "thread_pool.h"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <spawn.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char **environ;
+
+
+// A frame rendered by worker processes. The coordinator spawns `Raytracer worker`
+// children connected by a pipe each way, sends them a farm_job, then one tile at
+// a time. A worker answers every tile with a farm_result followed by the planes
+// of the tile's framebuffer, in the checkpoint order. A worker that dies or
+// breaks the protocol is replaced and its tile goes back to the queue.
+struct farm_job {
+    char magic[4] = {'R', 'T', 'F', 'J'};
+    uint32_t version = 3;
+    int32_t width = 0;
+    int32_t height = 0;
+    int32_t sample_per_pixel = 0;
+    int32_t max_depth = 0;
+    uint64_t seed = 0;
+    uint32_t aovs = 0;
+    uint32_t threads = 1;
+    camera_settings camera;
+};
+
+struct farm_result {
+    tile t;
+    double seconds;     // Render time of the tile inside the worker.
+};
+
+struct farm_settings {
+    unsigned workers = 4;
+    unsigned threads_per_worker = 1;
+    int tile_size = 64;
+    unsigned max_restarts = 8;  // Replacement workers before the render is abandoned.
+};
+
+struct farm_worker_stats {
+    int tiles = 0;
+    uint64_t pixels = 0;
+    double seconds = 0.0;
+    bool crashed = false;
+};
+
+namespace farm_detail {
+    inline bool write_all(int fd, const void *data, size_t size) {
+        const auto *bytes = static_cast<const char *>(data);
+        while (size > 0) {
+            const auto written = ::write(fd, bytes, size);
+            if (written < 0 && errno == EINTR) { continue; }
+            if (written <= 0) { return false; }
+            bytes += written;
+            size -= static_cast<size_t>(written);
+        }
+        return true;
+    }
+
+    inline bool read_all(int fd, void *data, size_t size) {
+        auto *bytes = static_cast<char *>(data);
+        while (size > 0) {
+            const auto read = ::read(fd, bytes, size);
+            if (read < 0 && errno == EINTR) { continue; }
+            if (read <= 0) { return false; }
+            bytes += read;
+            size -= static_cast<size_t>(read);
+        }
+        return true;
+    }
+
+    // Sends or receives every plane of fb, false when the other side is gone.
+    inline bool write_planes(int fd, const framebuffer &fb) {
+        bool ok = true;
+        checkpoint_detail::for_each_plane(fb, [&](const auto *data, size_t size) { ok = ok && write_all(fd, data, size); });
+        return ok;
+    }
+
+    inline bool read_planes(int fd, framebuffer &fb) {
+        bool ok = true;
+        checkpoint_detail::for_each_plane(fb, [&](auto *data, size_t size) { ok = ok && read_all(fd, data, size); });
+        return ok;
+    }
+
+    struct worker_process {
+        pid_t pid = -1;
+        int to_worker = -1;
+        int from_worker = -1;
+        std::optional<tile> current;
+        size_t stats_index = 0;
+    };
+
+    // Starts executable as `Raytracer worker <arguments>` with its stdin and stdout on pipes.
+    inline worker_process spawn_worker(const std::string &executable, const std::vector<std::string> &arguments) {
+        int to_worker[2], from_worker[2];
+        if (pipe2(to_worker, O_CLOEXEC) != 0) { throw std::runtime_error("Unable to create a worker pipe"); }
+        if (pipe2(from_worker, O_CLOEXEC) != 0) {
+            close(to_worker[0]);
+            close(to_worker[1]);
+            throw std::runtime_error("Unable to create a worker pipe");
+        }
+
+        posix_spawn_file_actions_t actions;
+        posix_spawn_file_actions_init(&actions);
+        posix_spawn_file_actions_adddup2(&actions, to_worker[0], STDIN_FILENO);
+        posix_spawn_file_actions_adddup2(&actions, from_worker[1], STDOUT_FILENO);
+
+        std::vector<char *> argv{const_cast<char *>("Raytracer"), const_cast<char *>("worker")};
+        for (const auto &argument : arguments) { argv.push_back(const_cast<char *>(argument.c_str())); }
+        argv.push_back(nullptr);
+        worker_process worker;
+        const auto error = posix_spawn(&worker.pid, executable.c_str(), &actions, nullptr, argv.data(), environ);
+        posix_spawn_file_actions_destroy(&actions);
+        close(to_worker[0]);
+        close(from_worker[1]);
+        if (error != 0) {
+            close(to_worker[1]);
+            close(from_worker[0]);
+            throw std::runtime_error("Unable to start a worker: " + std::string(std::strerror(error)));
+        }
+
+        worker.to_worker = to_worker[1];
+        worker.from_worker = from_worker[0];
+        return worker;
+    }
+
+    inline void stop_worker(worker_process &worker, bool kill_it) {
+        close(worker.to_worker);
+        close(worker.from_worker);
+        if (kill_it) { ::kill(worker.pid, SIGKILL); }
+        waitpid(worker.pid, nullptr, 0);
+        worker.pid = -1;
+    }
+}
+
+// Worker side: reads tiles from in_fd until it is closed, rendering each with
+// all the samples on the pool and answering on out_fd.
+inline void serve_tiles(const renderer &r, thread_pool &pool, aov_set aovs, int in_fd, int out_fd) {
+    using namespace farm_detail;
+    using clock = std::chrono::steady_clock;
+
+    tile t;
+    while (read_all(in_fd, &t, sizeof(t))) {
+        const auto start = clock::now();
+        framebuffer part(t.x1 - t.x0, t.y1 - t.y0, t.x0, t.y0, aovs);
+        r.render_pass(pool, part, 0, r.settings.sample_per_pixel);
+
+        const farm_result result{t, std::chrono::duration<double>(clock::now() - start).count()};
+        if (!write_all(out_fd, &result, sizeof(result)) || !write_planes(out_fd, part)) { return; }
+    }
+}
+
+inline farm_job read_farm_job(int fd) {
+    farm_job job;
+    const farm_job expected;
+    if (!farm_detail::read_all(fd, &job, sizeof(job)) || std::memcmp(job.magic, expected.magic, sizeof(job.magic)) != 0
+            || job.version != expected.version) {
+        throw std::runtime_error("The worker didn't receive a render job");
+    }
+    return job;
+}
+
+// Coordinator side: renders every pixel of fb with workers running executable,
+// started with the worker_arguments, and returns the statistics of each worker
+// process that took part, replaced ones included.
+inline std::vector<farm_worker_stats> render_farm(const std::string &executable, const std::vector<std::string> &worker_arguments,
+                                                  const farm_settings &farm, const render_settings &settings, framebuffer &fb) {
+    using namespace farm_detail;
+
+    // A dead worker must show up as a failed write, not kill the coordinator.
+    std::signal(SIGPIPE, SIG_IGN);
+
+    farm_job job;
+    job.width = settings.image_width;
+    job.height = settings.image_height;
+    job.sample_per_pixel = settings.sample_per_pixel;
+    job.max_depth = settings.max_depth;
+    job.seed = settings.seed;
+    job.camera = settings.camera;
+    job.aovs = fb.aovs.bits;
+    job.threads = farm.threads_per_worker;
+
+    const auto work = renderer::tiles(fb.origin_x, fb.origin_y, fb.width, fb.height, farm.tile_size);
+    std::deque<tile> queue(work.begin(), work.end());
+    std::vector<farm_worker_stats> stats;
+    std::vector<worker_process> workers;
+    unsigned restarts = 0;
+    size_t tiles_done = 0;
+
+    auto dispatch = [&](worker_process &worker) {
+        if (queue.empty()) { return true; }
+        worker.current = queue.front();
+        queue.pop_front();
+        return write_all(worker.to_worker, &*worker.current, sizeof(tile));
+    };
+    auto start_worker = [&] {
+        auto worker = spawn_worker(executable, worker_arguments);
+        worker.stats_index = stats.size();
+        stats.emplace_back();
+        workers.push_back(worker);
+        return write_all(worker.to_worker, &job, sizeof(job)) && dispatch(workers.back());
+    };
+    auto fail = [&](size_t index) {
+        auto &worker = workers[index];
+        if (worker.current) { queue.push_front(*worker.current); }
+        stats[worker.stats_index].crashed = true;
+        stop_worker(worker, true);
+        workers.erase(workers.begin() + static_cast<std::ptrdiff_t>(index));
+    };
+
+    try {
+        for (unsigned i = 0; i < std::max(1u, farm.workers); ++i) {
+            if (!start_worker()) { fail(workers.size() - 1); }
+        }
+
+        while (tiles_done < work.size()) {
+            // Crashed workers are replaced while tiles remain for them.
+            while (workers.size() < std::max(1u, farm.workers) && !queue.empty()) {
+                if (restarts++ >= farm.max_restarts) {
+                    if (!workers.empty()) { break; }
+                    throw std::runtime_error("The render farm lost too many workers");
+                }
+                if (!start_worker()) { fail(workers.size() - 1); }
+            }
+
+            // A worker that found the queue empty takes the tiles of failed ones.
+            for (size_t i = workers.size(); i-- > 0;) {
+                if (!workers[i].current && !queue.empty() && !dispatch(workers[i])) { fail(i); }
+            }
+            if (std::ranges::none_of(workers, [](const auto &worker) { return worker.current.has_value(); })) {
+                throw std::runtime_error("The render farm lost too many workers");
+            }
+
+            std::vector<pollfd> fds;
+            for (const auto &worker : workers) { fds.push_back({worker.from_worker, POLLIN, 0}); }
+            if (poll(fds.data(), fds.size(), -1) < 0) {
+                if (errno == EINTR) { continue; }
+                throw std::runtime_error("Unable to wait for the workers");
+            }
+
+            // Backwards, so a failed worker can be removed without skipping one.
+            for (size_t i = fds.size(); i-- > 0;) {
+                if (!fds[i].revents) { continue; }
+                auto &worker = workers[i];
+
+                farm_result result;
+                if (!read_all(worker.from_worker, &result, sizeof(result)) || !worker.current
+                        || result.t.x0 != worker.current->x0 || result.t.y0 != worker.current->y0
+                        || result.t.x1 != worker.current->x1 || result.t.y1 != worker.current->y1) {
+                    fail(i);
+                    continue;
+                }
+                framebuffer part(result.t.x1 - result.t.x0, result.t.y1 - result.t.y0, result.t.x0, result.t.y0, fb.aovs);
+                if (!read_planes(worker.from_worker, part)) {
+                    fail(i);
+                    continue;
+                }
+
+                fb.blit(part);
+                auto &worker_stats = stats[worker.stats_index];
+                ++worker_stats.tiles;
+                worker_stats.pixels += static_cast<uint64_t>(part.width) * part.height;
+                worker_stats.seconds += result.seconds;
+                worker.current.reset();
+                ++tiles_done;
+                std::cout << "\rTiles: " << tiles_done << '/' << work.size() << std::flush;
+
+                if (!dispatch(worker)) { fail(i); }
+            }
+        }
+    } catch (...) {
+        for (auto &worker : workers) { stop_worker(worker, true); }
+        throw;
+    }
+
+    // Closing its input lets a worker exit on its own.
+    for (auto &worker : workers) { stop_worker(worker, false); }
+    return stats;
+}
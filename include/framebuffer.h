@@ -0,0 +1,178 @@
+#pragma once
+
+#include "aov.h"
+#include "color.h"
+#include "rtweekend.h"
+#include "thread_pool.h"
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+
+// What the samples of one pixel add to the AOV planes: albedo and normal are
+// sums, depth and the ids are the ones of the closest hit.
+struct pixel_aovs {
+    color albedo;
+    vec3 normal;
+    float depth = std::numeric_limits<float>::infinity();
+    uint32_t material_id = 0;
+    uint32_t object_id = 0;
+    float seconds = 0.0f;
+};
+
+// Floating-point accumulation buffer. Every pixel keeps the running sum of its
+// samples and how many were taken, so it can be resolved at any point of a
+// progressive render. Rows are stored top to bottom. A framebuffer may cover a
+// part of the image only, (origin_x, origin_y) is then its top left pixel.
+// The planes of the requested AOVs are only allocated when needed: albedo and
+// normal are sums like the color, depth and the ids keep the closest hit.
+class framebuffer {
+    public:
+        framebuffer() {}
+        framebuffer(int width, int height, int origin_x = 0, int origin_y = 0, aov_set aovs = {})
+            : width(width), height(height), origin_x(origin_x), origin_y(origin_y), aovs(aovs),
+              sum(static_cast<size_t>(width) * height * 3, 0.0f),
+              samples(static_cast<size_t>(width) * height, 0) {
+            const auto size = samples.size();
+            if (aovs.has(aov::albedo)) { albedo.assign(size * 3, 0.0f); }
+            if (aovs.has(aov::normal)) { normal.assign(size * 3, 0.0f); }
+            if (aovs.has(aov::depth) || aovs.has(aov::material_id) || aovs.has(aov::object_id)) {
+                depth.assign(size, std::numeric_limits<float>::infinity());
+            }
+            if (aovs.has(aov::material_id)) { material_id.assign(size, 0); }
+            if (aovs.has(aov::object_id)) { object_id.assign(size, 0); }
+            if (aovs.has(aov::time)) { render_time.assign(size, 0.0f); }
+        }
+
+        // Whether the renderer has to follow the first hits of the samples.
+        bool tracks_hits() const { return !albedo.empty() || !normal.empty() || !depth.empty(); }
+
+        size_t pixel_index(int x, int y) const {
+            return static_cast<size_t>(y) * width + x;
+        }
+
+        // Adds to the pixel at (x, y) in image coordinates.
+        void accumulate(int x, int y, const color &sample_sum, uint32_t sample_count) {
+            const auto index = pixel_index(x - origin_x, y - origin_y);
+            sum[index*3    ] += static_cast<float>(sample_sum.x);
+            sum[index*3 + 1] += static_cast<float>(sample_sum.y);
+            sum[index*3 + 2] += static_cast<float>(sample_sum.z);
+            samples[index] += sample_count;
+        }
+
+        // Adds to the AOV planes of the pixel at (x, y) in image coordinates. Only
+        // a strictly closer hit replaces the stored depth and ids, so the result
+        // doesn't depend on how the samples were split into passes.
+        void accumulate_aovs(int x, int y, const pixel_aovs &p) {
+            const auto index = pixel_index(x - origin_x, y - origin_y);
+            if (!albedo.empty()) {
+                albedo[index*3    ] += static_cast<float>(p.albedo.x);
+                albedo[index*3 + 1] += static_cast<float>(p.albedo.y);
+                albedo[index*3 + 2] += static_cast<float>(p.albedo.z);
+            }
+            if (!normal.empty()) {
+                normal[index*3    ] += static_cast<float>(p.normal.x);
+                normal[index*3 + 1] += static_cast<float>(p.normal.y);
+                normal[index*3 + 2] += static_cast<float>(p.normal.z);
+            }
+            if (!depth.empty() && p.depth < depth[index]) {
+                depth[index] = p.depth;
+                if (!material_id.empty()) { material_id[index] = p.material_id; }
+                if (!object_id.empty()) { object_id[index] = p.object_id; }
+            }
+            if (!render_time.empty()) { render_time[index] += p.seconds; }
+        }
+
+        // Per-sample average of a summed plane of the given number of components.
+        std::vector<float> average(const std::vector<float> &plane, int components) const {
+            std::vector<float> result(plane.size());
+            for (size_t index = 0; index < samples.size(); ++index) {
+                const auto scale = samples[index] ? 1.0f / samples[index] : 0.0f;
+                for (int c = 0; c < components; ++c) {
+                    result[index*components + c] = plane[index*components + c] * scale;
+                }
+            }
+            return result;
+        }
+
+        // Copies every plane of part, a framebuffer with the same AOVs, into the
+        // pixels it covers, which must lie inside this one.
+        void blit(const framebuffer &part) {
+            auto copy = [&](auto &plane, const auto &part_plane, int components) {
+                if (plane.empty()) { return; }
+                for (int y = 0; y < part.height; ++y) {
+                    const auto from = part_plane.begin() + part.pixel_index(0, y) * components;
+                    std::copy(from, from + static_cast<size_t>(part.width) * components,
+                              plane.begin() + pixel_index(part.origin_x - origin_x, part.origin_y - origin_y + y) * components);
+                }
+            };
+            copy(sum, part.sum, 3);
+            copy(samples, part.samples, 1);
+            copy(albedo, part.albedo, 3);
+            copy(normal, part.normal, 3);
+            copy(depth, part.depth, 1);
+            copy(material_id, part.material_id, 1);
+            copy(object_id, part.object_id, 1);
+            copy(render_time, part.render_time, 1);
+        }
+
+        // Writes the linear average of the pixels in rows [first_row, last_row) to out, RGB interleaved.
+        void resolve_rows(int first_row, int last_row, float *out) const {
+            const auto first = pixel_index(0, first_row);
+            for (size_t index = first; index < pixel_index(0, last_row); ++index) {
+                const auto scale = samples[index] ? 1.0f / samples[index] : 0.0f;
+                *out++ = sum[index*3    ] * scale;
+                *out++ = sum[index*3 + 1] * scale;
+                *out++ = sum[index*3 + 2] * scale;
+            }
+        }
+
+        std::vector<float> to_linear() const {
+            std::vector<float> linear(sum.size());
+            resolve_rows(0, height, linear.data());
+            return linear;
+        }
+
+        // Tone mapped and quantized RGB samples of the rows [first_row, last_row),
+        // all rows by default, converted in parallel bands when a pool is given.
+        std::vector<uint8_t> to_display(const tonemap_settings &tonemap, int first_row = 0, int last_row = -1,
+                                        thread_pool *pool = nullptr) const {
+            constexpr int band_rows = 16;
+            if (last_row < 0) { last_row = height; }
+
+            const auto row_samples = static_cast<size_t>(width) * 3;
+            std::vector<uint8_t> display(row_samples * (last_row - first_row) * tonemap.bytes_per_sample());
+
+            const auto band_count = static_cast<size_t>((last_row - first_row + band_rows - 1) / band_rows);
+            auto convert = [&](size_t band) {
+                const auto y0 = first_row + static_cast<int>(band) * band_rows;
+                const auto y1 = std::min(y0 + band_rows, last_row);
+                std::vector<float> linear(row_samples * (y1 - y0));
+                resolve_rows(y0, y1, linear.data());
+                encode_display(linear.data(), linear.size(), tonemap, display.data() + row_samples * (y0 - first_row) * tonemap.bytes_per_sample());
+            };
+
+            if (pool) {
+                pool->parallel_for(band_count, convert);
+            } else {
+                for (size_t band = 0; band < band_count; ++band) { convert(band); }
+            }
+            return display;
+        }
+
+    public:
+        int width = 0;
+        int height = 0;
+        int origin_x = 0;
+        int origin_y = 0;
+        aov_set aovs;
+        std::vector<float> sum;
+        std::vector<uint32_t> samples;
+        std::vector<float> albedo;
+        std::vector<float> normal;
+        std::vector<float> depth;
+        std::vector<uint32_t> material_id;
+        std::vector<uint32_t> object_id;
+        std::vector<float> render_time;
+};
@@ -2,16 +2,24 @@
 
 struct hit_record;
 
+#include "aabb.h"
 #include "material.h"
 #include "rtweekend.h"
+#include <cstdint>
 
 
 struct hit_record {
     point3 p;
     vec3 normal;
-    std::shared_ptr<material> material;
+    const material *material; // Non-owning, the hit object keeps it alive.
     double t;
+    uint32_t object_id;
     bool is_front_face;
+    // Texture coordinates, set for textured materials only, with the texture
+    // coordinate units per unit of length around p.
+    double u, v;
+    double uv_scale;
+    double footprint;           // Width of the ray footprint at p, in texture coordinate units.
 
     inline void set_face_normal(const ray &r, const vec3 &outward_normal) {
         is_front_face = dot(r.direction, outward_normal) < 0.0;
@@ -24,4 +32,10 @@ class hittable {
         virtual ~hittable() = default;
         
         virtual bool hit(const ray &r, double t_min, double t_max, hit_record &rec) const = 0;
+
+        // Box around every point the object can be hit at, for the hierarchies.
+        virtual aabb bounds() const = 0;
+
+    public:
+        uint32_t object_id = 0;     // Numbered by the scene, from 1.
 };
\ No newline at end of file
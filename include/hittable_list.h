@@ -18,6 +18,12 @@ class hittable_list : public hittable {
 
         bool hit(const ray &r, double t_min, double t_max, hit_record &rec) const override;
 
+        aabb bounds() const override {
+            aabb box;
+            for (const auto &object : objects) { box.grow(object->bounds()); }
+            return box;
+        }
+
     public:
         std::vector<shared_ptr<hittable>> objects;
 };
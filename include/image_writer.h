@@ -0,0 +1,325 @@
+#pragma once
+
+#include "aov.h"
+#include "exr.h"
+#include "framebuffer.h"
+#include "png.h"
+#include "stb/stb_image_write.h"
+#include "thread_pool.h"
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <exception>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+
+// Tone mapped PNG, converted and encoded in parallel when a pool is given.
+inline void write_png(const std::string &path, const framebuffer &fb, const tonemap_settings &tonemap, thread_pool *pool = nullptr) {
+    const auto pixels = fb.to_display(tonemap, 0, fb.height, pool);
+
+    png_stream_writer png(path, fb.width, fb.height, tonemap.bit_depth);
+    png.write_rows(pixels.data(), fb.height, pool);
+    png.finish();
+}
+
+// Encodes the PNG strips of a framebuffer as soon as their rows are final, in
+// whatever order that happens, so that during the last pass of a render the
+// encoding overlaps with the tiles that are still rendering.
+class png_band_encoder {
+    public:
+        png_band_encoder(const framebuffer &fb, const tonemap_settings &tonemap) : fb(fb), tonemap(tonemap) { }
+
+        // Thread safe. The image rows [y0, y1) of fb must not change anymore.
+        void encode(int y0, int y1) {
+            y0 -= fb.origin_y;
+            y1 -= fb.origin_y;
+            const auto start = std::chrono::steady_clock::now();
+            const auto pixels = fb.to_display(tonemap, y0, y1);
+            auto strip = encode_png_strip(pixels.data(), y1 - y0, fb.width, tonemap.bit_depth);
+            const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+            std::lock_guard lock(mutex);
+            strips.emplace(y0, std::move(strip));
+            rows_encoded += y1 - y0;
+            encode_seconds += elapsed.count();
+        }
+
+        bool complete() const { return rows_encoded == fb.height; }
+
+        // Summed encode time of all the strips, across threads.
+        double seconds() const { return encode_seconds; }
+
+        void write(const std::string &path) const {
+            std::vector<png_strip> ordered;
+            for (const auto &[y, strip] : strips) { ordered.push_back(strip); }
+
+            png_stream_writer png(path, fb.width, fb.height, tonemap.bit_depth);
+            png.write_strips(ordered);
+            png.finish();
+        }
+
+    private:
+        const framebuffer &fb;
+        tonemap_settings tonemap;
+        std::map<int, png_strip> strips;
+        std::mutex mutex;
+        int rows_encoded = 0;
+        double encode_seconds = 0.0;
+};
+
+// Portable float map: little-endian float RGB, scanlines from the bottom up.
+inline void write_pfm(const std::string &path, const framebuffer &fb) {
+    const auto linear = fb.to_linear();
+
+    const auto temp_path = path + ".tmp";
+    {
+        std::ofstream out(temp_path, std::ios::binary | std::ios::trunc);
+        out << "PF\n" << fb.width << ' ' << fb.height << "\n-1.0\n";
+        for (int y = fb.height - 1; y >= 0; --y) {
+            out.write(reinterpret_cast<const char *>(&linear[fb.pixel_index(0, y) * 3]), static_cast<std::streamsize>(fb.width) * 3 * sizeof(float));
+        }
+        if (!out) { throw std::runtime_error("Unable to write the image: " + temp_path); }
+    }
+    if (std::rename(temp_path.c_str(), path.c_str()) != 0) {
+        throw std::runtime_error("Unable to write the image: " + path);
+    }
+}
+
+// Radiance RGBE image.
+inline void write_hdr(const std::string &path, const framebuffer &fb) {
+    constexpr int channels = 3;
+    const auto linear = fb.to_linear();
+
+    const auto temp_path = path + ".tmp";
+    if (!stbi_write_hdr(temp_path.c_str(), fb.width, fb.height, channels, linear.data())
+            || std::rename(temp_path.c_str(), path.c_str()) != 0) {
+        throw std::runtime_error("Unable to write the image: " + path);
+    }
+}
+
+// OpenEXR with linear half float R, G and B channels, and a layer for each of
+// the given AOVs that fb has.
+inline void write_exr(const std::string &path, const framebuffer &fb, aov_set aovs = {}) {
+    const auto linear = fb.to_linear();
+    std::vector<exr_channel> channels{
+        {"R", linear.data(), 3},
+        {"G", linear.data() + 1, 3},
+        {"B", linear.data() + 2, 3},
+    };
+
+    std::vector<float> albedo, normal;
+    if (aovs.has(aov::albedo) && !fb.albedo.empty()) {
+        albedo = fb.average(fb.albedo, 3);
+        channels.push_back({"albedo.R", albedo.data(), 3});
+        channels.push_back({"albedo.G", albedo.data() + 1, 3});
+        channels.push_back({"albedo.B", albedo.data() + 2, 3});
+    }
+    if (aovs.has(aov::normal) && !fb.normal.empty()) {
+        normal = fb.average(fb.normal, 3);
+        channels.push_back({"normal.X", normal.data(), 3});
+        channels.push_back({"normal.Y", normal.data() + 1, 3});
+        channels.push_back({"normal.Z", normal.data() + 2, 3});
+    }
+    if (aovs.has(aov::depth) && !fb.depth.empty()) {
+        channels.push_back({"depth.Z", fb.depth.data(), 1, exr_pixel_type::float32});
+    }
+    if (aovs.has(aov::material_id) && !fb.material_id.empty()) {
+        channels.push_back({"material_id", fb.material_id.data(), 1, exr_pixel_type::uint32});
+    }
+    if (aovs.has(aov::object_id) && !fb.object_id.empty()) {
+        channels.push_back({"object_id", fb.object_id.data(), 1, exr_pixel_type::uint32});
+    }
+    if (aovs.has(aov::sample_count)) {
+        channels.push_back({"samples", fb.samples.data(), 1, exr_pixel_type::uint32});
+    }
+    if (aovs.has(aov::time) && !fb.render_time.empty()) {
+        channels.push_back({"time", fb.render_time.data(), 1, exr_pixel_type::float32});
+    }
+
+    write_exr(path, fb.width, fb.height, std::move(channels));
+}
+
+inline std::string file_extension(const std::string &path) {
+    const auto dot = path.find_last_of('.');
+    const auto slash = path.find_last_of('/');
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) { return ""; }
+
+    auto extension = path.substr(dot + 1);
+    std::transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char c) { return std::tolower(c); });
+    return extension;
+}
+
+inline bool is_supported_image(const std::string &path) {
+    const auto extension = file_extension(path);
+    return extension == "png" || extension == "pfm" || extension == "hdr" || extension == "exr";
+}
+
+// Picks the format from the file extension. PNG is tone mapped, the other
+// formats keep the linear floating-point radiance. Only OpenEXR holds the AOVs.
+inline void write_image(const std::string &path, const framebuffer &fb, const tonemap_settings &tonemap, thread_pool *pool = nullptr,
+                        aov_set aovs = {}) {
+    const auto extension = file_extension(path);
+    if (extension == "png") { write_png(path, fb, tonemap, pool); }
+    else if (extension == "pfm") { write_pfm(path, fb); }
+    else if (extension == "hdr") { write_hdr(path, fb); }
+    else if (extension == "exr") { write_exr(path, fb, aovs); }
+    else { throw std::runtime_error("Unsupported image format: " + path); }
+}
+
+// Writes framebuffer snapshots on a background thread, so the render workers only
+// pay for the copy. If the writer falls behind, a snapshot that is still waiting
+// is replaced by the newer one.
+class preview_writer {
+    public:
+        explicit preview_writer(const tonemap_settings &tonemap) : tonemap(tonemap), thread([this] { run(); }) { }
+
+        ~preview_writer() {
+            {
+                std::lock_guard lock(mutex);
+                stopping = true;
+            }
+            wake.notify_one();
+            thread.join();
+        }
+
+        preview_writer(const preview_writer &) = delete;
+        preview_writer &operator = (const preview_writer &) = delete;
+
+        void post(framebuffer snapshot, std::string path) {
+            {
+                std::lock_guard lock(mutex);
+                pending.emplace(std::move(snapshot), std::move(path));
+            }
+            wake.notify_one();
+        }
+
+    private:
+        void run() {
+            while (true) {
+                std::pair<framebuffer, std::string> job;
+                {
+                    std::unique_lock lock(mutex);
+                    wake.wait(lock, [this] { return stopping || pending; });
+                    if (!pending) { return; }
+                    job = std::move(*pending);
+                    pending.reset();
+                }
+
+                try {
+                    write_png(job.second, job.first, tonemap);
+                } catch (const std::exception &e) {
+                    std::cerr << '\n' << e.what() << '\n';
+                }
+            }
+        }
+
+    private:
+        tonemap_settings tonemap;
+        std::optional<std::pair<framebuffer, std::string>> pending;
+        std::mutex mutex;
+        std::condition_variable wake;
+        bool stopping = false;
+        std::thread thread;
+};
+
+// Writes the frames of a sequence on a background thread while the next frame
+// renders. One frame may wait behind the one being written, posting another
+// blocks until it is taken, so at most two frames are held. A failed write is
+// raised by the next post or by finish.
+class frame_writer {
+    public:
+        frame_writer(const tonemap_settings &tonemap, aov_set aovs) : tonemap(tonemap), aovs(aovs), thread([this] { run(); }) { }
+
+        ~frame_writer() {
+            {
+                std::lock_guard lock(mutex);
+                stopping = true;
+            }
+            wake.notify_all();
+            thread.join();
+        }
+
+        frame_writer(const frame_writer &) = delete;
+        frame_writer &operator = (const frame_writer &) = delete;
+
+        // Returns the seconds spent waiting for the writer.
+        double post(framebuffer frame, std::vector<std::string> paths) {
+            const auto start = std::chrono::steady_clock::now();
+            std::unique_lock lock(mutex);
+            wake.wait(lock, [this] { return !pending || error; });
+            rethrow();
+            pending.emplace(std::move(frame), std::move(paths));
+            wake.notify_all();
+            return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        }
+
+        // Waits until every posted frame is written.
+        void finish() {
+            std::unique_lock lock(mutex);
+            wake.wait(lock, [this] { return (!pending && !writing) || error; });
+            rethrow();
+        }
+
+        // Total encode and write time of the frames written so far.
+        double seconds() const {
+            std::lock_guard lock(mutex);
+            return write_seconds;
+        }
+
+    private:
+        void run() {
+            while (true) {
+                std::pair<framebuffer, std::vector<std::string>> job;
+                {
+                    std::unique_lock lock(mutex);
+                    wake.wait(lock, [this] { return stopping || pending; });
+                    if (!pending) { return; }
+                    job = std::move(*pending);
+                    pending.reset();
+                    writing = true;
+                }
+                wake.notify_all();
+
+                const auto start = std::chrono::steady_clock::now();
+                std::exception_ptr failure;
+                try {
+                    for (const auto &path : job.second) { write_image(path, job.first, tonemap, nullptr, aovs); }
+                } catch (...) {
+                    failure = std::current_exception();
+                }
+                {
+                    std::lock_guard lock(mutex);
+                    write_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                    writing = false;
+                    if (failure && !error) { error = failure; }
+                }
+                wake.notify_all();
+            }
+        }
+
+        void rethrow() {
+            if (error) { std::rethrow_exception(std::exchange(error, nullptr)); }
+        }
+
+    private:
+        tonemap_settings tonemap;
+        aov_set aovs;
+        std::optional<std::pair<framebuffer, std::vector<std::string>>> pending;
+        bool writing = false;
+        double write_seconds = 0.0;
+        std::exception_ptr error;
+        mutable std::mutex mutex;
+        std::condition_variable wake;
+        bool stopping = false;
+        std::thread thread;
+};
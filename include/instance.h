@@ -0,0 +1,111 @@
+#pragma once
+
+#include "aabb.h"
+#include "bvh.h"
+#include "bvh_refit.h"
+#include "hittable.h"
+#include "transform.h"
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+
+// A placement of shared geometry. Rays are moved into the space of the object
+// instead of copying the object, so an instance costs its transforms only. The
+// placement is that at time 0, the instance moves by motion during the frame.
+class instance : public hittable {
+    public:
+        instance(std::shared_ptr<const hittable> object, const transform &to_world, const vec3 &motion = vec3(0.0))
+            : object(std::move(object)), to_world(to_world), to_object(to_world.inverse()), motion(motion) { }
+
+        void set_transform(const transform &t, const vec3 &motion = vec3(0.0)) {
+            to_world = t;
+            to_object = t.inverse();
+            this->motion = motion;
+        }
+
+        bool moves() const { return motion.length_squared() > 0.0; }
+
+        aabb bounds_at(double time) const { return (transform::translation(time * motion) * to_world).apply(object->bounds()); }
+
+        virtual aabb bounds() const override {
+            auto box = bounds_at(0.0);
+            if (moves()) { box.grow(bounds_at(1.0)); }
+            return box;
+        }
+
+        virtual bool hit(const ray &r, double t_min, double t_max, hit_record &rec) const override {
+            // The object space ray is normalized again, which scales its distances.
+            const auto direction = to_object.apply_vector(r.direction);
+            const auto scale = direction.length();
+            const ray object_ray(to_object.apply_point(r.origin - r.time * motion), direction / scale, r.time);
+            if (!object->hit(object_ray, t_min * scale, t_max * scale, rec)) { return false; }
+
+            rec.t /= scale;
+            rec.uv_scale *= scale;
+            rec.p = r.at(rec.t);
+            rec.normal = normalized(to_object.apply_normal_of_inverse(rec.normal));
+            rec.object_id = object_id;
+            return true;
+        }
+
+    private:
+        std::shared_ptr<const hittable> object;
+        transform to_world;
+        transform to_object;
+        vec3 motion;
+};
+
+// Top level of a two-level hierarchy: a BVH over instances, each holding the
+// bottom-level hierarchy of its object. Moving instances only needs the top
+// level to be updated, which only looks at one box per instance.
+class instance_list : public hittable {
+    public:
+        void add(instance placed) { instances.push_back(std::move(placed)); }
+
+        size_t size() const { return instances.size(); }
+        instance &operator[](size_t i) { return instances[i]; }
+        const bvh &hierarchy() const { return tlas.hierarchy(); }
+
+        // One of them must follow additions and moves before the next hit.
+        void rebuild() { tlas.rebuild(instance_bounds(0.0), end_bounds()); }
+
+        // Refits the hierarchy to moved instances, see dynamic_bvh. True when it
+        // had to be rebuilt, which additions always need.
+        bool update(thread_pool &pool) { return tlas.update(instance_bounds(0.0), pool, end_bounds()); }
+
+        virtual aabb bounds() const override { return tlas.hierarchy().bounds(); }
+
+        virtual bool hit(const ray &r, double t_min, double t_max, hit_record &rec) const override {
+            const auto &tree = tlas.hierarchy();
+            bool hit_anything = false;
+            auto closest_t = t_max;
+            traverse_bvh(tree, box_ray(r), static_cast<float>(t_min), closest_t, [&](const bvh_node &leaf) {
+                for (uint32_t i = leaf.first; i < leaf.first + leaf.count; ++i) {
+                    if (instances[tree.indices[i]].hit(r, t_min, closest_t, rec)) {
+                        hit_anything = true;
+                        closest_t = rec.t;
+                    }
+                }
+            });
+            return hit_anything;
+        }
+
+    private:
+        std::vector<aabb> instance_bounds(double time) const {
+            std::vector<aabb> boxes(instances.size());
+            for (size_t i = 0; i < boxes.size(); ++i) { boxes[i] = instances[i].bounds_at(time); }
+            return boxes;
+        }
+
+        // Bounds at time 1 when some instance moves, for a motion hierarchy.
+        std::vector<aabb> end_bounds() const {
+            if (std::ranges::none_of(instances, [](const instance &i) { return i.moves(); })) { return {}; }
+            return instance_bounds(1.0);
+        }
+
+    private:
+        std::vector<instance> instances;
+        dynamic_bvh tlas;
+};
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+// Read-only memory mapping of a whole file. Pages are read from the file on
+// first access, nothing is copied up front.
+class mapped_file {
+    public:
+        explicit mapped_file(const std::string &path) {
+            const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0) { throw std::runtime_error("Unable to open " + path + ": " + std::strerror(errno)); }
+
+            struct stat status;
+            if (fstat(fd, &status) != 0) {
+                ::close(fd);
+                throw std::runtime_error("Unable to read " + path + ": " + std::strerror(errno));
+            }
+            length = static_cast<size_t>(status.st_size);
+            if (length > 0) {
+                address = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+            }
+            ::close(fd);
+            if (address == MAP_FAILED) {
+                address = nullptr;
+                throw std::runtime_error("Unable to map " + path + ": " + std::strerror(errno));
+            }
+        }
+
+        mapped_file(const mapped_file &) = delete;
+        mapped_file &operator=(const mapped_file &) = delete;
+
+        ~mapped_file() {
+            if (address) { munmap(address, length); }
+        }
+
+        const std::byte *data() const { return static_cast<const std::byte *>(address); }
+        size_t size() const { return length; }
+
+    private:
+        void *address = nullptr;
+        size_t length = 0;
+};
@@ -4,10 +4,22 @@ class material;
 
 #include "hittable.h"
 #include "rtweekend.h"
+#include <cstdint>
 
 class material {
     public:
         virtual ~material() = default;
         virtual bool scatter(const ray &r_in, const hit_record &rec, color &attenuation, ray &scattered) const = 0;
+
+        // Surface color for the denoiser's albedo guide.
+        virtual color base_color(const hit_record &) const { return color(1.0); }
+
+        // Mirror-like surfaces don't make good denoiser guides, the ones seen
+        // through them are used instead.
+        virtual bool is_specular() const { return false; }
+
+    public:
+        uint32_t material_id = 0;   // Numbered by the scene, from 1.
+        bool textured = false;      // Its hits need texture coordinates.
 };
 
@@ -3,17 +3,16 @@
 #include "rtweekend.h"
 #include "material.h"
 #include "hittable.h"
+#include "texture.h"
 #include <cmath>
 
 
 class lambertian : public material {
     public:
         lambertian(const color &a) : albedo(a) { }
+        lambertian(std::shared_ptr<const texture> t) : albedo(1.0), tex(std::move(t)) { textured = true; }
         virtual ~lambertian() = default;
 
-        #pragma clang diagnostic push
-        #pragma clang diagnostic ignored "-Wunused-parameter"
-
         virtual bool scatter(const ray &r_in, const hit_record &rec, color &attenuation, ray &scattered) const override {
             auto scatter_direction = random_in_hemisphere(rec.normal);
 
@@ -21,32 +20,38 @@ class lambertian : public material {
                 scatter_direction = rec.normal;
             }
 
-            scattered = ray(rec.p, scatter_direction);
-            attenuation = albedo;
+            scattered = ray(rec.p, scatter_direction, r_in.time);
+            attenuation = tex ? tex->value(rec) : albedo;
             return true;
         }
 
-        #pragma clang diagnostic pop
+        virtual color base_color(const hit_record &rec) const override { return tex ? tex->value(rec) : albedo; }
 
     public:
         color albedo;
+        std::shared_ptr<const texture> tex;     // Replaces the albedo when set.
 };
 
 class metal : public material {
     public: 
         metal(const color &a, const double f) : albedo(a), fuzz(f < 1.0 ? f : 1.0) { }
+        metal(std::shared_ptr<const texture> t, const double f) : albedo(1.0), fuzz(f < 1.0 ? f : 1.0), tex(std::move(t)) { textured = true; }
         virtual ~metal() = default;
 
         virtual bool scatter(const ray &r_in, const hit_record &rec, color &attenuation, ray &scattered) const override {
             auto reflected = reflect(r_in.direction, rec.normal);
-            scattered = ray(rec.p, reflected + fuzz*random_in_unit_sphere());
-            attenuation = albedo;
+            scattered = ray(rec.p, reflected + fuzz*random_in_unit_sphere(), r_in.time);
+            attenuation = tex ? tex->value(rec) : albedo;
             return dot(scattered.direction, rec.normal) > 0.0;
         }
+
+        virtual color base_color(const hit_record &rec) const override { return tex ? tex->value(rec) : albedo; }
+        virtual bool is_specular() const override { return true; }
         
     public:
         color albedo;
         double fuzz;
+        std::shared_ptr<const texture> tex;
 };
 
 class dielectric : public material {
@@ -70,9 +75,11 @@ class dielectric : public material {
                 direction = refract(r_in.direction, rec.normal, refraction_ratio);
             }
 
-            scattered = ray(rec.p, direction);
+            scattered = ray(rec.p, direction, r_in.time);
             return true;
         }
+
+        virtual bool is_specular() const override { return true; }
     
     private: 
         constexpr static double reflectance(const double cosine, const double ref_idx) {
@@ -84,4 +91,23 @@ class dielectric : public material {
         
     public:
         double ir; // Index of Refraction
+};
+
+// Phase function of participating media, which scatters light into every
+// direction alike.
+class isotropic : public material {
+    public:
+        isotropic(const color &a) : albedo(a) { }
+        virtual ~isotropic() = default;
+
+        virtual bool scatter(const ray &r_in, const hit_record &rec, color &attenuation, ray &scattered) const override {
+            scattered = ray(rec.p, random_unit_vector(), r_in.time);
+            attenuation = albedo;
+            return true;
+        }
+
+        virtual color base_color(const hit_record &) const override { return albedo; }
+
+    public:
+        color albedo;
 };
\ No newline at end of file
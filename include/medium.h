@@ -0,0 +1,225 @@
+#pragma once
+
+#include "aabb.h"
+#include "hittable.h"
+#include "material.h"
+#include "noise.h"
+#include "rtweekend.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+
+// Density of a heterogeneous medium, sampled on the nodes of a regular grid
+// over a box and interpolated trilinearly between them. Delta tracking steps
+// through the coarser majorant grid, the largest density each block of cells
+// can take.
+class density_grid {
+    public:
+        static constexpr int block = 8;     // Cells per side of a majorant block.
+
+        // Samples of nx * ny * nz nodes, x varying fastest, the corner nodes on the corners of the box.
+        density_grid(const point3 &lo, const point3 &hi, int nx, int ny, int nz, std::vector<float> samples)
+            : lo(lo), hi(hi), nodes{nx, ny, nz}, samples(std::move(samples)) {
+            if (nx < 2 || ny < 2 || nz < 2 || this->samples.size() != static_cast<size_t>(nx) * ny * nz) {
+                throw std::runtime_error("A density grid needs at least 2 nodes per side and one sample per node");
+            }
+            const double extent[3] = {hi.x - lo.x, hi.y - lo.y, hi.z - lo.z};
+            for (int axis = 0; axis < 3; ++axis) {
+                cells_per_unit[axis] = (nodes[axis] - 1) / extent[axis];
+                blocks[axis] = (nodes[axis] - 2) / block + 1;
+            }
+
+            // The interpolated density of a block lies between the samples of its nodes.
+            majorants.assign(static_cast<size_t>(blocks[0]) * blocks[1] * blocks[2], 0.0f);
+            for (int z = 0; z < nz; ++z) {
+                for (int y = 0; y < ny; ++y) {
+                    for (int x = 0; x < nx; ++x) {
+                        const auto value = sample(x, y, z);
+                        for (int bz = std::max(0, (z - 1) / block); bz <= std::min(blocks[2] - 1, z / block); ++bz) {
+                            for (int by = std::max(0, (y - 1) / block); by <= std::min(blocks[1] - 1, y / block); ++by) {
+                                for (int bx = std::max(0, (x - 1) / block); bx <= std::min(blocks[0] - 1, x / block); ++bx) {
+                                    auto &majorant = majorants[(static_cast<size_t>(bz) * blocks[1] + by) * blocks[0] + bx];
+                                    majorant = std::max(majorant, value);
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+        }
+
+        const point3 &min() const { return lo; }
+        const point3 &max() const { return hi; }
+        float largest_density() const { return *std::max_element(majorants.begin(), majorants.end()); }
+
+        double density(const point3 &p) const {
+            const double position[3] = {(p.x - lo.x) * cells_per_unit[0], (p.y - lo.y) * cells_per_unit[1], (p.z - lo.z) * cells_per_unit[2]};
+            int node[3];
+            double weight[3];
+            for (int axis = 0; axis < 3; ++axis) {
+                const auto clamped = std::clamp(position[axis], 0.0, nodes[axis] - 1.0);
+                node[axis] = std::min(static_cast<int>(clamped), nodes[axis] - 2);
+                weight[axis] = clamped - node[axis];
+            }
+
+            auto row = [&](int dy, int dz) {
+                const auto a = sample(node[0], node[1] + dy, node[2] + dz), b = sample(node[0] + 1, node[1] + dy, node[2] + dz);
+                return a + weight[0] * (b - a);
+            };
+            const auto near = row(0, 0) + weight[1] * (row(1, 0) - row(0, 0));
+            const auto far = row(0, 1) + weight[1] * (row(1, 1) - row(0, 1));
+            return near + weight[2] * (far - near);
+        }
+
+        // Distance along r of the first collision within [t0, t1] by delta tracking,
+        // false if the ray leaves the interval without one. The blocks are walked in
+        // the order the ray crosses them, tentative collisions are drawn against the
+        // majorant of each one and the exponential distance restarts at its border.
+        bool track(const ray &r, double t0, double t1, double &t) const {
+            const double origin[3] = {(r.origin.x - lo.x) * cells_per_unit[0] / block, (r.origin.y - lo.y) * cells_per_unit[1] / block,
+                                      (r.origin.z - lo.z) * cells_per_unit[2] / block};
+            const double direction[3] = {r.direction.x * cells_per_unit[0] / block, r.direction.y * cells_per_unit[1] / block,
+                                         r.direction.z * cells_per_unit[2] / block};
+
+            int cell[3], step[3];
+            double next[3], delta[3];
+            for (int axis = 0; axis < 3; ++axis) {
+                const auto start = origin[axis] + t0 * direction[axis];
+                cell[axis] = std::clamp(static_cast<int>(std::floor(start)), 0, blocks[axis] - 1);
+                step[axis] = direction[axis] < 0.0 ? -1 : 1;
+                if (direction[axis] == 0.0) {
+                    next[axis] = delta[axis] = infinity;
+                } else {
+                    next[axis] = (cell[axis] + (step[axis] > 0) - origin[axis]) / direction[axis];
+                    delta[axis] = step[axis] / direction[axis];
+                }
+            }
+
+            t = t0;
+            while (t < t1) {
+                const auto axis = next[0] < next[1] ? (next[0] < next[2] ? 0 : 2) : (next[1] < next[2] ? 1 : 2);
+                const auto exit = std::min(next[axis], t1);
+                const double majorant = majorants[(static_cast<size_t>(cell[2]) * blocks[1] + cell[1]) * blocks[0] + cell[0]];
+                if (majorant > 0.0) {
+                    for (auto collision = t - std::log(1.0 - random_double()) / majorant; collision < exit;
+                            collision -= std::log(1.0 - random_double()) / majorant) {
+                        if (random_double() * majorant < density(r.at(collision))) {
+                            t = collision;
+                            return true;
+                        }
+                    }
+                }
+
+                t = exit;
+                cell[axis] += step[axis];
+                next[axis] += delta[axis];
+                if (cell[axis] < 0 || cell[axis] >= blocks[axis]) { break; }
+            }
+            return false;
+        }
+
+    private:
+        float sample(int x, int y, int z) const { return samples[(static_cast<size_t>(z) * nodes[1] + y) * nodes[0] + x]; }
+
+    private:
+        point3 lo, hi;
+        int nodes[3];
+        int blocks[3];
+        double cells_per_unit[3];
+        std::vector<float> samples;
+        std::vector<float> majorants;
+};
+
+// Smoke: a density grid over the box of density times Perlin noise, turbulence
+// with more than one octave, sampled about four times per noise period.
+inline std::shared_ptr<const density_grid> noise_density(const point3 &lo, const point3 &hi, double density, double scale, int octaves,
+                                                         uint64_t seed = 0) {
+    constexpr int max_nodes = 256;
+    const perlin noise(seed);
+    int nodes[3];
+    const double extent[3] = {hi.x - lo.x, hi.y - lo.y, hi.z - lo.z};
+    for (int axis = 0; axis < 3; ++axis) {
+        nodes[axis] = std::clamp(static_cast<int>(std::ceil(4.0 * scale * extent[axis])) + 1, 2, max_nodes);
+    }
+
+    std::vector<float> samples;
+    samples.reserve(static_cast<size_t>(nodes[0]) * nodes[1] * nodes[2]);
+    for (int z = 0; z < nodes[2]; ++z) {
+        for (int y = 0; y < nodes[1]; ++y) {
+            for (int x = 0; x < nodes[0]; ++x) {
+                const auto p = scale * (lo + vec3(extent[0] * x / (nodes[0] - 1), extent[1] * y / (nodes[1] - 1), extent[2] * z / (nodes[2] - 1)));
+                const auto value = octaves > 1 ? noise.turbulence(p, octaves) : 0.5f * (1.0f + noise.noise(p));
+                samples.push_back(static_cast<float>(density * std::clamp(value, 0.0f, 1.0f)));
+            }
+        }
+    }
+    return std::make_shared<density_grid>(lo, hi, nodes[0], nodes[1], nodes[2], std::move(samples));
+}
+
+// Participating medium filling a box, fog of a constant density or smoke of a
+// density grid. A ray through it scatters at a random distance drawn from the
+// density along it, where it reports a hit of the phase material. That distance
+// has a closed form in fog and comes from delta tracking in smoke, so dense
+// media need no small ray marching steps and empty blocks cost nothing. Media
+// are meant to be added after the surfaces, whose hits shorten the tracking.
+class medium : public hittable {
+    public:
+        medium(const point3 &lo, const point3 &hi, double density, std::shared_ptr<material> phase)
+            : lo(lo), hi(hi), density(density), phase(std::move(phase)) { }
+
+        medium(std::shared_ptr<const density_grid> grid, std::shared_ptr<material> phase)
+            : lo(grid->min()), hi(grid->max()), density(grid->largest_density()), grid(std::move(grid)), phase(std::move(phase)) { }
+
+        virtual bool hit(const ray &r, double t_min, double t_max, hit_record &rec) const override {
+            if (density <= 0.0) { return false; }
+            const double origin[3] = {r.origin.x, r.origin.y, r.origin.z}, direction[3] = {r.direction.x, r.direction.y, r.direction.z};
+            const double box_min[3] = {lo.x, lo.y, lo.z}, box_max[3] = {hi.x, hi.y, hi.z};
+            for (int axis = 0; axis < 3; ++axis) {
+                const auto inverse = 1.0 / direction[axis];
+                auto t0 = (box_min[axis] - origin[axis]) * inverse, t1 = (box_max[axis] - origin[axis]) * inverse;
+                if (t0 > t1) { std::swap(t0, t1); }
+                t_min = t0 > t_min ? t0 : t_min;
+                t_max = t1 < t_max ? t1 : t_max;
+                if (t_min >= t_max) { return false; }
+            }
+
+            double t;
+            if (grid) {
+                if (!grid->track(r, t_min, t_max, t)) { return false; }
+            } else {
+                t = t_min - std::log(1.0 - random_double()) / density;
+                if (t >= t_max) { return false; }
+            }
+
+            rec.t = t;
+            rec.p = r.at(t);
+            rec.normal = -r.direction;      // Has no meaning, faces the ray for the denoiser.
+            rec.is_front_face = true;
+            rec.material = phase.get();
+            rec.object_id = object_id;
+            return true;
+        }
+
+        virtual aabb bounds() const override {
+            constexpr auto inf = std::numeric_limits<float>::infinity();
+            const double box_min[3] = {lo.x, lo.y, lo.z}, box_max[3] = {hi.x, hi.y, hi.z};
+            aabb box;
+            for (int axis = 0; axis < 3; ++axis) {
+                box.min[axis] = std::nextafter(static_cast<float>(box_min[axis]), -inf);
+                box.max[axis] = std::nextafter(static_cast<float>(box_max[axis]), inf);
+            }
+            return box;
+        }
+
+    private:
+        point3 lo, hi;
+        double density;     // Of fog, the largest one of smoke.
+        std::shared_ptr<const density_grid> grid;
+        std::shared_ptr<material> phase;
+};
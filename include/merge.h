@@ -0,0 +1,59 @@
+#pragma once
+
+#include "checkpoint.h"
+#include "framebuffer.h"
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+
+struct merged_frame {
+    framebuffer fb;
+    render_settings settings;   // Image size, seed, key and max depth of the slices.
+    int samples_done = 0;       // Reached by every slice.
+    size_t missing_pixels = 0;  // Not covered by any slice, they stay black.
+};
+
+// Stitches the framebuffer files of slices of one frame, rendered with --crop
+// or --slice, into the whole image. Per-pixel sample seeds make the result
+// identical to a render of the whole frame. Throws if the slices come from
+// different renders or overlap.
+inline merged_frame merge_slices(const std::vector<std::string> &paths) {
+    merged_frame merged;
+    checkpoint_header first;
+    std::vector<bool> covered;
+
+    for (const auto &path : paths) {
+        checkpoint_header header;
+        const auto part = read_checkpoint(path, header);
+
+        if (covered.empty()) {
+            first = header;
+            merged.settings.image_width = header.width;
+            merged.settings.image_height = header.height;
+            merged.settings.seed = header.seed;
+            merged.settings.key = header.key;
+            merged.settings.max_depth = header.max_depth;
+            merged.samples_done = header.samples_done;
+            merged.fb = framebuffer(header.width, header.height, 0, 0, part.aovs);
+            covered.assign(merged.fb.samples.size(), false);
+        } else if (header.width != first.width || header.height != first.height || header.seed != first.seed
+                   || header.key != first.key || header.max_depth != first.max_depth || part.aovs != merged.fb.aovs) {
+            throw std::runtime_error(path + " is a slice of another render than " + paths.front());
+        }
+
+        for (int y = part.origin_y; y < part.origin_y + part.height; ++y) {
+            for (int x = part.origin_x; x < part.origin_x + part.width; ++x) {
+                const auto index = merged.fb.pixel_index(x, y);
+                if (covered[index]) { throw std::runtime_error(path + " overlaps another slice"); }
+                covered[index] = true;
+            }
+        }
+        merged.fb.blit(part);
+        merged.samples_done = std::min(merged.samples_done, static_cast<int>(header.samples_done));
+    }
+
+    merged.missing_pixels = static_cast<size_t>(std::count(covered.begin(), covered.end(), false));
+    return merged;
+}
@@ -0,0 +1,342 @@
+#pragma once
+
+#include "mapped_file.h"
+#include "thread_pool.h"
+#include "triangle_mesh.h"
+#include <algorithm>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+
+// Mesh importers. Both map the file and write straight into the arrays of the
+// mesh_buffers, polygons are split into triangle fans.
+//
+// OBJ: only the v and f statements matter, the rest is skipped. The text is cut
+// into chunks at line boundaries that are parsed in parallel twice: once to
+// count the vertices and triangles of every chunk, which gives each chunk its
+// place in the arrays, then to fill them.
+//
+// PLY: binary little endian only. The x, y and z vertex properties may be float
+// or double, the faces are a list of int or uint indices.
+namespace mesh_loader_detail {
+    inline bool is_space(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+    // Lines of a chunk, each without its newline.
+    class line_reader {
+        public:
+            explicit line_reader(std::string_view text) : text(text) { }
+
+            bool next(std::string_view &line) {
+                if (position >= text.size()) { return false; }
+                const auto *start = text.data() + position;
+                const auto *end = static_cast<const char *>(std::memchr(start, '\n', text.size() - position));
+                const auto length = end ? static_cast<size_t>(end - start) : text.size() - position;
+                line = std::string_view(start, length);
+                position += length + 1;
+                return true;
+            }
+
+        private:
+            std::string_view text;
+            size_t position = 0;
+    };
+
+    inline std::string_view next_token(std::string_view &line) {
+        size_t start = 0;
+        while (start < line.size() && is_space(line[start])) { ++start; }
+        size_t end = start;
+        while (end < line.size() && !is_space(line[end])) { ++end; }
+        const auto token = line.substr(start, end - start);
+        line.remove_prefix(end);
+        return token;
+    }
+
+    // Drops a trailing # comment.
+    inline std::string_view strip_comment(std::string_view line) {
+        return line.substr(0, line.find('#'));
+    }
+
+    struct obj_chunk {
+        std::string_view text;
+        size_t vertices = 0;    // Counted by the first pass, then the offsets of the second.
+        size_t triangles = 0;
+        size_t first_vertex = 0;
+        size_t first_triangle = 0;
+    };
+
+    class obj_error : public std::runtime_error {
+        public:
+            obj_error(const char *where, const std::string &message) : std::runtime_error(message), where(where) { }
+            const char *where;
+    };
+
+    inline void count_obj(obj_chunk &chunk) {
+        line_reader lines(chunk.text);
+        for (std::string_view line; lines.next(line);) {
+            line = strip_comment(line);
+            const auto keyword = next_token(line);
+            if (keyword == "v") {
+                ++chunk.vertices;
+            } else if (keyword == "f") {
+                size_t corners = 0;
+                while (!next_token(line).empty()) { ++corners; }
+                if (corners >= 3) { chunk.triangles += corners - 2; }
+            }
+        }
+    }
+
+    inline void parse_obj(const obj_chunk &chunk, mesh_buffers &mesh, size_t vertex_count) {
+        line_reader lines(chunk.text);
+        auto vertex = chunk.first_vertex;
+        auto *indices = mesh.indices.data() + chunk.first_triangle * 3;
+
+        for (std::string_view line; lines.next(line);) {
+            line = strip_comment(line);
+            const auto keyword = next_token(line);
+            if (keyword == "v") {
+                float *axes[3] = {mesh.x.data(), mesh.y.data(), mesh.z.data()};
+                for (auto *axis : axes) {
+                    const auto token = next_token(line);
+                    const auto [end, error] = std::from_chars(token.data(), token.data() + token.size(), axis[vertex]);
+                    if (token.empty() || error != std::errc() || end != token.data() + token.size()) {
+                        throw obj_error(token.empty() ? line.data() : token.data(), "expected a vertex coordinate");
+                    }
+                }
+                ++vertex;
+            } else if (keyword == "f") {
+                uint32_t first = 0, previous = 0;
+                int corner = 0;
+                for (auto token = next_token(line); !token.empty(); token = next_token(line), ++corner) {
+                    // v, v/vt, v//vn or v/vt/vn, negative indices count back from the last vertex.
+                    long long index = 0;
+                    const auto [end, error] = std::from_chars(token.data(), token.data() + token.size(), index);
+                    if (error != std::errc() || (end != token.data() + token.size() && *end != '/')) {
+                        throw obj_error(token.data(), "expected a vertex index");
+                    }
+                    const auto resolved = index < 0 ? static_cast<long long>(vertex) + index : index - 1;
+                    if (index == 0 || resolved < 0 || resolved >= static_cast<long long>(vertex_count)) {
+                        throw obj_error(token.data(), "vertex index out of range");
+                    }
+
+                    const auto current = static_cast<uint32_t>(resolved);
+                    if (corner == 0) { first = current; }
+                    if (corner >= 2) {
+                        *indices++ = first;
+                        *indices++ = previous;
+                        *indices++ = current;
+                    }
+                    previous = current;
+                }
+            }
+        }
+    }
+
+    enum class ply_type { int8, uint8, int16, uint16, int32, uint32, float32, float64 };
+
+    inline ply_type parse_ply_type(std::string_view name) {
+        if (name == "char" || name == "int8") { return ply_type::int8; }
+        if (name == "uchar" || name == "uint8") { return ply_type::uint8; }
+        if (name == "short" || name == "int16") { return ply_type::int16; }
+        if (name == "ushort" || name == "uint16") { return ply_type::uint16; }
+        if (name == "int" || name == "int32") { return ply_type::int32; }
+        if (name == "uint" || name == "uint32") { return ply_type::uint32; }
+        if (name == "float" || name == "float32") { return ply_type::float32; }
+        if (name == "double" || name == "float64") { return ply_type::float64; }
+        throw std::runtime_error("unknown PLY type " + std::string(name));
+    }
+
+    inline size_t ply_size(ply_type type) {
+        switch (type) {
+            case ply_type::int8: case ply_type::uint8: return 1;
+            case ply_type::int16: case ply_type::uint16: return 2;
+            case ply_type::int32: case ply_type::uint32: case ply_type::float32: return 4;
+            case ply_type::float64: return 8;
+        }
+        return 0;
+    }
+
+    // Reads a value of type at data, in host byte order, which is little endian here.
+    template <typename T>
+    T read_ply(const std::byte *data, ply_type type) {
+        auto read = [data]<typename V>(V value) {
+            std::memcpy(&value, data, sizeof(value));
+            return static_cast<T>(value);
+        };
+        switch (type) {
+            case ply_type::int8: return read(int8_t());
+            case ply_type::uint8: return read(uint8_t());
+            case ply_type::int16: return read(int16_t());
+            case ply_type::uint16: return read(uint16_t());
+            case ply_type::int32: return read(int32_t());
+            case ply_type::uint32: return read(uint32_t());
+            case ply_type::float32: return read(float());
+            case ply_type::float64: return read(double());
+        }
+        return T();
+    }
+
+    struct ply_property {
+        std::string name;
+        ply_type type;
+        bool is_list = false;
+        ply_type count_type = ply_type::uint8;
+    };
+
+    struct ply_element {
+        std::string name;
+        size_t count = 0;
+        std::vector<ply_property> properties;
+    };
+}
+
+inline std::shared_ptr<mesh_buffers> load_obj(const std::string &path, thread_pool &pool) {
+    using namespace mesh_loader_detail;
+
+    const mapped_file file(path);
+    const std::string_view text(reinterpret_cast<const char *>(file.data()), file.size());
+
+    // A few chunks per thread balance uneven lines, and every chunk ends on a newline.
+    const auto chunk_count = std::max<size_t>(1, std::min<size_t>(pool.size() * 4, text.size() / 65536));
+    std::vector<obj_chunk> chunks;
+    for (size_t start = 0, i = 1; start < text.size(); ++i) {
+        auto end = text.size();
+        if (i < chunk_count) {
+            const auto newline = text.find('\n', std::max(start, text.size() * i / chunk_count));
+            if (newline != std::string_view::npos) { end = newline + 1; }
+        }
+        chunks.push_back({text.substr(start, end - start)});
+        start = end;
+    }
+
+    pool.parallel_for(chunks.size(), [&](size_t i) { count_obj(chunks[i]); });
+    size_t vertices = 0, triangles = 0;
+    for (auto &chunk : chunks) {
+        chunk.first_vertex = vertices;
+        chunk.first_triangle = triangles;
+        vertices += chunk.vertices;
+        triangles += chunk.triangles;
+    }
+    if (vertices > UINT32_MAX) { throw std::runtime_error(path + " has more vertices than 32 bit indices can address"); }
+
+    auto mesh = std::make_shared<mesh_buffers>();
+    mesh->x.resize(vertices);
+    mesh->y.resize(vertices);
+    mesh->z.resize(vertices);
+    mesh->indices.resize(triangles * 3);
+    try {
+        pool.parallel_for(chunks.size(), [&](size_t i) { parse_obj(chunks[i], *mesh, vertices); });
+    } catch (const obj_error &e) {
+        const auto line = std::count(text.data(), e.where, '\n') + 1;
+        throw std::runtime_error(path + ':' + std::to_string(line) + ": " + e.what());
+    }
+    return mesh;
+}
+
+inline std::shared_ptr<mesh_buffers> load_ply(const std::string &path) {
+    using namespace mesh_loader_detail;
+
+    const mapped_file file(path);
+    const std::string_view text(reinterpret_cast<const char *>(file.data()), file.size());
+    auto fail = [&path](const std::string &message) { return std::runtime_error(path + ": " + message); };
+
+    const auto header_end = text.find("end_header\n");
+    if (!text.starts_with("ply\n") || header_end == std::string_view::npos) { throw fail("not a PLY file"); }
+
+    std::vector<ply_element> elements;
+    line_reader lines(text.substr(4, header_end - 4));
+    for (std::string_view line; lines.next(line);) {
+        const auto keyword = next_token(line);
+        if (keyword == "format") {
+            if (next_token(line) != "binary_little_endian") { throw fail("only binary little endian PLY files are supported"); }
+        } else if (keyword == "element") {
+            ply_element element;
+            element.name = next_token(line);
+            const auto count = next_token(line);
+            if (std::from_chars(count.data(), count.data() + count.size(), element.count).ec != std::errc()) { throw fail("bad element count"); }
+            elements.push_back(element);
+        } else if (keyword == "property") {
+            if (elements.empty()) { throw fail("property outside of an element"); }
+            ply_property property;
+            auto type = next_token(line);
+            if (type == "list") {
+                property.is_list = true;
+                property.count_type = parse_ply_type(next_token(line));
+                type = next_token(line);
+            }
+            property.type = parse_ply_type(type);
+            property.name = next_token(line);
+            elements.back().properties.push_back(property);
+        }
+    }
+
+    auto mesh = std::make_shared<mesh_buffers>();
+    const auto *data = file.data() + header_end + std::strlen("end_header\n");
+    const auto *data_end = file.data() + file.size();
+    auto need = [&](size_t bytes) {
+        if (static_cast<size_t>(data_end - data) < bytes) { throw fail("truncated data"); }
+    };
+
+    for (const auto &element : elements) {
+        if (element.name == "vertex" && std::ranges::none_of(element.properties, [](const auto &p) { return p.is_list; })) {
+            // Fixed size records, x, y and z are read at their offsets.
+            size_t stride = 0, offsets[3] = {SIZE_MAX, SIZE_MAX, SIZE_MAX};
+            ply_type types[3] = {};
+            for (const auto &property : element.properties) {
+                for (int axis = 0; axis < 3; ++axis) {
+                    if (property.name == std::string(1, static_cast<char>('x' + axis))) {
+                        offsets[axis] = stride;
+                        types[axis] = property.type;
+                    }
+                }
+                stride += ply_size(property.type);
+            }
+            if (std::ranges::count(offsets, SIZE_MAX)) { throw fail("the vertices have no x, y and z"); }
+            if (element.count > UINT32_MAX) { throw fail("more vertices than 32 bit indices can address"); }
+            need(element.count * stride);
+
+            mesh->x.resize(element.count);
+            mesh->y.resize(element.count);
+            mesh->z.resize(element.count);
+            float *axes[3] = {mesh->x.data(), mesh->y.data(), mesh->z.data()};
+            for (size_t i = 0; i < element.count; ++i, data += stride) {
+                for (int axis = 0; axis < 3; ++axis) { axes[axis][i] = read_ply<float>(data + offsets[axis], types[axis]); }
+            }
+            continue;
+        }
+
+        const auto is_faces = element.name == "face";
+        if (is_faces) { mesh->indices.reserve(element.count * 3); }
+        for (size_t i = 0; i < element.count; ++i) {
+            for (const auto &property : element.properties) {
+                if (!property.is_list) {
+                    need(ply_size(property.type));
+                    data += ply_size(property.type);
+                    continue;
+                }
+                need(ply_size(property.count_type));
+                const auto corners = read_ply<size_t>(data, property.count_type);
+                data += ply_size(property.count_type);
+                need(corners * ply_size(property.type));
+
+                const auto is_indices = is_faces && (property.name == "vertex_indices" || property.name == "vertex_index");
+                for (size_t corner = 0; is_indices && corner < corners; ++corner) {
+                    const auto index = read_ply<int64_t>(data + corner * ply_size(property.type), property.type);
+                    if (index < 0 || static_cast<size_t>(index) >= mesh->vertex_count()) { throw fail("vertex index out of range"); }
+                    if (corner >= 2) {
+                        mesh->indices.push_back(read_ply<uint32_t>(data, property.type));
+                        mesh->indices.push_back(read_ply<uint32_t>(data + (corner - 1) * ply_size(property.type), property.type));
+                        mesh->indices.push_back(static_cast<uint32_t>(index));
+                    }
+                }
+                data += corners * ply_size(property.type);
+            }
+        }
+    }
+    return mesh;
+}
@@ -0,0 +1,244 @@
+#pragma once
+
+#include "hittable.h"
+#include "rtweekend.h"
+#include "texture.h"
+#include "vec3.h"
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <numeric>
+#include <span>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+
+// Ken Perlin's improved noise, in single precision. The gradient of every
+// lattice corner is picked by hashing the corner through a permutation table,
+// which is built once from the seed and repeated to save the index wrapping.
+// Values are within about [-1, 1]. The batch evaluation runs eight points at a
+// time with AVX2, four with SSE2, in the operations of the scalar one.
+class perlin {
+    public:
+        static constexpr int max_octaves = 16;
+#if defined(__AVX2__)
+        static constexpr int lanes = 8;
+#elif defined(__SSE2__)
+        static constexpr int lanes = 4;
+#else
+        static constexpr int lanes = 1;
+#endif
+
+        explicit perlin(uint64_t seed = 0) {
+            std::array<int32_t, 256> shuffled;
+            std::iota(shuffled.begin(), shuffled.end(), 0);
+            for (size_t i = shuffled.size() - 1; i > 0; --i) {
+                std::swap(shuffled[i], shuffled[mix64(hash_combine(seed, i)) % (i + 1)]);
+            }
+            for (size_t i = 0; i < permutation.size(); ++i) { permutation[i] = shuffled[i % 256]; }
+        }
+
+        float noise(float x, float y, float z) const {
+            const auto fx = std::floor(x), fy = std::floor(y), fz = std::floor(z);
+            const auto X = static_cast<int32_t>(fx) & 255, Y = static_cast<int32_t>(fy) & 255, Z = static_cast<int32_t>(fz) & 255;
+            x -= fx;
+            y -= fy;
+            z -= fz;
+            const auto u = fade(x), v = fade(y), w = fade(z);
+
+            const auto &p = permutation;
+            const auto A = p[X] + Y, AA = p[A] + Z, AB = p[A + 1] + Z;
+            const auto B = p[X + 1] + Y, BA = p[B] + Z, BB = p[B + 1] + Z;
+            return lerp(w, lerp(v, lerp(u, grad(p[AA], x, y, z), grad(p[BA], x - 1.0f, y, z)),
+                                   lerp(u, grad(p[AB], x, y - 1.0f, z), grad(p[BB], x - 1.0f, y - 1.0f, z))),
+                           lerp(v, lerp(u, grad(p[AA + 1], x, y, z - 1.0f), grad(p[BA + 1], x - 1.0f, y, z - 1.0f)),
+                                   lerp(u, grad(p[AB + 1], x, y - 1.0f, z - 1.0f), grad(p[BB + 1], x - 1.0f, y - 1.0f, z - 1.0f))));
+        }
+
+        // Noise of every point (x[i], y[i], z[i]) into out[i].
+        void noise(std::span<const float> x, std::span<const float> y, std::span<const float> z, std::span<float> out) const {
+            size_t i = 0;
+#if defined(__AVX2__)
+            for (; i + 8 <= out.size(); i += 8) { noise8(&x[i], &y[i], &z[i], &out[i]); }
+#endif
+#if defined(__SSE2__)
+            for (; i + 4 <= out.size(); i += 4) { noise4(&x[i], &y[i], &z[i], &out[i]); }
+#endif
+            for (; i < out.size(); ++i) { out[i] = noise(x[i], y[i], z[i]); }
+        }
+
+        float noise(const point3 &p) const { return noise(static_cast<float>(p.x), static_cast<float>(p.y), static_cast<float>(p.z)); }
+
+        // Sum of octaves of noise, each twice the frequency and half the weight of
+        // the one before, as the absolute value. The octaves are one batch.
+        float turbulence(const point3 &p, int octaves) const {
+            octaves = std::clamp(octaves, 1, max_octaves);
+            float x[max_octaves], y[max_octaves], z[max_octaves], values[max_octaves];
+            auto frequency = 1.0f;
+            for (int i = 0; i < octaves; ++i, frequency *= 2.0f) {
+                x[i] = static_cast<float>(p.x) * frequency;
+                y[i] = static_cast<float>(p.y) * frequency;
+                z[i] = static_cast<float>(p.z) * frequency;
+            }
+            noise(std::span<const float>(x, octaves), std::span<const float>(y, octaves), std::span<const float>(z, octaves), std::span<float>(values, octaves));
+
+            auto sum = 0.0f, weight = 1.0f;
+            for (int i = 0; i < octaves; ++i, weight *= 0.5f) { sum += weight * values[i]; }
+            return std::fabs(sum);
+        }
+
+    private:
+        static float fade(float t) { return t * t * t * (t * (t * 6.0f - 15.0f) + 10.0f); }
+        static float lerp(float t, float a, float b) { return a + t * (b - a); }
+
+        // One of the twelve edge directions of a cube, chosen by the low four bits.
+        static float grad(int32_t hash, float x, float y, float z) {
+            const auto h = hash & 15;
+            const auto u = h < 8 ? x : y;
+            const auto v = h < 4 ? y : (h == 12 || h == 14 ? x : z);
+            return ((h & 1) ? -u : u) + ((h & 2) ? -v : v);
+        }
+
+#if defined(__SSE2__)
+        static __m128 floor4(__m128 v) {
+            const auto truncated = _mm_cvtepi32_ps(_mm_cvttps_epi32(v));
+            return _mm_sub_ps(truncated, _mm_and_ps(_mm_cmpgt_ps(truncated, v), _mm_set1_ps(1.0f)));
+        }
+
+        static __m128 fade4(__m128 t) {
+            const auto inner = _mm_add_ps(_mm_mul_ps(t, _mm_sub_ps(_mm_mul_ps(t, _mm_set1_ps(6.0f)), _mm_set1_ps(15.0f))), _mm_set1_ps(10.0f));
+            return _mm_mul_ps(_mm_mul_ps(_mm_mul_ps(t, t), t), inner);
+        }
+
+        static __m128 lerp4(__m128 t, __m128 a, __m128 b) { return _mm_add_ps(a, _mm_mul_ps(t, _mm_sub_ps(b, a))); }
+
+        static __m128 select4(__m128i mask, __m128 a, __m128 b) {
+            const auto m = _mm_castsi128_ps(mask);
+            return _mm_or_ps(_mm_and_ps(m, a), _mm_andnot_ps(m, b));
+        }
+
+        static __m128 grad4(__m128i hash, __m128 x, __m128 y, __m128 z) {
+            const auto h = _mm_and_si128(hash, _mm_set1_epi32(15));
+            const auto u = select4(_mm_cmplt_epi32(h, _mm_set1_epi32(8)), x, y);
+            const auto x_for_v = _mm_or_si128(_mm_cmpeq_epi32(h, _mm_set1_epi32(12)), _mm_cmpeq_epi32(h, _mm_set1_epi32(14)));
+            const auto v = select4(_mm_cmplt_epi32(h, _mm_set1_epi32(4)), y, select4(x_for_v, x, z));
+            // Bits 0 and 1 of the hash become the sign bits of u and v.
+            const auto u_sign = _mm_castsi128_ps(_mm_slli_epi32(_mm_and_si128(h, _mm_set1_epi32(1)), 31));
+            const auto v_sign = _mm_castsi128_ps(_mm_slli_epi32(_mm_and_si128(h, _mm_set1_epi32(2)), 30));
+            return _mm_add_ps(_mm_xor_ps(u, u_sign), _mm_xor_ps(v, v_sign));
+        }
+
+        // SSE2 has no gather, the table lookups go lane by lane.
+        void noise4(const float *xs, const float *ys, const float *zs, float *out) const {
+            auto x = _mm_loadu_ps(xs), y = _mm_loadu_ps(ys), z = _mm_loadu_ps(zs);
+            const auto fx = floor4(x), fy = floor4(y), fz = floor4(z);
+            const auto mask = _mm_set1_epi32(255);
+            alignas(16) int32_t X[4], Y[4], Z[4];
+            _mm_store_si128(reinterpret_cast<__m128i *>(X), _mm_and_si128(_mm_cvttps_epi32(fx), mask));
+            _mm_store_si128(reinterpret_cast<__m128i *>(Y), _mm_and_si128(_mm_cvttps_epi32(fy), mask));
+            _mm_store_si128(reinterpret_cast<__m128i *>(Z), _mm_and_si128(_mm_cvttps_epi32(fz), mask));
+            x = _mm_sub_ps(x, fx);
+            y = _mm_sub_ps(y, fy);
+            z = _mm_sub_ps(z, fz);
+
+            alignas(16) int32_t corners[8][4];
+            const auto &p = permutation;
+            for (int lane = 0; lane < 4; ++lane) {
+                const auto A = p[X[lane]] + Y[lane], AA = p[A] + Z[lane], AB = p[A + 1] + Z[lane];
+                const auto B = p[X[lane] + 1] + Y[lane], BA = p[B] + Z[lane], BB = p[B + 1] + Z[lane];
+                const int32_t hashes[8] = {p[AA], p[BA], p[AB], p[BB], p[AA + 1], p[BA + 1], p[AB + 1], p[BB + 1]};
+                for (int corner = 0; corner < 8; ++corner) { corners[corner][lane] = hashes[corner]; }
+            }
+            auto corner = [&corners](int i) { return _mm_load_si128(reinterpret_cast<const __m128i *>(corners[i])); };
+
+            const auto one = _mm_set1_ps(1.0f);
+            const auto x1 = _mm_sub_ps(x, one), y1 = _mm_sub_ps(y, one), z1 = _mm_sub_ps(z, one);
+            const auto u = fade4(x), v = fade4(y), w = fade4(z);
+            const auto result = lerp4(w, lerp4(v, lerp4(u, grad4(corner(0), x, y, z), grad4(corner(1), x1, y, z)),
+                                                  lerp4(u, grad4(corner(2), x, y1, z), grad4(corner(3), x1, y1, z))),
+                                         lerp4(v, lerp4(u, grad4(corner(4), x, y, z1), grad4(corner(5), x1, y, z1)),
+                                                  lerp4(u, grad4(corner(6), x, y1, z1), grad4(corner(7), x1, y1, z1))));
+            _mm_storeu_ps(out, result);
+        }
+#endif
+
+#if defined(__AVX2__)
+        static __m256 fade8(__m256 t) {
+            const auto inner = _mm256_add_ps(_mm256_mul_ps(t, _mm256_sub_ps(_mm256_mul_ps(t, _mm256_set1_ps(6.0f)), _mm256_set1_ps(15.0f))), _mm256_set1_ps(10.0f));
+            return _mm256_mul_ps(_mm256_mul_ps(_mm256_mul_ps(t, t), t), inner);
+        }
+
+        static __m256 lerp8(__m256 t, __m256 a, __m256 b) { return _mm256_add_ps(a, _mm256_mul_ps(t, _mm256_sub_ps(b, a))); }
+
+        static __m256 grad8(__m256i hash, __m256 x, __m256 y, __m256 z) {
+            const auto h = _mm256_and_si256(hash, _mm256_set1_epi32(15));
+            const auto u = _mm256_blendv_ps(y, x, _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_set1_epi32(8), h)));
+            const auto x_for_v = _mm256_or_si256(_mm256_cmpeq_epi32(h, _mm256_set1_epi32(12)), _mm256_cmpeq_epi32(h, _mm256_set1_epi32(14)));
+            const auto v = _mm256_blendv_ps(_mm256_blendv_ps(z, x, _mm256_castsi256_ps(x_for_v)), y,
+                                            _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_set1_epi32(4), h)));
+            const auto u_sign = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_and_si256(h, _mm256_set1_epi32(1)), 31));
+            const auto v_sign = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_and_si256(h, _mm256_set1_epi32(2)), 30));
+            return _mm256_add_ps(_mm256_xor_ps(u, u_sign), _mm256_xor_ps(v, v_sign));
+        }
+
+        void noise8(const float *xs, const float *ys, const float *zs, float *out) const {
+            auto x = _mm256_loadu_ps(xs), y = _mm256_loadu_ps(ys), z = _mm256_loadu_ps(zs);
+            const auto fx = _mm256_floor_ps(x), fy = _mm256_floor_ps(y), fz = _mm256_floor_ps(z);
+            const auto mask = _mm256_set1_epi32(255);
+            const auto X = _mm256_and_si256(_mm256_cvttps_epi32(fx), mask);
+            const auto Y = _mm256_and_si256(_mm256_cvttps_epi32(fy), mask);
+            const auto Z = _mm256_and_si256(_mm256_cvttps_epi32(fz), mask);
+            x = _mm256_sub_ps(x, fx);
+            y = _mm256_sub_ps(y, fy);
+            z = _mm256_sub_ps(z, fz);
+
+            const auto *p = permutation.data();
+            auto lookup = [p](__m256i index) { return _mm256_i32gather_epi32(p, index, 4); };
+            const auto one_i = _mm256_set1_epi32(1);
+            const auto A = _mm256_add_epi32(lookup(X), Y), B = _mm256_add_epi32(lookup(_mm256_add_epi32(X, one_i)), Y);
+            const auto AA = _mm256_add_epi32(lookup(A), Z), AB = _mm256_add_epi32(lookup(_mm256_add_epi32(A, one_i)), Z);
+            const auto BA = _mm256_add_epi32(lookup(B), Z), BB = _mm256_add_epi32(lookup(_mm256_add_epi32(B, one_i)), Z);
+
+            const auto one = _mm256_set1_ps(1.0f);
+            const auto x1 = _mm256_sub_ps(x, one), y1 = _mm256_sub_ps(y, one), z1 = _mm256_sub_ps(z, one);
+            const auto u = fade8(x), v = fade8(y), w = fade8(z);
+            auto next = [&](__m256i index) { return lookup(_mm256_add_epi32(index, one_i)); };
+            const auto result = lerp8(w, lerp8(v, lerp8(u, grad8(lookup(AA), x, y, z), grad8(lookup(BA), x1, y, z)),
+                                                  lerp8(u, grad8(lookup(AB), x, y1, z), grad8(lookup(BB), x1, y1, z))),
+                                         lerp8(v, lerp8(u, grad8(next(AA), x, y, z1), grad8(next(BA), x1, y, z1)),
+                                                  lerp8(u, grad8(next(AB), x, y1, z1), grad8(next(BB), x1, y1, z1))));
+            _mm256_storeu_ps(out, result);
+        }
+#endif
+
+        std::array<int32_t, 512> permutation;
+};
+
+// Procedural solid texture of the hit point, scaled by scale. One octave is
+// plain noise, more are turbulence. Marble runs the turbulence through a sine
+// along z, the veined look of the second book.
+class noise_texture : public texture {
+    public:
+        noise_texture(double scale, int octaves = 1, bool marble = false, uint64_t seed = 0)
+            : noise(seed), scale(scale), octaves(octaves), marble(marble) { }
+
+        virtual color value(const hit_record &rec) const override {
+            const auto p = scale * rec.p;
+            if (marble) { return color(0.5 * (1.0 + std::sin(p.z + 10.0 * noise.turbulence(p, octaves)))); }
+            if (octaves > 1) { return color(noise.turbulence(p, octaves)); }
+            return color(0.5 * (1.0 + noise.noise(p)));
+        }
+
+    private:
+        perlin noise;
+        double scale;
+        int octaves;
+        bool marble;
+};
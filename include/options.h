@@ -0,0 +1,379 @@
+#pragma once
+
+#include "aov.h"
+#include "denoiser.h"
+#include "farm.h"
+#include "image_writer.h"
+#include "progressive.h"
+#include "renderer.h"
+#include <algorithm>
+#include <charconv>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+
+enum class run_mode {
+    render,
+    merge,      // Stitch the input_paths slices instead of rendering.
+    farm,       // Coordinate worker processes that render the tiles.
+    worker,     // Render tiles for a coordinator, over stdin and stdout.
+    serve,      // Run a render server.
+    submit,     // Send the render to a server and follow its progress.
+    convert,    // Write the text scene of input_paths as a binary scene.
+    bench,      // Time the triangle intersection of a generated mesh and BVH refits.
+    sequence,   // Render the frames of a camera path in one process.
+};
+
+struct render_options {
+    std::vector<std::string> output_paths;  // result.png when none is given, frame_####.png for sequences.
+    run_mode mode = run_mode::render;
+    std::vector<std::string> input_paths;
+    std::string scene_path;     // The built-in random scene when empty.
+    std::string camera_path;    // Keyframes of a sequence.
+    farm_settings farm;
+    std::string socket_path = "raytracer.sock";    // Of serve and submit.
+    int priority = 0;                               // Of jobs submitted to a server.
+    unsigned bench_triangles = 1000000;
+    unsigned bench_rays = 1000000;
+    render_settings settings;
+    std::vector<int> crop;      // x0,y0,x1,y1 of --crop, empty for the whole image.
+    int slice = 0;
+    int slice_count = 1;
+    tile region{0, 0, 0, 0};    // Pixels to render, set by resolve_region.
+    tonemap_settings tonemap;
+    progressive_settings progressive;
+    unsigned thread_count = std::thread::hardware_concurrency();
+    size_t texture_cache_mb = 512;
+    size_t geometry_cache_mb = 1024;
+    double time_budget = 0.0;   // Wall-clock seconds per frame, zero renders all the samples.
+    std::string resume_path;
+    bool stream = false;
+    bool denoise = false;
+    denoise_settings denoiser;
+    aov_set aovs;               // Extra layers of the OpenEXR outputs.
+    bool show_help = false;
+};
+
+inline void print_usage(std::ostream &out) {
+    out << "Usage: Raytracer [options]\n"
+           "       Raytracer merge [output options] <slice.rtfb>...\n"
+           "       Raytracer farm [--workers <count>] [options]\n"
+           "       Raytracer serve [--socket <path>] [--threads <count>]\n"
+           "       Raytracer submit [--socket <path>] [--priority <value>] [options]\n"
+           "       Raytracer convert <scene.txt> -o <scene.rtsc>\n"
+           "       Raytracer sequence --camera-path <path> [options] -o <frame_####.png>\n"
+           "       Raytracer bench [--triangles <count>] [--rays <count>] [<mesh.obj|ply>...]\n"
+           "  --scene <path>           scene file, text (see scene_parser.h) or .rtsc binary\n"
+           "                           (default: the random scene of the first book)\n"
+           "  -o, --output <path>      output image, .png, .exr, .hdr or .pfm (default: result.png),\n"
+           "                           repeat it to write several formats from one render, or .rtfb\n"
+           "                           to save the raw framebuffer of a slice for merging\n"
+           "  --width <pixels>         image width (default: 1200)\n"
+           "  --height <pixels>        image height (default: width / 1.5)\n"
+           "  --crop <x0,y0,x1,y1>     render only the pixels [x0, x1) x [y0, y1), rows counted from the top\n"
+           "  --slice <k/N>            render only the k-th of N bands of rows (of the crop), k from 0\n"
+           "  --spp <count>            samples per pixel (default: 500)\n"
+           "  --time-budget <seconds>  stop adding passes at this wall-clock time, --spp becomes an upper bound\n"
+           "                           the budget covers the render, writing the outputs comes after it\n"
+           "  --max-depth <count>      ray bounce limit (default: 50)\n"
+           "  --lookfrom <x,y,z>       camera position (default: 13,2,3)\n"
+           "  --lookat <x,y,z>         point the camera looks at (default: 0,0,0)\n"
+           "  --vup <x,y,z>            up direction of the camera (default: 0,1,0)\n"
+           "  --fov <degrees>          vertical field of view (default: 20)\n"
+           "  --aperture <diameter>    lens aperture, 0 for a pinhole (default: 0.1)\n"
+           "  --focus-distance <units> distance of the plane in focus (default: 10)\n"
+           "  --shutter <open,close>   times within the frame the shutter is open, 0 to 1, for motion blur\n"
+           "                           (default: 0,0, no blur)\n"
+           "  --seed <value>           random seed of scene and samples (default: 0)\n"
+           "  --threads <count>        render threads (default: hardware threads)\n"
+           "  --texture-cache <MB>     memory for the texture tiles of a scene (default: 512)\n"
+           "  --geometry-cache <MB>    memory for the clusters of the streamed meshes of a scene (default: 1024)\n"
+           "  --workers <count>        worker processes of farm, sharing the threads (default: 4)\n"
+           "  --socket <path>          Unix socket of the render server (default: raytracer.sock)\n"
+           "  --priority <value>       server jobs of higher priority run first (default: 0)\n"
+           "  --triangles <count>      triangles of the bench mesh, spheres of the refit frames (default: 1000000)\n"
+           "  --rays <count>           rays of each bench run (default: 1000000)\n"
+           "  --camera-path <path>     keyframes of the camera for sequence, see camera_path.h\n"
+           "  --exposure <stops>       exposure of PNG outputs (default: 0)\n"
+           "  --tonemap <operator>     none, reinhard or aces (default: none)\n"
+           "  --transfer <function>    gamma2 or srgb (default: gamma2)\n"
+           "  --bit-depth <bits>       8 or 16 bits PNG samples (default: 8)\n"
+           "  --denoise                filter the final image guided by first hit albedo and normals\n"
+           "  --denoise-iterations <count>  a-trous filter iterations (default: 5)\n"
+           "  --aov <name,...>         render these AOVs into the .exr outputs: depth, normal, albedo,\n"
+           "                           material_id, object_id, samples, time\n"
+           "  --preview <spp,...>      write a preview when these sample counts are reached\n"
+           "  --preview-path <path>    preview image (default: <output>_preview.png)\n"
+           "  --stream                 write finished rows to the PNG while rendering, for huge images\n"
+           "  --checkpoint <path>      periodically save the render state, and on SIGINT/SIGTERM\n"
+           "  --checkpoint-interval <seconds>  time between checkpoints (default: 300)\n"
+           "  --resume <path>          continue the render saved in a checkpoint\n"
+           "  -h, --help               show this help\n";
+}
+
+template <typename T>
+T parse_number(std::string_view option, std::string_view text) {
+    T value{};
+    const auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), value);
+    if (error != std::errc() || end != text.data() + text.size()) {
+        throw std::invalid_argument("Invalid value for " + std::string(option) + ": " + std::string(text));
+    }
+    return value;
+}
+
+template <typename T>
+std::vector<T> parse_list(std::string_view option, std::string_view text) {
+    std::vector<T> values;
+    while (!text.empty()) {
+        const auto comma = text.find(',');
+        values.push_back(parse_number<T>(option, text.substr(0, comma)));
+        text = comma == std::string_view::npos ? std::string_view() : text.substr(comma + 1);
+    }
+    return values;
+}
+
+inline point3 parse_point(std::string_view option, std::string_view text) {
+    const auto values = parse_list<double>(option, text);
+    if (values.size() != 3) { throw std::invalid_argument(std::string(option) + " takes x,y,z"); }
+    return point3(values[0], values[1], values[2]);
+}
+
+// Throws std::invalid_argument on malformed command lines. The defaults are
+// parsed before the arguments of the command line, which override them.
+inline render_options parse_options(int argc, char **argv, const std::vector<std::string> &defaults = {}) {
+    render_options options;
+    bool height_given = false;
+
+    const std::string_view command = argc > 1 ? argv[1] : "";
+    if (command == "merge") { options.mode = run_mode::merge; }
+    else if (command == "farm") { options.mode = run_mode::farm; }
+    else if (command == "worker") { options.mode = run_mode::worker; }
+    else if (command == "serve") { options.mode = run_mode::serve; }
+    else if (command == "submit") { options.mode = run_mode::submit; }
+    else if (command == "convert") { options.mode = run_mode::convert; }
+    else if (command == "bench") { options.mode = run_mode::bench; }
+    else if (command == "sequence") { options.mode = run_mode::sequence; }
+
+    std::vector<std::string_view> args(defaults.begin(), defaults.end());
+    for (int i = options.mode == run_mode::render ? 1 : 2; i < argc; ++i) { args.emplace_back(argv[i]); }
+
+    for (size_t i = 0; i < args.size(); ++i) {
+        const auto arg = args[i];
+        auto value = [&]() -> std::string_view {
+            if (i + 1 >= args.size()) { throw std::invalid_argument("Missing value for " + std::string(arg)); }
+            return args[++i];
+        };
+
+        if (arg == "-h" || arg == "--help") { options.show_help = true; }
+        else if (arg == "-o" || arg == "--output") { options.output_paths.emplace_back(value()); }
+        else if (arg == "--exposure") { options.tonemap.exposure = parse_number<double>(arg, value()); }
+        else if (arg == "--tonemap") {
+            const auto name = value();
+            if (name == "none") { options.tonemap.tonemap = tonemap_operator::none; }
+            else if (name == "reinhard") { options.tonemap.tonemap = tonemap_operator::reinhard; }
+            else if (name == "aces") { options.tonemap.tonemap = tonemap_operator::aces; }
+            else { throw std::invalid_argument("Unknown tone mapping operator: " + std::string(name)); }
+        }
+        else if (arg == "--transfer") {
+            const auto name = value();
+            if (name == "gamma2") { options.tonemap.transfer = transfer_function::gamma2; }
+            else if (name == "srgb") { options.tonemap.transfer = transfer_function::srgb; }
+            else { throw std::invalid_argument("Unknown transfer function: " + std::string(name)); }
+        }
+        else if (arg == "--bit-depth") { options.tonemap.bit_depth = parse_number<int>(arg, value()); }
+        else if (arg == "--width") { options.settings.image_width = parse_number<int>(arg, value()); }
+        else if (arg == "--height") { options.settings.image_height = parse_number<int>(arg, value()); height_given = true; }
+        else if (arg == "--crop") {
+            options.crop = parse_list<int>(arg, value());
+            if (options.crop.size() != 4) { throw std::invalid_argument("--crop takes x0,y0,x1,y1"); }
+        }
+        else if (arg == "--slice") {
+            const auto text = value();
+            const auto slash = text.find('/');
+            if (slash == std::string_view::npos) { throw std::invalid_argument("--slice takes k/N"); }
+            options.slice = parse_number<int>(arg, text.substr(0, slash));
+            options.slice_count = parse_number<int>(arg, text.substr(slash + 1));
+        }
+        else if (arg == "--spp") { options.settings.sample_per_pixel = parse_number<int>(arg, value()); }
+        else if (arg == "--time-budget") { options.time_budget = parse_number<double>(arg, value()); }
+        else if (arg == "--max-depth") { options.settings.max_depth = parse_number<int>(arg, value()); }
+        else if (arg == "--lookfrom") { options.settings.camera.lookfrom = parse_point(arg, value()); }
+        else if (arg == "--lookat") { options.settings.camera.lookat = parse_point(arg, value()); }
+        else if (arg == "--vup") { options.settings.camera.vup = parse_point(arg, value()); }
+        else if (arg == "--fov") { options.settings.camera.vfov = parse_number<double>(arg, value()); }
+        else if (arg == "--aperture") { options.settings.camera.aperture = parse_number<double>(arg, value()); }
+        else if (arg == "--focus-distance") { options.settings.camera.focus_distance = parse_number<double>(arg, value()); }
+        else if (arg == "--shutter") {
+            const auto shutter = parse_list<double>(arg, value());
+            if (shutter.size() != 2) { throw std::invalid_argument("--shutter takes open,close"); }
+            options.settings.camera.shutter_open = shutter[0];
+            options.settings.camera.shutter_close = shutter[1];
+        }
+        else if (arg == "--seed") { options.settings.seed = parse_number<uint64_t>(arg, value()); }
+        else if (arg == "--threads") { options.thread_count = parse_number<unsigned>(arg, value()); }
+        else if (arg == "--texture-cache") { options.texture_cache_mb = parse_number<size_t>(arg, value()); }
+        else if (arg == "--geometry-cache") { options.geometry_cache_mb = parse_number<size_t>(arg, value()); }
+        else if (arg == "--preview") { options.progressive.preview_spp = parse_list<int>(arg, value()); }
+        else if (arg == "--preview-path") { options.progressive.preview_path = value(); }
+        else if (arg == "--stream") { options.stream = true; }
+        else if (arg == "--denoise") { options.denoise = true; }
+        else if (arg == "--denoise-iterations") { options.denoiser.iterations = parse_number<int>(arg, value()); }
+        else if (arg == "--aov") {
+            auto names = value();
+            while (!names.empty()) {
+                const auto comma = names.find(',');
+                options.aovs.add(parse_aov(names.substr(0, comma)));
+                names = comma == std::string_view::npos ? std::string_view() : names.substr(comma + 1);
+            }
+        }
+        else if (arg == "--checkpoint") { options.progressive.checkpoint_path = value(); }
+        else if (arg == "--checkpoint-interval") { options.progressive.checkpoint_interval = parse_number<double>(arg, value()); }
+        else if (arg == "--resume") { options.resume_path = value(); }
+        else if (arg == "--scene") { options.scene_path = value(); }
+        else if (arg == "--socket") { options.socket_path = value(); }
+        else if (arg == "--priority") { options.priority = parse_number<int>(arg, value()); }
+        else if (arg == "--workers") { options.farm.workers = parse_number<unsigned>(arg, value()); }
+        else if (arg == "--triangles") { options.bench_triangles = parse_number<unsigned>(arg, value()); }
+        else if (arg == "--rays") { options.bench_rays = parse_number<unsigned>(arg, value()); }
+        else if (arg == "--camera-path") { options.camera_path = value(); }
+        else if ((options.mode == run_mode::merge || options.mode == run_mode::convert || options.mode == run_mode::bench)
+                 && !arg.starts_with('-')) { options.input_paths.emplace_back(arg); }
+        else { throw std::invalid_argument("Unknown option: " + std::string(arg)); }
+    }
+
+    auto &settings = options.settings;
+    if (!height_given) {
+        constexpr auto aspect_ratio = 3.0 / 2.0;
+        settings.image_height = static_cast<int>(settings.image_width / aspect_ratio);
+    }
+    if (settings.image_width < 2 || settings.image_height < 2) { throw std::invalid_argument("The image must be at least 2x2 pixels"); }
+    if (settings.sample_per_pixel < 1) { throw std::invalid_argument("--spp must be positive"); }
+    if (settings.max_depth < 1) { throw std::invalid_argument("--max-depth must be positive"); }
+    const auto &camera = settings.camera;
+    if ((camera.lookfrom - camera.lookat).length_squared() == 0.0) { throw std::invalid_argument("--lookfrom and --lookat must differ"); }
+    if (camera.vfov <= 0.0 || camera.vfov >= 180.0) { throw std::invalid_argument("--fov must be between 0 and 180 degrees"); }
+    if (camera.aperture < 0.0 || camera.focus_distance <= 0.0) { throw std::invalid_argument("--aperture must not be negative and --focus-distance must be positive"); }
+    if (!(0.0 <= camera.shutter_open && camera.shutter_open <= camera.shutter_close && camera.shutter_close <= 1.0)) {
+        throw std::invalid_argument("--shutter must open before it closes, between 0 and 1");
+    }
+    if (options.time_budget < 0.0) { throw std::invalid_argument("--time-budget must not be negative"); }
+    if (options.progressive.checkpoint_interval < 0.0) { throw std::invalid_argument("--checkpoint-interval must not be negative"); }
+    if (options.mode == run_mode::merge && options.input_paths.empty()) { throw std::invalid_argument("merge needs the slices to stitch"); }
+
+    // A resumed render keeps checkpointing into the file it came from.
+    if (options.progressive.checkpoint_path.empty()) {
+        options.progressive.checkpoint_path = options.resume_path;
+    }
+
+    auto &preview_spp = options.progressive.preview_spp;
+    std::sort(preview_spp.begin(), preview_spp.end());
+    preview_spp.erase(std::unique(preview_spp.begin(), preview_spp.end()), preview_spp.end());
+    if (!preview_spp.empty() && preview_spp.front() < 1) { throw std::invalid_argument("--preview sample counts must be positive"); }
+    std::erase_if(preview_spp, [&](int spp) { return spp >= settings.sample_per_pixel; });
+
+    if (options.denoiser.iterations < 1 || options.denoiser.iterations > 10) { throw std::invalid_argument("--denoise-iterations must be between 1 and 10"); }
+    if (options.tonemap.bit_depth != 8 && options.tonemap.bit_depth != 16) { throw std::invalid_argument("--bit-depth must be 8 or 16"); }
+
+    if (options.mode == run_mode::bench && (options.bench_triangles < 2 || options.bench_rays < 1)) {
+        throw std::invalid_argument("bench needs at least 2 triangles and 1 ray");
+    }
+
+    if (options.mode == run_mode::convert) {
+        if (options.input_paths.size() != 1 || options.output_paths.size() != 1 || file_extension(options.output_paths.front()) != "rtsc") {
+            throw std::invalid_argument("convert needs one text scene and one .rtsc output");
+        }
+        return options;
+    }
+
+    if (options.output_paths.empty()) { options.output_paths.emplace_back(options.mode == run_mode::sequence ? "frame_####.png" : "result.png"); }
+    for (const auto &path : options.output_paths) {
+        if (!is_supported_image(path) && file_extension(path) != "rtfb") { throw std::invalid_argument("Unsupported image format: " + path); }
+    }
+
+    const auto keeps_aovs = [](const auto &path) { return file_extension(path) == "exr" || file_extension(path) == "rtfb"; };
+    if (!options.aovs.empty() && std::ranges::none_of(options.output_paths, keeps_aovs)) {
+        throw std::invalid_argument("--aov needs an .exr or .rtfb output to write the planes to");
+    }
+
+    if (options.stream) {
+        if (options.mode != run_mode::render) { throw std::invalid_argument("--stream only applies to a single process render"); }
+        if (options.output_paths.size() != 1 || file_extension(options.output_paths.front()) != "png") {
+            throw std::invalid_argument("--stream writes a single PNG image");
+        }
+        if (!preview_spp.empty() || options.time_budget > 0.0 || !options.progressive.checkpoint_path.empty() || !options.resume_path.empty()) {
+            throw std::invalid_argument("--stream renders every band to completion and can't be combined with previews, time budgets or checkpoints");
+        }
+        if (options.denoise) {
+            throw std::invalid_argument("--stream can't be combined with --denoise, the filter needs the whole image");
+        }
+    }
+
+    if (options.mode == run_mode::sequence) {
+        if (options.camera_path.empty()) { throw std::invalid_argument("sequence needs a --camera-path"); }
+        for (const auto &path : options.output_paths) {
+            if (file_extension(path) == "rtfb" || path.find('#') == std::string::npos) {
+                throw std::invalid_argument("The outputs of a sequence are images with # in their name for the frame number: " + path);
+            }
+        }
+        if (options.stream || !preview_spp.empty() || options.time_budget > 0.0 || !options.progressive.checkpoint_path.empty()
+                || !options.resume_path.empty()) {
+            throw std::invalid_argument("sequence renders whole frames and can't be combined with streaming, previews, time budgets or checkpoints");
+        }
+    }
+
+    if (options.mode == run_mode::farm) {
+        if (options.farm.workers < 1) { throw std::invalid_argument("--workers must be positive"); }
+        if (!preview_spp.empty() || options.time_budget > 0.0 || !options.progressive.checkpoint_path.empty() || !options.resume_path.empty()) {
+            throw std::invalid_argument("farm renders every tile to completion and can't be combined with previews, time budgets or checkpoints");
+        }
+        options.farm.threads_per_worker = std::max(1u, options.thread_count / options.farm.workers);
+    }
+
+    if (options.progressive.preview_path.empty()) {
+        const auto &output = options.output_paths.front();
+        const auto dot = output.find_last_of('.');
+        const auto slash = output.find_last_of('/');
+        const auto stem_end = (dot != std::string::npos && (slash == std::string::npos || dot > slash)) ? dot : output.size();
+        options.progressive.preview_path = output.substr(0, stem_end) + "_preview.png";
+    }
+
+    return options;
+}
+
+// Sets the region of the options from their crop and slice. It needs the
+// image size, so it runs once the defaults of the scene are parsed. Throws
+// std::invalid_argument when they don't fit the image.
+inline void resolve_region(render_options &options) {
+    const auto &settings = options.settings;
+    const auto &crop = options.crop;
+    auto &region = options.region;
+    region = {0, 0, settings.image_width, settings.image_height};
+    if (!crop.empty()) {
+        region = {crop[0], crop[1], crop[2], crop[3]};
+        if (region.x0 < 0 || region.y0 < 0 || region.x1 > settings.image_width || region.y1 > settings.image_height
+                || region.x0 >= region.x1 || region.y0 >= region.y1) {
+            throw std::invalid_argument("--crop must be a non-empty rectangle inside the image");
+        }
+    }
+    const auto slice = options.slice, slice_count = options.slice_count;
+    if (slice_count < 1 || slice < 0 || slice >= slice_count || slice_count > region.y1 - region.y0) {
+        throw std::invalid_argument("--slice k/N needs 0 <= k < N and no more slices than rows");
+    }
+    const auto region_height = region.y1 - region.y0;
+    region = {region.x0, region.y0 + region_height * slice / slice_count, region.x1, region.y0 + region_height * (slice + 1) / slice_count};
+
+    if (options.mode == run_mode::sequence && (region.x1 - region.x0 != settings.image_width || region.y1 - region.y0 != settings.image_height)) {
+        throw std::invalid_argument("sequence renders whole frames and can't be combined with crops or slices");
+    }
+}
+
+// parse_options for arguments that don't come from main, without the program name.
+inline render_options parse_options(const std::vector<std::string> &arguments, const std::vector<std::string> &defaults = {}) {
+    std::vector<char *> argv{const_cast<char *>("Raytracer")};
+    for (const auto &argument : arguments) { argv.push_back(const_cast<char *>(argument.c_str())); }
+    return parse_options(static_cast<int>(argv.size()), argv.data(), defaults);
+}
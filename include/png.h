@@ -0,0 +1,203 @@
+#pragma once
+
+#include "deflate.h"
+#include "thread_pool.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+
+// Prefixes every row with the PNG filter that gives the smallest sum of absolute
+// residuals. previous is the unfiltered row above the first one, or null when it
+// isn't known, at the top of the image or when the strips are encoded out of
+// order. The first row then only tries the filters which don't look above it.
+inline void filter_rows(const uint8_t *rows, int row_count, int row_bytes, int bytes_per_pixel,
+                        const uint8_t *previous, std::vector<uint8_t> &out) {
+    const std::vector<uint8_t> zero_row(previous ? 0 : row_bytes, 0);
+    const uint8_t filter_count = previous ? 5 : 2;
+    if (!previous) { previous = zero_row.data(); }
+
+    std::vector<uint8_t> candidate(row_bytes);
+    std::vector<uint8_t> best(row_bytes);
+
+    for (int y = 0; y < row_count; ++y) {
+        const auto *row = rows + static_cast<size_t>(y) * row_bytes;
+        uint64_t best_cost = UINT64_MAX;
+        uint8_t best_filter = 0;
+
+        for (uint8_t filter = 0; filter < (y == 0 ? filter_count : 5); ++filter) {
+            uint64_t cost = 0;
+            for (int i = 0; i < row_bytes; ++i) {
+                const int a = i >= bytes_per_pixel ? row[i - bytes_per_pixel] : 0;
+                const int b = previous[i];
+                const int c = i >= bytes_per_pixel ? previous[i - bytes_per_pixel] : 0;
+                int predictor = 0;
+                switch (filter) {
+                    case 1: predictor = a; break;
+                    case 2: predictor = b; break;
+                    case 3: predictor = (a + b) / 2; break;
+                    case 4: {
+                        const int p = a + b - c;
+                        const int pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+                        predictor = (pa <= pb && pa <= pc) ? a : (pb <= pc ? b : c);
+                        break;
+                    }
+                    default: break;
+                }
+                candidate[i] = static_cast<uint8_t>(row[i] - predictor);
+                cost += std::abs(static_cast<int8_t>(candidate[i]));
+            }
+            if (cost < best_cost) {
+                best_cost = cost;
+                best_filter = filter;
+                best.swap(candidate);
+            }
+        }
+
+        out.push_back(best_filter);
+        out.insert(out.end(), best.begin(), best.end());
+        previous = row;
+    }
+}
+
+// A horizontal strip of the image, filtered and deflated on its own. Strips only
+// read the row above them, so they can be encoded in any order and in parallel,
+// and their deflate blocks concatenate into one zlib stream.
+struct png_strip {
+    std::vector<uint8_t> compressed;
+    uint32_t adler = 1;
+    size_t filtered_size = 0;
+    int rows = 0;
+};
+
+// pixels holds row_count rows of RGB samples of bit_depth bits, 16-bit ones big-endian.
+// previous is the row above them, see filter_rows.
+inline png_strip encode_png_strip(const uint8_t *pixels, int row_count, int width, int bit_depth, const uint8_t *previous = nullptr) {
+    const int bytes_per_pixel = 3 * bit_depth / 8;
+
+    png_strip strip;
+    strip.rows = row_count;
+
+    std::vector<uint8_t> filtered;
+    filtered.reserve(static_cast<size_t>(row_count) * (width * bytes_per_pixel + 1));
+    filter_rows(pixels, row_count, width * bytes_per_pixel, bytes_per_pixel, previous, filtered);
+
+    strip.adler = adler32(1, filtered.data(), filtered.size());
+    strip.filtered_size = filtered.size();
+    deflate_block(filtered.data(), filtered.size(), false, strip.compressed);
+    return strip;
+}
+
+// Encodes row_count rows as strips of strip_rows rows, spread over the pool.
+// previous is the row above the first one.
+inline std::vector<png_strip> encode_png_strips(thread_pool *pool, const uint8_t *pixels, int row_count, int width,
+                                                int bit_depth, const uint8_t *previous = nullptr, int strip_rows = 32) {
+    const int bytes_per_pixel = 3 * bit_depth / 8;
+    const auto row_bytes = static_cast<size_t>(width) * bytes_per_pixel;
+    const auto strip_count = static_cast<size_t>((row_count + strip_rows - 1) / strip_rows);
+    std::vector<png_strip> strips(strip_count);
+
+    auto encode = [&](size_t i) {
+        const auto first_row = static_cast<int>(i) * strip_rows;
+        const auto *rows = pixels + first_row * row_bytes;
+        strips[i] = encode_png_strip(rows, std::min(strip_rows, row_count - first_row), width, bit_depth,
+                                     first_row > 0 ? rows - row_bytes : previous);
+    };
+    if (pool) {
+        pool->parallel_for(strip_count, encode);
+    } else {
+        for (size_t i = 0; i < strip_count; ++i) { encode(i); }
+    }
+    return strips;
+}
+
+// Writes an 8 or 16-bit RGB PNG a few strips at a time. Each call emits its strips as one
+// IDAT chunk, so only the rows being encoded have to be kept in memory.
+class png_stream_writer {
+    public:
+        png_stream_writer(const std::string &path, int width, int height, int bit_depth = 8)
+            : path(path), temp_path(path + ".tmp"), width(width), height(height), bit_depth(bit_depth),
+              out(temp_path, std::ios::binary | std::ios::trunc) {
+            if (!out) { throw std::runtime_error("Unable to write the image: " + temp_path); }
+
+            static const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+            out.write(reinterpret_cast<const char *>(signature), sizeof(signature));
+
+            std::vector<uint8_t> header;
+            put_u32(header, width);
+            put_u32(header, height);
+            // RGB, deflate, adaptive filters, no interlace.
+            header.insert(header.end(), {static_cast<uint8_t>(bit_depth), 2, 0, 0, 0});
+            write_chunk("IHDR", header);
+        }
+
+        int rows_written() const { return next_row; }
+
+        // Appends row_count rows of RGB pixels, top to bottom, see encode_png_strip.
+        void write_rows(const uint8_t *pixels, int row_count, thread_pool *pool = nullptr) {
+            write_strips(encode_png_strips(pool, pixels, row_count, width, bit_depth, last_row.empty() ? nullptr : last_row.data()));
+            const auto row_bytes = static_cast<size_t>(width) * 3 * bit_depth / 8;
+            if (row_count > 0) { last_row.assign(pixels + (row_count - 1) * row_bytes, pixels + row_count * row_bytes); }
+        }
+
+        // Appends already encoded strips, in top to bottom order.
+        void write_strips(const std::vector<png_strip> &strips) {
+            last_row.clear();
+            std::vector<uint8_t> compressed;
+            if (next_row == 0) { compressed = {0x78, 0x01}; } // zlib header: deflate, 32K window.
+
+            for (const auto &strip : strips) {
+                compressed.insert(compressed.end(), strip.compressed.begin(), strip.compressed.end());
+                adler = adler32_combine(adler, strip.adler, strip.filtered_size);
+                next_row += strip.rows;
+            }
+            write_chunk("IDAT", compressed);
+        }
+
+        // Terminates the zlib stream and moves the file into place.
+        void finish() {
+            if (next_row != height) { throw std::runtime_error("Missing rows in the image: " + path); }
+
+            std::vector<uint8_t> tail;
+            deflate_block(nullptr, 0, true, tail);
+            put_u32(tail, adler);
+            write_chunk("IDAT", tail);
+            write_chunk("IEND", {});
+
+            out.close();
+            if (!out || std::rename(temp_path.c_str(), path.c_str()) != 0) {
+                throw std::runtime_error("Unable to write the image: " + path);
+            }
+        }
+
+    private:
+        static void put_u32(std::vector<uint8_t> &data, uint32_t value) {
+            data.insert(data.end(), {static_cast<uint8_t>(value >> 24), static_cast<uint8_t>(value >> 16),
+                                     static_cast<uint8_t>(value >> 8), static_cast<uint8_t>(value)});
+        }
+
+        void write_chunk(const char *type, const std::vector<uint8_t> &data) {
+            std::vector<uint8_t> chunk;
+            put_u32(chunk, static_cast<uint32_t>(data.size()));
+            chunk.insert(chunk.end(), type, type + 4);
+            chunk.insert(chunk.end(), data.begin(), data.end());
+            put_u32(chunk, crc32(0, chunk.data() + 4, chunk.size() - 4));
+            out.write(reinterpret_cast<const char *>(chunk.data()), chunk.size());
+        }
+
+    private:
+        std::string path;
+        std::string temp_path;
+        int width;
+        int height;
+        int bit_depth;
+        std::ofstream out;
+        int next_row = 0;
+        uint32_t adler = 1;
+        std::vector<uint8_t> last_row;      // Of the last rows written, the row above the next ones.
+};
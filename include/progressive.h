@@ -0,0 +1,118 @@
+#pragma once
+
+#include "checkpoint.h"
+#include "framebuffer.h"
+#include "image_writer.h"
+#include "renderer.h"
+#include "thread_pool.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <vector>
+
+
+struct progressive_settings {
+    int pass_samples = 16;          // Upper bound of samples per pixel rendered by one pass.
+    std::vector<int> preview_spp;   // Sample counts, in increasing order, that emit a preview.
+    std::string preview_path;
+
+    // When set, no pass is started that is predicted to end after the deadline.
+    std::optional<std::chrono::steady_clock::time_point> deadline;
+
+    // A checkpoint is saved at the first pass boundary after every interval, and
+    // when interrupt is raised, which also stops the render at that boundary.
+    std::string checkpoint_path;
+    double checkpoint_interval = 300.0;
+    const std::atomic<bool> *interrupt = nullptr;
+
+    // Passed on to the pass that completes the render, see renderer::render_pass.
+    std::function<void(int, int)> final_rows_done;
+
+    // Called with the samples per pixel reached after every pass.
+    std::function<void(int)> pass_done;
+};
+
+// Renders the frame in passes of a few samples per pixel, accumulating into fb.
+// Passes end exactly on the preview sample counts, and each preview is handed to
+// the writer thread while the workers continue with the next pass.
+// The render continues from first_sample, the samples fb already holds, and
+// returns the number of samples per pixel it reached.
+inline int render_progressive(const renderer &r, thread_pool &pool, framebuffer &fb,
+                              const progressive_settings &progressive, preview_writer &previews, int first_sample = 0) {
+    using clock = std::chrono::steady_clock;
+
+    const auto total = r.settings.sample_per_pixel;
+    auto next_preview = std::upper_bound(progressive.preview_spp.begin(), progressive.preview_spp.end(), first_sample);
+    int done = first_sample;
+    auto last_checkpoint = clock::now();
+    int checkpointed = -1;      // Samples per pixel of the last checkpoint saved.
+
+    // Smoothed cost of one sample per pixel over the whole frame, it tracks
+    // changes of the machine load while the render goes on.
+    double seconds_per_sample = 0.0;
+
+    while (done < total) {
+        if (progressive.interrupt && *progressive.interrupt) { break; }
+
+        auto end = std::min(total, done + progressive.pass_samples);
+        if (next_preview != progressive.preview_spp.end()) {
+            end = std::min(end, *next_preview);
+        }
+
+        if (progressive.deadline) {
+            if (seconds_per_sample == 0.0) {
+                // The first pass is a single sample, it measures the cost and
+                // guarantees there is an image to deliver.
+                end = done + 1;
+            } else {
+                const std::chrono::duration<double> remaining = *progressive.deadline - clock::now();
+                const auto affordable = static_cast<int>(std::min<double>(remaining.count() / seconds_per_sample, total));
+                if (affordable < 1) { break; }
+                end = std::min(end, done + affordable);
+            }
+        }
+
+        const auto pass_start = clock::now();
+        r.render_pass(pool, fb, done, end - done, end == total ? progressive.final_rows_done : nullptr);
+        const std::chrono::duration<double> pass_time = clock::now() - pass_start;
+
+        const auto measured = pass_time.count() / (end - done);
+        seconds_per_sample = seconds_per_sample == 0.0 ? measured : 0.5 * (seconds_per_sample + measured);
+        done = end;
+
+        if (next_preview != progressive.preview_spp.end() && *next_preview == done) {
+            previews.post(fb, progressive.preview_path);
+            ++next_preview;
+        }
+
+        const std::chrono::duration<double> since_checkpoint = clock::now() - last_checkpoint;
+        const auto interrupted = progressive.interrupt && *progressive.interrupt;
+        if (!progressive.checkpoint_path.empty() && done < total
+                && (interrupted || since_checkpoint.count() >= progressive.checkpoint_interval)) {
+            save_checkpoint(progressive.checkpoint_path, fb, r.settings, done);
+            last_checkpoint = clock::now();
+            checkpointed = done;
+        }
+
+        std::cout << "\rSamples per pixel: " << done << '/' << total;
+        if (progressive.deadline) {
+            const std::chrono::duration<double> remaining = *progressive.deadline - clock::now();
+            const auto predicted = std::clamp(static_cast<int>(remaining.count() / seconds_per_sample), 0, total - done);
+            const auto passes = (predicted + progressive.pass_samples - 1) / progressive.pass_samples;
+            std::cout << ", predicted " << passes << " more passes (" << predicted << " spp) within the time budget   ";
+        }
+        std::cout << std::flush;
+        if (progressive.pass_done) { progressive.pass_done(done); }
+    }
+
+    // An interrupt raised after the checkpoint test of the last pass stops the
+    // loop at its top, the samples of that pass are saved here.
+    if (progressive.interrupt && *progressive.interrupt && !progressive.checkpoint_path.empty() && done < total && checkpointed != done) {
+        save_checkpoint(progressive.checkpoint_path, fb, r.settings, done);
+    }
+    return done;
+}
@@ -5,7 +5,7 @@
 struct ray {
     public:
         ray() {}
-        constexpr ray(const point3 &origin, const vec3 &direction) : origin(origin), direction(direction) {
+        constexpr ray(const point3 &origin, const vec3 &direction, double time = 0.0) : origin(origin), direction(direction), time(time) {
             if(direction.length_squared() != 1.0) {
                 this->direction = normalized(direction);
             }
@@ -18,4 +18,9 @@ struct ray {
     public: 
         point3 origin;
         vec3 direction;
+        double time = 0.0;      // Within the frame, 0 when the shutter of a full frame opens and 1 when it closes.
+        // Footprint of the ray for texture filtering, a cone of this width at the
+        // origin which widens by spread per unit of distance.
+        double width = 0.0;
+        double spread = 0.0;
 };
\ No newline at end of file
@@ -0,0 +1,198 @@
+#pragma once
+
+#include "camera.h"
+#include "framebuffer.h"
+#include "hittable.h"
+#include "material.h"
+#include "rtweekend.h"
+#include "thread_pool.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+
+// First surfaces seen by a camera ray. Albedo and normal guide the denoiser, the
+// distance and ids are the ones of the very first hit, specular or not.
+struct first_hit {
+    color albedo;
+    vec3 normal;
+    double distance = infinity;
+    uint32_t material_id = 0;
+    uint32_t object_id = 0;
+};
+
+inline color sky_color(const ray &r) {
+    auto t = 0.5 * (r.direction.y + 1.0);
+    return (1.0 - t)*color(1.0) + t*color(0.5, 0.7, 1.0);
+}
+
+// Spread of the ray footprints after a diffuse bounce, which blurs the textures
+// seen through it.
+constexpr double diffuse_spread = 0.05;
+
+// When first is given it receives the guides of the first non-specular surface
+// along the path, tinted by the specular bounces before it.
+inline color ray_color(const ray &r, const hittable &world, int depth, first_hit *first = nullptr) {
+    // If we've exceeded the ray bounce limit, no more light is gathered.
+    if(depth <= 0) {
+        if(first) { first->albedo = first->normal = vec3(0.0); }
+        return color(0.0);
+    }
+
+    hit_record rec;
+    if(world.hit(r, 0.001, infinity, rec)) {
+        // Grazing rays cover more of the surface, the footprint keeps the longest side.
+        const auto width = r.width + rec.t * r.spread;
+        if(rec.material->textured) {
+            rec.footprint = width * rec.uv_scale / std::max(std::fabs(dot(r.direction, rec.normal)), 0.1);
+        }
+
+        if(first && first->distance == infinity) {
+            first->distance = rec.t * r.direction.length();
+            first->material_id = rec.material->material_id;
+            first->object_id = rec.object_id;
+        }
+
+        const auto follow = first && rec.material->is_specular();
+        if(first && !follow) {
+            first->albedo = rec.material->base_color(rec);
+            first->normal = rec.normal;
+        }
+
+        ray scattered;
+        color attenuation;
+        if(rec.material->scatter(r, rec, attenuation, scattered)) {
+            scattered.width = width;
+            scattered.spread = rec.material->is_specular() ? r.spread : std::max(r.spread, diffuse_spread);
+            const auto result = attenuation * ray_color(scattered, world, depth - 1, follow ? first : nullptr);
+            if(follow) { first->albedo = attenuation * first->albedo; }
+            return result;
+        }
+        if(follow) {
+            first->albedo = rec.material->base_color(rec);
+            first->normal = rec.normal;
+        }
+        return color(0.0);
+    }
+
+    const auto background = sky_color(r);
+    if(first) {
+        first->albedo = background;
+        first->normal = vec3(0.0);
+    }
+    return background;
+}
+
+struct render_settings {
+    int image_width = 1200;
+    int image_height = 800;
+    int sample_per_pixel = 500;
+    int max_depth = 50;
+    uint64_t seed = 0;
+    camera_settings camera;
+    uint64_t key = 0;           // Of the scene and the camera, see render_key. Checkpoints keep it.
+};
+
+// Pixel rectangle [x0, x1) x [y0, y1), y grows downwards from the top row.
+struct tile {
+    int x0, y0;
+    int x1, y1;
+};
+
+class renderer {
+    public:
+        static constexpr int tile_size = 32;
+
+        renderer(const hittable &world, const camera &cam, const render_settings &settings)
+            : world(world), cam(cam), settings(settings) { }
+
+        // Every sample draws its random numbers from a seed derived from the pixel and
+        // the sample index, so the result does not depend on tiling, thread count or
+        // on how the samples were split into passes.
+        uint64_t sample_seed(int x, int y, int s) const {
+            return hash_combine(hash_combine(hash_combine(settings.seed, x), y), s);
+        }
+
+        // Adds the samples [first_sample, first_sample + sample_count) of every pixel in t,
+        // and their AOVs when fb has any.
+        void render_tile(framebuffer &fb, const tile &t, int first_sample, int sample_count) const {
+            using clock = std::chrono::steady_clock;
+            const auto track_hits = fb.tracks_hits();
+            const auto track_time = !fb.render_time.empty();
+            const auto spread = cam.pixel_spread(settings.image_height);
+
+            for (int y = t.y0; y < t.y1; ++y) {
+                for (int x = t.x0; x < t.x1; ++x) {
+                    const auto pixel_start = track_time ? clock::now() : clock::time_point();
+                    color pixel_color(0);
+                    pixel_aovs aovs;
+
+                    for (int s = first_sample; s < first_sample + sample_count; ++s) {
+                        seed_random(sample_seed(x, y, s));
+                        auto u = (x + random_double()) / (settings.image_width - 1);
+                        auto v = (settings.image_height - 1 - y + random_double()) / (settings.image_height - 1);
+                        ray r = cam.get_ray(u, v);
+                        r.spread = spread;
+
+                        first_hit first;
+                        pixel_color += ray_color(r, world, settings.max_depth, track_hits ? &first : nullptr);
+                        if (track_hits) {
+                            aovs.albedo += first.albedo;
+                            aovs.normal += first.normal;
+                            if (first.distance < aovs.depth) {
+                                aovs.depth = static_cast<float>(first.distance);
+                                aovs.material_id = first.material_id;
+                                aovs.object_id = first.object_id;
+                            }
+                        }
+                    }
+
+                    fb.accumulate(x, y, pixel_color, sample_count);
+                    if (track_time) {
+                        aovs.seconds = std::chrono::duration<float>(clock::now() - pixel_start).count();
+                    }
+                    if (track_hits || track_time) {
+                        fb.accumulate_aovs(x, y, aovs);
+                    }
+                }
+            }
+        }
+
+        // Tiles covering the rectangle [x0, x0 + width) x [y0, y0 + height), row by row.
+        static std::vector<tile> tiles(int x0, int y0, int width, int height, int size = tile_size) {
+            std::vector<tile> result;
+            for (int y = y0; y < y0 + height; y += size) {
+                for (int x = x0; x < x0 + width; x += size) {
+                    result.push_back({x, y, std::min(x + size, x0 + width), std::min(y + size, y0 + height)});
+                }
+            }
+            return result;
+        }
+
+        // Renders one pass of sample_count samples per pixel over the part of the
+        // image covered by fb. When given, rows_done(y0, y1) is called from a worker
+        // as soon as every tile of the rows [y0, y1) has finished the pass.
+        void render_pass(thread_pool &pool, framebuffer &fb, int first_sample, int sample_count,
+                         const std::function<void(int, int)> &rows_done = {}) const {
+            const auto work = tiles(fb.origin_x, fb.origin_y, fb.width, fb.height);
+            const auto tiles_per_row = (fb.width + tile_size - 1) / tile_size;
+            std::vector<std::atomic<int>> remaining((work.size() + tiles_per_row - 1) / tiles_per_row);
+            for (auto &count : remaining) { count = tiles_per_row; }
+
+            pool.parallel_for(work.size(), [&](size_t i) {
+                render_tile(fb, work[i], first_sample, sample_count);
+                if (rows_done && --remaining[i / tiles_per_row] == 0) {
+                    rows_done(work[i].y0, work[i].y1);
+                }
+            });
+        }
+
+    public:
+        const hittable &world;
+        const camera &cam;
+        render_settings settings;
+};
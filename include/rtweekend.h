@@ -1,6 +1,7 @@
 #pragma once
 
 #include <cmath>
+#include <cstdint>
 #include <cstdlib>
 #include <limits>
 #include <memory>
@@ -19,8 +20,28 @@ constexpr double degree_to_radians(double degrees) {
     return degrees * pi / 180.0;
 }
 
+// Random numbers come from a per-thread splitmix64 generator, so render workers
+// never share state. The renderer reseeds it for every pixel sample, which makes
+// an image independent of how its pixels were split between threads.
+inline thread_local uint64_t random_state = 0;
+
+constexpr uint64_t mix64(uint64_t z) {
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+constexpr uint64_t hash_combine(uint64_t seed, uint64_t value) {
+    return mix64(seed ^ (value + 0x9e3779b97f4a7c15ULL + (seed << 6) + (seed >> 2)));
+}
+
+inline void seed_random(uint64_t seed) {
+    random_state = seed;
+}
+
 inline double random_double() {
-    return rand() / (RAND_MAX + 1.0);
+    random_state += 0x9e3779b97f4a7c15ULL;
+    return (mix64(random_state) >> 11) * 0x1.0p-53;
 }
 
 inline double random_double(double min, double max) {
@@ -68,4 +89,12 @@ inline vec3 random_in_unit_disk_full() {
 inline vec3 random_in_hemisphere(const vec3 &normal) {
     vec3 in_unit_sphere = random_in_unit_sphere();
     return dot(in_unit_sphere, normal) > 0.0 ? in_unit_sphere : -in_unit_sphere;
+}
+
+// Uniformly distributed over the unit sphere.
+inline vec3 random_unit_vector() {
+    const auto z = random_double(-1.0, 1.0);
+    const auto phi = random_double(0.0, tao);
+    const auto r = std::sqrt(1.0 - z*z);
+    return vec3(r * std::cos(phi), r * std::sin(phi), z);
 }
\ No newline at end of file
@@ -0,0 +1,268 @@
+#pragma once
+
+#include "aabb.h"
+#include "bvh.h"
+#include "bvh_refit.h"
+#include "hittable.h"
+#include "material.h"
+#include "materials.h"
+#include "medium.h"
+#include "rtweekend.h"
+#include "sphere.h"
+#include "transform.h"
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+
+enum class material_type : uint32_t {
+    lambertian,
+    metal,
+    dielectric,
+};
+
+// Plain data form of the material classes, as scene files store them.
+struct material_desc {
+    material_type type = material_type::lambertian;
+    float albedo[3] = {0.0f, 0.0f, 0.0f};
+    float fuzz = 0.0f;
+    float ir = 1.0f;
+    uint32_t texture = 0;       // One plus the index of the scene texture replacing the albedo, 0 for none.
+};
+
+// The textures are those of the scene, in file order.
+inline std::shared_ptr<material> make_material(const material_desc &desc, std::span<const std::shared_ptr<const texture>> textures = {}) {
+    const color albedo(desc.albedo[0], desc.albedo[1], desc.albedo[2]);
+    if (desc.texture > textures.size()) { throw std::runtime_error("Material texture out of range"); }
+    const auto tex = desc.texture > 0 ? textures[desc.texture - 1] : nullptr;
+    switch (desc.type) {
+        case material_type::lambertian: return tex ? std::make_shared<lambertian>(tex) : std::make_shared<lambertian>(albedo);
+        case material_type::metal: return tex ? std::make_shared<metal>(tex, desc.fuzz) : std::make_shared<metal>(albedo, desc.fuzz);
+        case material_type::dielectric: return std::make_shared<dielectric>(desc.ir);
+    }
+    throw std::runtime_error("Unknown material type");
+}
+
+// Triangle mesh of a scene, imported from an OBJ or PLY file.
+struct mesh_reference {
+    std::string path;           // Relative paths start from the directory of the scene file.
+    uint32_t material = 0;
+    bool placed = true;         // False for objects which only appear through instances.
+    bool streamed = false;      // Read from disk in clusters instead of loaded.
+};
+
+enum class texture_type : uint32_t {
+    image,
+    noise,
+};
+
+// Texture of a scene, an image or Perlin noise.
+struct texture_reference {
+    texture_type type = texture_type::image;
+    std::string path;           // Relative paths start from the directory of the scene file.
+    bool srgb = true;           // False for 8-bit images of linear data.
+    float scale = 1.0f;         // Of the noise, its frequency in world space.
+    uint32_t octaves = 1;
+    bool marble = false;
+};
+
+// A placement of a mesh, the rows of its affine transform to world space at
+// time 0, and the distance it moves by time 1.
+struct instance_desc {
+    uint32_t mesh = 0;
+    float transform[12] = {1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 0.0f};
+    float motion[3] = {0.0f, 0.0f, 0.0f};
+};
+
+// A box of participating medium, fog of a constant density or, with a noise
+// scale, smoke whose density follows Perlin noise.
+struct medium_desc {
+    float min[3] = {0.0f, 0.0f, 0.0f};
+    float max[3] = {0.0f, 0.0f, 0.0f};
+    float density = 0.0f;       // Scattering events per unit of length, the largest one of smoke.
+    float albedo[3] = {0.0f, 0.0f, 0.0f};
+    float noise_scale = 0.0f;   // 0 for fog.
+    uint32_t octaves = 1;
+};
+
+inline std::shared_ptr<medium> make_medium(const medium_desc &desc, uint32_t material_id) {
+    const point3 lo(desc.min[0], desc.min[1], desc.min[2]), hi(desc.max[0], desc.max[1], desc.max[2]);
+    auto phase = std::make_shared<isotropic>(color(desc.albedo[0], desc.albedo[1], desc.albedo[2]));
+    phase->material_id = material_id;
+    if (desc.noise_scale <= 0.0f) { return std::make_shared<medium>(lo, hi, desc.density, std::move(phase)); }
+    return std::make_shared<medium>(noise_density(lo, hi, desc.density, desc.noise_scale, static_cast<int>(desc.octaves)), std::move(phase));
+}
+
+inline transform instance_transform(const instance_desc &desc) {
+    transform t;
+    for (int i = 0; i < 12; ++i) { t.m[i / 4][i % 4] = desc.transform[i]; }
+    return t;
+}
+
+// Arrays of a scene read from text, owned by the scene_description.
+struct scene_arrays {
+    std::vector<float> center_x;
+    std::vector<float> center_y;
+    std::vector<float> center_z;
+    std::vector<float> radius;
+    std::vector<uint32_t> material;
+    std::vector<float> motion_x;
+    std::vector<float> motion_y;
+    std::vector<float> motion_z;
+    std::vector<material_desc> materials;
+    std::vector<instance_desc> instances;
+    std::vector<medium_desc> media;
+};
+
+// A loaded scene. Spheres are kept in structure of arrays layout and refer to
+// their material by index. The motion arrays hold the distance each sphere moves
+// during the frame, they are empty when none moves. The arrays are views of the storage, parsed vectors
+// or a mapped binary scene file, so a description can be moved and copied freely.
+struct scene_description {
+    std::span<const float> center_x;
+    std::span<const float> center_y;
+    std::span<const float> center_z;
+    std::span<const float> radius;
+    std::span<const uint32_t> material;
+    std::span<const float> motion_x;
+    std::span<const float> motion_y;
+    std::span<const float> motion_z;
+    std::span<const material_desc> materials;
+    std::span<const instance_desc> instances;
+    std::span<const medium_desc> media;
+
+    // Command line options set by the file, the real command line overrides them.
+    std::vector<std::string> default_args;
+    std::vector<mesh_reference> meshes;
+    std::vector<texture_reference> textures;
+
+    std::shared_ptr<const void> storage;
+
+    scene_description() = default;
+
+    explicit scene_description(std::shared_ptr<const scene_arrays> arrays)
+        : center_x(arrays->center_x), center_y(arrays->center_y), center_z(arrays->center_z), radius(arrays->radius),
+          material(arrays->material), motion_x(arrays->motion_x), motion_y(arrays->motion_y), motion_z(arrays->motion_z),
+          materials(arrays->materials), instances(arrays->instances), media(arrays->media), storage(std::move(arrays)) { }
+
+    size_t sphere_count() const { return radius.size(); }
+    bool spheres_move() const { return !motion_x.empty(); }
+
+    point3 center(size_t sphere, double time) const {
+        point3 c(center_x[sphere], center_y[sphere], center_z[sphere]);
+        if (spheres_move()) { c += time * vec3(motion_x[sphere], motion_y[sphere], motion_z[sphere]); }
+        return c;
+    }
+};
+
+// Bounds of every sphere at a time of the frame.
+inline std::vector<aabb> sphere_bounds(const scene_description &scene, double time = 0.0) {
+    std::vector<aabb> bounds(scene.sphere_count());
+    for (size_t i = 0; i < bounds.size(); ++i) { bounds[i] = sphere_box(scene.center(i, time), scene.radius[i]); }
+    return bounds;
+}
+
+// Hierarchy of the spheres, over their motion when they move.
+inline bvh build_sphere_bvh(const scene_description &scene, const bvh_build_settings &settings) {
+    if (!scene.spheres_move()) { return build_bvh(sphere_bounds(scene), settings); }
+    return build_motion_bvh(sphere_bounds(scene, 0.0), sphere_bounds(scene, 1.0), settings);
+}
+
+// Key of the hierarchy of the spheres, see bvh_key.
+inline uint64_t sphere_bvh_key(const scene_description &scene, const bvh_build_settings &settings) {
+    return bvh_key({scene.center_x, scene.center_y, scene.center_z, scene.radius, scene.motion_x, scene.motion_y, scene.motion_z}, settings);
+}
+
+// Key of everything a scene holds, so checkpoints of different scenes can be
+// told apart. Meshes and textures count by their references.
+inline uint64_t scene_key(const scene_description &scene) {
+    uint64_t key = scene.sphere_count();
+    auto hash = [&key](auto span) { key = bvh_detail::hash_bytes(span.data(), span.size_bytes(), key); };
+    hash(scene.center_x);
+    hash(scene.center_y);
+    hash(scene.center_z);
+    hash(scene.radius);
+    hash(scene.material);
+    hash(scene.motion_x);
+    hash(scene.motion_y);
+    hash(scene.motion_z);
+    hash(scene.materials);
+    hash(scene.instances);
+    hash(scene.media);
+    for (const auto &mesh : scene.meshes) {
+        key = hash_combine(key, (uint64_t(mesh.material) << 2) | (uint64_t(mesh.placed) << 1) | uint64_t(mesh.streamed));
+        hash(std::span(mesh.path));
+    }
+    for (const auto &texture : scene.textures) {
+        key = hash_combine(hash_combine(key, static_cast<uint64_t>(texture.type)), (uint64_t(texture.octaves) << 2) | (uint64_t(texture.srgb) << 1) | uint64_t(texture.marble));
+        key = hash_combine(key, std::bit_cast<uint32_t>(texture.scale));
+        hash(std::span(texture.path));
+    }
+    return key;
+}
+
+// The spheres of a scene as a single hittable, intersected through a bounding
+// volume hierarchy. The object id of a sphere is its index in the file plus one.
+class sphere_array : public hittable {
+    public:
+        // The materials are those of the scene, shared with its meshes.
+        sphere_array(scene_description scene, bvh tree, std::vector<std::shared_ptr<material>> materials)
+            : scene(std::move(scene)), tree(std::move(tree)), materials(std::move(materials)) { }
+
+        virtual aabb bounds() const override { return tree.bounds(); }
+
+        virtual bool hit(const ray &r, double t_min, double t_max, hit_record &rec) const override {
+            const auto count = scene.sphere_count();
+            size_t closest = count;
+            auto closest_t = t_max;
+            traverse_bvh(tree, box_ray(r), static_cast<float>(t_min), closest_t, [&](const bvh_node &leaf) {
+                for (uint32_t i = leaf.first; i < leaf.first + leaf.count; ++i) {
+                    const auto sphere = tree.indices[i];
+                    if (hit_sphere(r, sphere, t_min, closest_t)) { closest = sphere; }
+                }
+            });
+            if (closest == count) { return false; }
+
+            rec.t = closest_t;
+            rec.p = r.at(rec.t);
+            const auto outward_normal = (rec.p - scene.center(closest, r.time)) / scene.radius[closest];
+            rec.set_face_normal(r, outward_normal);
+            rec.material = materials[scene.material[closest]].get();
+            rec.object_id = static_cast<uint32_t>(closest + 1);
+            if (rec.material->textured) { set_sphere_uv(rec, outward_normal, scene.radius[closest]); }
+            return true;
+        }
+
+    private:
+        // Lowers closest_t and returns true if the ray hits the sphere before it.
+        bool hit_sphere(const ray &r, size_t i, double t_min, double &closest_t) const {
+            const vec3 oc = r.origin - scene.center(i, r.time);
+            const double radius = scene.radius[i];
+            const auto half_b = dot(oc, r.direction);
+            const auto c = oc.length_squared() - radius*radius;
+
+            // The ray direction is normalized, so a is 1.
+            const auto discriminant = half_b*half_b - c;
+            if (discriminant < 0.0) { return false; }
+            const auto sqrtd = std::sqrt(discriminant);
+
+            auto root = -half_b - sqrtd;
+            if (root < t_min || closest_t < root) {
+                root = -half_b + sqrtd;
+                if (root < t_min || closest_t < root) { return false; }
+            }
+            closest_t = root;
+            return true;
+        }
+
+    private:
+        scene_description scene;
+        bvh tree;
+        std::vector<std::shared_ptr<material>> materials;
+};
@@ -0,0 +1,260 @@
+#pragma once
+
+#include "mapped_file.h"
+#include "scene.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+
+// Binary scene file (.rtsc): a fixed header followed by the arrays of the
+// scene_description in their in-memory layout and host byte order, each
+// starting on a 64 byte boundary, then the default options as NUL terminated
+// strings and the meshes, each a material index, a placed and a streamed flag
+// followed by its NUL terminated path, and the textures, each a texture_record followed by
+// its NUL terminated path. Loading maps the file and points the description at it, so nothing
+// is parsed, copied or allocated per sphere.
+struct scene_file_header {
+    char magic[4] = {'R', 'T', 'S', 'C'};
+    uint32_t version = 8;
+    uint64_t sphere_count = 0;
+    uint64_t motion_count = 0;      // The sphere count when spheres move, otherwise 0.
+    uint64_t material_count = 0;
+    uint64_t instance_count = 0;
+    uint64_t medium_count = 0;
+    uint64_t options_size = 0;  // Bytes of the default options.
+    uint64_t meshes_size = 0;   // Bytes of the mesh references.
+    uint64_t textures_size = 0; // Bytes of the texture references.
+};
+
+namespace scene_binary_detail {
+    constexpr size_t alignment = 64;
+
+    // Fixed part of a texture reference.
+    struct texture_record {
+        texture_type type;
+        uint32_t srgb;
+        float scale;
+        uint32_t octaves;
+        uint32_t marble;
+    };
+
+    // Offsets of the arrays in the file, in file order.
+    struct layout {
+        size_t center_x, center_y, center_z, radius, material, motion_x, motion_y, motion_z, materials, instances, media, options, meshes, textures, size;
+    };
+
+    inline layout file_layout(const scene_file_header &header) {
+        auto offset = sizeof(scene_file_header);
+        auto next = [&offset](size_t bytes) {
+            offset = (offset + alignment - 1) / alignment * alignment;
+            const auto start = offset;
+            offset += bytes;
+            return start;
+        };
+
+        const auto floats = header.sphere_count * sizeof(float);
+        layout l;
+        l.center_x = next(floats);
+        l.center_y = next(floats);
+        l.center_z = next(floats);
+        l.radius = next(floats);
+        l.material = next(header.sphere_count * sizeof(uint32_t));
+        l.motion_x = next(header.motion_count * sizeof(float));
+        l.motion_y = next(header.motion_count * sizeof(float));
+        l.motion_z = next(header.motion_count * sizeof(float));
+        l.materials = next(header.material_count * sizeof(material_desc));
+        l.instances = next(header.instance_count * sizeof(instance_desc));
+        l.media = next(header.medium_count * sizeof(medium_desc));
+        l.options = next(header.options_size);
+        l.meshes = next(header.meshes_size);
+        l.textures = next(header.textures_size);
+        l.size = offset;
+        return l;
+    }
+
+    template <typename T>
+    std::span<const T> view(const mapped_file &file, size_t offset, size_t count) {
+        return std::span<const T>(reinterpret_cast<const T *>(file.data() + offset), count);
+    }
+}
+
+inline void save_scene_binary(const std::string &path, const scene_description &scene) {
+    using namespace scene_binary_detail;
+
+    std::string options;
+    for (const auto &option : scene.default_args) {
+        options += option;
+        options += '\0';
+    }
+
+    std::string meshes;
+    for (const auto &mesh : scene.meshes) {
+        const uint32_t placed = mesh.placed, streamed = mesh.streamed;
+        meshes.append(reinterpret_cast<const char *>(&mesh.material), sizeof(mesh.material));
+        meshes.append(reinterpret_cast<const char *>(&placed), sizeof(placed));
+        meshes.append(reinterpret_cast<const char *>(&streamed), sizeof(streamed));
+        meshes += mesh.path;
+        meshes += '\0';
+    }
+
+    std::string textures;
+    for (const auto &texture : scene.textures) {
+        const texture_record record{texture.type, texture.srgb, texture.scale, texture.octaves, texture.marble};
+        textures.append(reinterpret_cast<const char *>(&record), sizeof(record));
+        textures += texture.path;
+        textures += '\0';
+    }
+
+    scene_file_header header;
+    header.sphere_count = scene.sphere_count();
+    header.motion_count = scene.motion_x.size();
+    header.material_count = scene.materials.size();
+    header.instance_count = scene.instances.size();
+    header.medium_count = scene.media.size();
+    header.options_size = options.size();
+    header.meshes_size = meshes.size();
+    header.textures_size = textures.size();
+    const auto l = file_layout(header);
+
+    const auto temp_path = path + ".tmp";
+    {
+        std::ofstream out(temp_path, std::ios::binary | std::ios::trunc);
+        auto write_at = [&out](size_t offset, const void *data, size_t size) {
+            static const char padding[alignment] = {};
+            out.write(padding, static_cast<std::streamsize>(offset - static_cast<size_t>(out.tellp())));
+            out.write(static_cast<const char *>(data), static_cast<std::streamsize>(size));
+        };
+        out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        write_at(l.center_x, scene.center_x.data(), scene.center_x.size_bytes());
+        write_at(l.center_y, scene.center_y.data(), scene.center_y.size_bytes());
+        write_at(l.center_z, scene.center_z.data(), scene.center_z.size_bytes());
+        write_at(l.radius, scene.radius.data(), scene.radius.size_bytes());
+        write_at(l.material, scene.material.data(), scene.material.size_bytes());
+        write_at(l.motion_x, scene.motion_x.data(), scene.motion_x.size_bytes());
+        write_at(l.motion_y, scene.motion_y.data(), scene.motion_y.size_bytes());
+        write_at(l.motion_z, scene.motion_z.data(), scene.motion_z.size_bytes());
+        write_at(l.materials, scene.materials.data(), scene.materials.size_bytes());
+        write_at(l.instances, scene.instances.data(), scene.instances.size_bytes());
+        write_at(l.media, scene.media.data(), scene.media.size_bytes());
+        write_at(l.options, options.data(), options.size());
+        write_at(l.meshes, meshes.data(), meshes.size());
+        write_at(l.textures, textures.data(), textures.size());
+        if (!out) { throw std::runtime_error("Unable to write the scene: " + temp_path); }
+    }
+    if (std::rename(temp_path.c_str(), path.c_str()) != 0) {
+        throw std::runtime_error("Unable to write the scene: " + path);
+    }
+}
+
+// Maps a binary scene file. The description keeps the mapping alive.
+inline scene_description map_scene(const std::string &path) {
+    using namespace scene_binary_detail;
+
+    auto file = std::make_shared<const mapped_file>(path);
+    const scene_file_header expected;
+    scene_file_header header;
+    if (file->size() < sizeof(header)) { throw std::runtime_error("Not a binary scene file: " + path); }
+    std::memcpy(&header, file->data(), sizeof(header));
+    if (std::memcmp(header.magic, expected.magic, sizeof(header.magic)) != 0) { throw std::runtime_error("Not a binary scene file: " + path); }
+    if (header.version != expected.version) {
+        throw std::runtime_error(path + " is a binary scene of version " + std::to_string(header.version)
+                                 + ", convert its text again for version " + std::to_string(expected.version));
+    }
+    // Guards the layout arithmetic against absurd counts before the size check.
+    if (header.sphere_count > file->size() || header.material_count > file->size() || header.instance_count > file->size()
+            || header.medium_count > file->size() || header.options_size > file->size() || header.meshes_size > file->size()
+            || header.textures_size > file->size()) {
+        throw std::runtime_error("The binary scene " + path + " is truncated");
+    }
+    if (header.motion_count != 0 && header.motion_count != header.sphere_count) {
+        throw std::runtime_error("The binary scene " + path + " is corrupt");
+    }
+    if (file_layout(header).size > file->size()) { throw std::runtime_error("The binary scene " + path + " is truncated"); }
+
+    const auto l = file_layout(header);
+    scene_description scene;
+    scene.center_x = view<float>(*file, l.center_x, header.sphere_count);
+    scene.center_y = view<float>(*file, l.center_y, header.sphere_count);
+    scene.center_z = view<float>(*file, l.center_z, header.sphere_count);
+    scene.radius = view<float>(*file, l.radius, header.sphere_count);
+    scene.material = view<uint32_t>(*file, l.material, header.sphere_count);
+    scene.motion_x = view<float>(*file, l.motion_x, header.motion_count);
+    scene.motion_y = view<float>(*file, l.motion_y, header.motion_count);
+    scene.motion_z = view<float>(*file, l.motion_z, header.motion_count);
+    scene.materials = view<material_desc>(*file, l.materials, header.material_count);
+    scene.instances = view<instance_desc>(*file, l.instances, header.instance_count);
+    scene.media = view<medium_desc>(*file, l.media, header.medium_count);
+
+    // A bad index would read outside the materials while rendering.
+    const auto material_count = static_cast<uint32_t>(header.material_count);
+    if (std::ranges::any_of(scene.material, [material_count](uint32_t index) { return index >= material_count; })
+            || std::ranges::any_of(scene.materials, [](const material_desc &desc) { return desc.type > material_type::dielectric; })) {
+        throw std::runtime_error("The binary scene " + path + " is corrupt");
+    }
+
+    const auto *options = reinterpret_cast<const char *>(file->data() + l.options);
+    for (size_t start = 0, end; start < header.options_size; start = end + 1) {
+        end = std::find(options + start, options + header.options_size, '\0') - options;
+        scene.default_args.emplace_back(options + start, end - start);
+    }
+
+    const auto *meshes = reinterpret_cast<const char *>(file->data() + l.meshes);
+    for (size_t start = 0; start < header.meshes_size;) {
+        mesh_reference mesh;
+        uint32_t placed = 0, streamed = 0;
+        constexpr auto fixed = sizeof(mesh.material) + sizeof(placed) + sizeof(streamed);
+        const auto *end = std::find(meshes + start + std::min(fixed, header.meshes_size - start), meshes + header.meshes_size, '\0');
+        if (end == meshes + header.meshes_size || end - meshes - start < static_cast<std::ptrdiff_t>(fixed)) {
+            throw std::runtime_error("The binary scene " + path + " is corrupt");
+        }
+        std::memcpy(&mesh.material, meshes + start, sizeof(mesh.material));
+        std::memcpy(&placed, meshes + start + sizeof(mesh.material), sizeof(placed));
+        std::memcpy(&streamed, meshes + start + sizeof(mesh.material) + sizeof(placed), sizeof(streamed));
+        mesh.placed = placed != 0;
+        mesh.streamed = streamed != 0;
+        mesh.path.assign(meshes + start + fixed, end);
+        if (mesh.material >= material_count) { throw std::runtime_error("The binary scene " + path + " is corrupt"); }
+        scene.meshes.push_back(std::move(mesh));
+        start = static_cast<size_t>(end - meshes) + 1;
+    }
+
+    const auto *textures = reinterpret_cast<const char *>(file->data() + l.textures);
+    for (size_t start = 0; start < header.textures_size;) {
+        texture_reference texture;
+        texture_record record;
+        const auto *end = std::find(textures + start + std::min(sizeof(record), header.textures_size - start), textures + header.textures_size, '\0');
+        if (end == textures + header.textures_size || end - textures - start < static_cast<std::ptrdiff_t>(sizeof(record))) {
+            throw std::runtime_error("The binary scene " + path + " is corrupt");
+        }
+        std::memcpy(&record, textures + start, sizeof(record));
+        if (record.type > texture_type::noise || record.octaves < 1 || record.octaves > 16) {
+            throw std::runtime_error("The binary scene " + path + " is corrupt");
+        }
+        texture = {record.type, std::string(textures + start + sizeof(record), end), record.srgb != 0, record.scale, record.octaves, record.marble != 0};
+        scene.textures.push_back(std::move(texture));
+        start = static_cast<size_t>(end - textures) + 1;
+    }
+    if (std::ranges::any_of(scene.materials, [&scene](const material_desc &desc) { return desc.texture > scene.textures.size(); })) {
+        throw std::runtime_error("The binary scene " + path + " is corrupt");
+    }
+
+    if (std::ranges::any_of(scene.instances, [&scene](const instance_desc &desc) { return desc.mesh >= scene.meshes.size(); })) {
+        throw std::runtime_error("The binary scene " + path + " is corrupt");
+    }
+    auto bad_medium = [](const medium_desc &desc) {
+        return !(desc.min[0] < desc.max[0] && desc.min[1] < desc.max[1] && desc.min[2] < desc.max[2] && desc.density >= 0.0f)
+               || desc.octaves < 1 || desc.octaves > 16;
+    };
+    if (std::ranges::any_of(scene.media, bad_medium)) { throw std::runtime_error("The binary scene " + path + " is corrupt"); }
+
+    scene.storage = std::move(file);
+    return scene;
+}
@@ -0,0 +1,356 @@
+#pragma once
+
+#include "scene.h"
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+
+// Text scene format, one statement per line, # starts a comment:
+//   settings width 400 height 300 spp 64 max_depth 50 seed 1
+//   camera lookfrom 13 2 3 lookat 0 0 0 vup 0 1 0 fov 20 aperture 0.1 focus_distance 10 shutter 0 1
+//   texture <name> <path of an image> [linear]
+//   texture <name> noise <scale> [octaves <count>] [marble]
+//   material <name> lambertian <r> <g> <b>
+//   material <name> lambertian texture <texture name>
+//   material <name> metal <r> <g> <b> <fuzz>
+//   material <name> metal texture <texture name> <fuzz>
+//   material <name> dielectric <index of refraction>
+//   sphere <x> <y> <z> <radius> <material name>
+//   sphere <x> <y> <z> <radius> <material type and parameters>
+//   sphere <x> <y> <z> <radius> <material> move <dx> <dy> <dz>
+//   mesh <path of an .obj or .ply file> <material name or type and parameters> [stream]
+//   object <name> <path of an .obj or .ply file> <material name or type and parameters> [stream]
+//   instance <object name> translate <x> <y> <z> rotate <x|y|z> <degrees> scale <x> <y> <z> move <dx> <dy> <dz>
+//   medium <x0> <y0> <z0> <x1> <y1> <z1> <density> <r> <g> <b> [noise <scale> [octaves <count>]]
+// The settings and camera keys are defaults for the matching command line options.
+// Spheres and meshes may define their material inline, which doesn't need a
+// name. Mesh and texture paths are relative to the directory of the scene file.
+// Textures are images stb_image reads, 8-bit ones are sRGB colors unless they
+// are marked linear. Noise textures are solid Perlin noise, turbulence with
+// more than one octave. A texture replaces the albedo of a material. An object
+// is a mesh which is only drawn by its instances, which all share it. The
+// transforms of an instance apply in the order given, in any number. Spheres
+// and instances that move go from their position at time 0 of the frame to
+// that position plus the move at time 1, the shutter blurs their motion. A
+// medium fills the box between two corners with fog of a density, in
+// scattering events per unit of length, and of an albedo. With noise it is
+// smoke instead, whose density goes from 0 to the one given with Perlin noise.
+// A streamed mesh stays on disk, in clusters read on demand within the memory
+// budget of the geometry cache, for meshes too large to keep in memory.
+//
+// The parser makes a single pass over the text without copying it, tokens are
+// views into the buffer and numbers are converted in place with from_chars.
+class scene_parser {
+    public:
+        scene_parser(std::string_view text, std::string name) : text(text), name(std::move(name)) { }
+
+        scene_description parse() {
+            auto arrays = std::make_shared<scene_arrays>();
+            auto &scene = *arrays;
+            std::vector<std::string> default_args;
+            std::vector<mesh_reference> meshes;
+            std::vector<texture_reference> textures;
+            while (next_line()) {
+                const auto keyword = token();
+                if (keyword.empty()) { continue; }
+
+                if (keyword == "sphere") {
+                    scene.center_x.push_back(number());
+                    scene.center_y.push_back(number());
+                    scene.center_z.push_back(number());
+                    scene.radius.push_back(number());
+                    scene.material.push_back(material_reference(scene));
+                    sphere_motion(scene);
+                } else if (keyword == "mesh") {
+                    const auto path = token();
+                    if (path.empty()) { fail("expected the path of a mesh"); }
+                    auto material = material_reference(scene);
+                    meshes.push_back({std::string(path), material, true, line_continues_with("stream")});
+                } else if (keyword == "object") {
+                    const auto object_name = token();
+                    const auto path = token();
+                    if (path.empty()) { fail("expected the name and the path of an object"); }
+                    object_names[std::string(object_name)] = static_cast<uint32_t>(meshes.size());
+                    auto material = material_reference(scene);
+                    meshes.push_back({std::string(path), material, false, line_continues_with("stream")});
+                } else if (keyword == "instance") {
+                    scene.instances.push_back(instance());
+                } else if (keyword == "medium") {
+                    scene.media.push_back(medium());
+                } else if (keyword == "texture") {
+                    const auto texture_name = token();
+                    const auto path = token();
+                    if (path.empty()) { fail("expected the name and the path of a texture"); }
+                    texture_reference texture;
+                    if (path == "noise") {
+                        texture.type = texture_type::noise;
+                        texture.scale = number();
+                        for (auto key = token(); !key.empty(); key = token()) {
+                            if (key == "octaves") {
+                                const auto octaves = number();
+                                if (octaves < 1.0f || octaves > 16.0f || octaves != std::floor(octaves)) { fail("octaves must be a whole number from 1 to 16"); }
+                                texture.octaves = static_cast<uint32_t>(octaves);
+                            } else if (key == "marble") {
+                                texture.marble = true;
+                            } else {
+                                fail("unknown noise key " + std::string(key));
+                            }
+                        }
+                    } else {
+                        texture.path = path;
+                        const auto encoding = token();
+                        if (encoding == "linear") { texture.srgb = false; }
+                        else if (!encoding.empty()) { fail("unexpected text at the end of the line"); }
+                    }
+                    texture_names[std::string(texture_name)] = static_cast<uint32_t>(textures.size());
+                    textures.push_back(std::move(texture));
+                } else if (keyword == "material") {
+                    const auto material_name = token();
+                    if (material_name.empty()) { fail("expected a material name"); }
+                    material_names[std::string(material_name)] = static_cast<uint32_t>(scene.materials.size());
+                    scene.materials.push_back(material(token()));
+                } else if (keyword == "camera") {
+                    for (auto key = token(); !key.empty(); key = token()) {
+                        if (key == "lookfrom" || key == "lookat" || key == "vup") {
+                            const auto x = token(), y = token(), z = token();
+                            if (z.empty()) { fail("expected x y z after " + std::string(key)); }
+                            default_args.push_back("--" + std::string(key));
+                            default_args.push_back(std::string(x) + ',' + std::string(y) + ',' + std::string(z));
+                        } else if (key == "fov" || key == "aperture" || key == "focus_distance") {
+                            option(default_args, key);
+                        } else if (key == "shutter") {
+                            const auto open = token(), close = token();
+                            if (close.empty()) { fail("expected the open and close times of the shutter"); }
+                            default_args.push_back("--shutter");
+                            default_args.push_back(std::string(open) + ',' + std::string(close));
+                        } else {
+                            fail("unknown camera key " + std::string(key));
+                        }
+                    }
+                } else if (keyword == "settings") {
+                    for (auto key = token(); !key.empty(); key = token()) {
+                        if (key == "width" || key == "height" || key == "spp" || key == "max_depth" || key == "seed") {
+                            option(default_args, key);
+                        } else {
+                            fail("unknown setting " + std::string(key));
+                        }
+                    }
+                } else {
+                    fail("unknown statement " + std::string(keyword));
+                }
+
+                if (!token().empty()) { fail("unexpected text at the end of the line"); }
+            }
+
+            scene_description description(std::move(arrays));
+            description.default_args = std::move(default_args);
+            description.meshes = std::move(meshes);
+            description.textures = std::move(textures);
+            return description;
+        }
+
+    private:
+        // Moves to the next line, false at the end of the text.
+        bool next_line() {
+            if (position >= text.size()) { return false; }
+            const auto end = text.find('\n', position);
+            line = text.substr(position, end == std::string_view::npos ? std::string_view::npos : end - position);
+            position = end == std::string_view::npos ? text.size() : end + 1;
+            ++line_number;
+            return true;
+        }
+
+        // Next whitespace separated token of the line, empty at its end or at a comment.
+        std::string_view token() {
+            size_t start = 0;
+            while (start < line.size() && (line[start] == ' ' || line[start] == '\t' || line[start] == '\r')) { ++start; }
+            size_t end = start;
+            while (end < line.size() && line[end] != ' ' && line[end] != '\t' && line[end] != '\r') { ++end; }
+
+            const auto result = line.substr(start, end - start);
+            if (!result.empty() && result.front() == '#') {
+                line = {};
+                return {};
+            }
+            line = line.substr(end);
+            return result;
+        }
+
+        // Consumes the next token if it is word.
+        bool line_continues_with(std::string_view word) {
+            const auto rest = line;
+            if (token() == word) { return true; }
+            line = rest;
+            return false;
+        }
+
+        float number() {
+            const auto text = token();
+            float value = 0.0f;
+            const auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), value);
+            if (text.empty() || error != std::errc() || end != text.data() + text.size()) {
+                fail("expected a number" + (text.empty() ? std::string() : ", found " + std::string(text)));
+            }
+            return value;
+        }
+
+        // A material name, or an inline material added to the scene.
+        uint32_t material_reference(scene_arrays &scene) {
+            const auto reference = token();
+            const auto named = material_names.find(reference);
+            if (named != material_names.end()) { return named->second; }
+            scene.materials.push_back(material(reference));
+            return static_cast<uint32_t>(scene.materials.size() - 1);
+        }
+
+        material_desc material(std::string_view type) {
+            material_desc desc;
+            if (type == "lambertian" || type == "metal") {
+                desc.type = type == "metal" ? material_type::metal : material_type::lambertian;
+                if (line_continues_with("texture")) {
+                    const auto texture_name = token();
+                    const auto texture = texture_names.find(texture_name);
+                    if (texture == texture_names.end()) {
+                        fail(texture_name.empty() ? "expected a texture name" : "unknown texture " + std::string(texture_name));
+                    }
+                    desc.texture = texture->second + 1;
+                    for (auto &channel : desc.albedo) { channel = 1.0f; }
+                } else {
+                    for (auto &channel : desc.albedo) { channel = number(); }
+                }
+                if (desc.type == material_type::metal) { desc.fuzz = number(); }
+            } else if (type == "dielectric") {
+                desc.type = material_type::dielectric;
+                desc.ir = number();
+            } else {
+                fail(type.empty() ? "expected a material" : "unknown material " + std::string(type));
+            }
+            return desc;
+        }
+
+        // The optional move at the end of a sphere statement. The motion arrays
+        // appear with the first sphere that moves.
+        void sphere_motion(scene_arrays &scene) {
+            const auto count = scene.radius.size();
+            float motion[3] = {0.0f, 0.0f, 0.0f};
+            const auto key = token();
+            if (key == "move") {
+                for (auto &distance : motion) { distance = number(); }
+                if (scene.motion_x.empty()) {
+                    scene.motion_x.resize(count - 1, 0.0f);
+                    scene.motion_y.resize(count - 1, 0.0f);
+                    scene.motion_z.resize(count - 1, 0.0f);
+                }
+            } else if (!key.empty()) {
+                fail("unexpected text at the end of the line");
+            }
+            if (!scene.motion_x.empty()) {
+                scene.motion_x.push_back(motion[0]);
+                scene.motion_y.push_back(motion[1]);
+                scene.motion_z.push_back(motion[2]);
+            }
+        }
+
+        // An instance statement after its keyword.
+        instance_desc instance() {
+            const auto object_name = token();
+            const auto object = object_names.find(object_name);
+            if (object == object_names.end()) {
+                fail(object_name.empty() ? "expected an object name" : "unknown object " + std::string(object_name));
+            }
+
+            instance_desc desc;
+            transform placement;
+            for (auto key = token(); !key.empty(); key = token()) {
+                if (key == "translate") {
+                    const auto x = number(), y = number(), z = number();
+                    placement = transform::translation(vec3(x, y, z)) * placement;
+                } else if (key == "scale") {
+                    const auto x = number(), y = number(), z = number();
+                    if (x == 0.0f || y == 0.0f || z == 0.0f) { fail("an instance can't be scaled by zero"); }
+                    placement = transform::scaling(vec3(x, y, z)) * placement;
+                } else if (key == "move") {
+                    for (auto &distance : desc.motion) { distance += number(); }
+                } else if (key == "rotate") {
+                    const auto axis = token();
+                    if (axis != "x" && axis != "y" && axis != "z") { fail("expected the axis x, y or z to rotate around"); }
+                    placement = transform::rotation(axis[0] - 'x', number()) * placement;
+                } else {
+                    fail("unknown transform " + std::string(key));
+                }
+            }
+
+            desc.mesh = object->second;
+            for (int i = 0; i < 12; ++i) { desc.transform[i] = static_cast<float>(placement.m[i / 4][i % 4]); }
+            return desc;
+        }
+
+        // A medium statement after its keyword.
+        medium_desc medium() {
+            medium_desc desc;
+            for (auto &corner : desc.min) { corner = number(); }
+            for (auto &corner : desc.max) { corner = number(); }
+            for (int axis = 0; axis < 3; ++axis) {
+                if (!(desc.min[axis] < desc.max[axis])) { fail("the first corner of a medium must be below the second on every axis"); }
+            }
+            desc.density = number();
+            if (!(desc.density >= 0.0f)) { fail("the density of a medium must not be negative"); }
+            for (auto &channel : desc.albedo) { channel = number(); }
+
+            if (line_continues_with("noise")) {
+                desc.noise_scale = number();
+                if (!(desc.noise_scale > 0.0f)) { fail("the noise scale must be positive"); }
+                if (line_continues_with("octaves")) {
+                    const auto octaves = number();
+                    if (octaves < 1.0f || octaves > 16.0f || octaves != std::floor(octaves)) { fail("octaves must be a whole number from 1 to 16"); }
+                    desc.octaves = static_cast<uint32_t>(octaves);
+                }
+            }
+            return desc;
+        }
+
+        // A key with one value becomes the command line option --key value.
+        void option(std::vector<std::string> &default_args, std::string_view key) {
+            const auto value = token();
+            if (value.empty()) { fail("expected a value after " + std::string(key)); }
+            auto option = "--" + std::string(key);
+            std::replace(option.begin(), option.end(), '_', '-');
+            default_args.push_back(std::move(option));
+            default_args.emplace_back(value);
+        }
+
+        [[noreturn]] void fail(const std::string &message) const {
+            throw std::runtime_error(name + ':' + std::to_string(line_number) + ": " + message);
+        }
+
+    private:
+        std::string_view text;
+        std::string name;
+        std::string_view line;
+        size_t position = 0;
+        size_t line_number = 0;
+        std::map<std::string, uint32_t, std::less<>> material_names;
+        std::map<std::string, uint32_t, std::less<>> object_names;
+        std::map<std::string, uint32_t, std::less<>> texture_names;
+};
+
+inline scene_description load_scene(const std::string &path) {
+    std::ifstream in(path, std::ios::binary | std::ios::ate);
+    if (!in) { throw std::runtime_error("Unable to open the scene: " + path); }
+
+    std::string text(static_cast<size_t>(in.tellg()), '\0');
+    in.seekg(0);
+    in.read(text.data(), static_cast<std::streamsize>(text.size()));
+    if (!in) { throw std::runtime_error("Unable to read the scene: " + path); }
+
+    return scene_parser(text, path).parse();
+}
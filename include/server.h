@@ -0,0 +1,339 @@
+#pragma once
+
+#include "framebuffer.h"
+#include "options.h"
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+
+// A render queued on the server. The client that submitted it receives its
+// progress until the job ends, a client that disconnects doesn't stop the job.
+struct render_job {
+    uint64_t id = 0;
+    std::vector<std::string> arguments;     // The options of the request.
+    render_options options;                 // Parsed from arguments, not changed once queued.
+    std::optional<render_options> resolved; // With the scene defaults, only used by the runner.
+    int client = -1;
+    std::optional<framebuffer> fb;  // Samples rendered before a preemption.
+    std::atomic<int> samples_done = 0;
+    std::atomic<int> samples_total = 0;
+    std::atomic<bool> preempt = false;
+    bool complete = false;          // Set by the runner once the outputs are written.
+    std::optional<std::chrono::steady_clock::time_point> started;
+
+    // Sends a line to the client, and forgets a client that is gone.
+    void send(const std::string &line) {
+        const auto text = line + '\n';
+        if (client >= 0 && ::send(client, text.data(), text.size(), MSG_NOSIGNAL) != static_cast<ssize_t>(text.size())) {
+            close(client);
+            client = -1;
+        }
+    }
+
+    void finish(const std::string &line) {
+        send(line);
+        if (client >= 0) { close(client); }
+        client = -1;
+    }
+};
+
+namespace server_detail {
+    inline sockaddr_un socket_address(const std::string &path) {
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(address.sun_path)) { throw std::runtime_error("The socket path is too long: " + path); }
+        std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+        return address;
+    }
+
+    // A connection whose request line hasn't fully arrived yet.
+    struct pending_request {
+        int client;
+        std::string line;
+        std::chrono::steady_clock::time_point deadline;
+    };
+
+    // Reads what has arrived of a request without blocking. Returns true once
+    // the line is complete, and closes the connection when it can't complete.
+    inline bool read_request(pending_request &request) {
+        char buffer[4096];
+        const auto size = ::recv(request.client, buffer, sizeof(buffer), MSG_DONTWAIT);
+        if (size < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) { return false; }
+        if (size > 0) {
+            request.line.append(buffer, size);
+            if (const auto end = request.line.find('\n'); end != std::string::npos) {
+                request.line.resize(end);
+                return true;
+            }
+            if (request.line.size() < 16384) { return false; }
+        } else if (size == 0 && !request.line.empty()) {
+            return true;
+        }
+        close(request.client);
+        request.client = -1;
+        return false;
+    }
+
+    // Splits a request into words. A word can be quoted with double quotes,
+    // a backslash escapes the next character.
+    inline std::vector<std::string> split(const std::string &line) {
+        std::vector<std::string> result;
+        std::optional<std::string> word;
+        bool quoted = false;
+        for (size_t i = 0; i < line.size(); ++i) {
+            const char c = line[i];
+            if (!quoted && std::isspace(static_cast<unsigned char>(c))) {
+                if (word) { result.push_back(std::move(*word)); }
+                word.reset();
+                continue;
+            }
+            if (!word) { word.emplace(); }
+            if (c == '"') {
+                quoted = !quoted;
+            } else if (c == '\\' && i + 1 < line.size()) {
+                word->push_back(line[++i]);
+            } else {
+                word->push_back(c);
+            }
+        }
+        if (quoted) { throw std::invalid_argument("Unterminated quote in the request"); }
+        if (word) { result.push_back(std::move(*word)); }
+        return result;
+    }
+
+    // Quotes a word for split when it needs it.
+    inline std::string quote(const std::string &word) {
+        if (!word.empty() && word.find_first_of(" \t\r\n\"\\") == std::string::npos) { return word; }
+        std::string result = "\"";
+        for (const char c : word) {
+            if (c == '"' || c == '\\') { result.push_back('\\'); }
+            result.push_back(c);
+        }
+        return result + '"';
+    }
+}
+
+// Long-lived render daemon listening on a Unix socket. Every connection sends
+// one request line, words with spaces are quoted as in "my scene.txt":
+//   render <options>  queues a render, with the options of the command line.
+//                     The connection receives "queued <id>", then lines
+//                     "progress <id> <spp> <total>" and "preempted <id>", and
+//                     ends with "done <id> <seconds>" or "failed <id> <reason>".
+//   status            answers a line per job, the running one first.
+//   shutdown          stops once the running job reaches a pass boundary.
+// Jobs run one at a time on the shared thread pool, highest --priority first.
+// A job of higher priority than the running one preempts it at its next pass
+// boundary, the preempted job keeps its framebuffer and continues later on.
+class render_server {
+    public:
+        // Renders job from job.samples_done on, until done or until job.preempt
+        // is raised, keeping job.fb and job.samples_done up to date. Once the
+        // render is finished it writes the outputs and sets job.complete. The
+        // runner leaves job.options alone, the server reads them concurrently.
+        using job_runner = std::function<void(render_job &)>;
+
+        render_server(std::string socket_path, job_runner run) : socket_path(std::move(socket_path)), run(std::move(run)) { }
+
+        // Serves until a shutdown request or until interrupt is raised.
+        void serve(const std::atomic<bool> *interrupt = nullptr) {
+            using namespace server_detail;
+
+            const auto address = socket_address(socket_path);
+            const int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            ::unlink(socket_path.c_str());
+            if (listener < 0 || bind(listener, reinterpret_cast<const sockaddr *>(&address), sizeof(address)) != 0
+                    || listen(listener, 16) != 0) {
+                if (listener >= 0) { close(listener); }
+                throw std::runtime_error("Unable to listen on " + socket_path + ": " + std::strerror(errno));
+            }
+            std::cout << "Listening on " << socket_path << std::endl;
+
+            std::thread scheduler([this] { schedule(); });
+            // Requests are read as they arrive, so a client that is slow to send
+            // its request doesn't hold up the others.
+            std::vector<pending_request> pending;
+            while (!stopping()) {
+                if (interrupt && *interrupt) { stop(); break; }
+
+                std::vector<pollfd> ready{{listener, POLLIN, 0}};
+                for (const auto &request : pending) { ready.push_back({request.client, POLLIN, 0}); }
+                if (poll(ready.data(), ready.size(), 200) < 0) { continue; }
+
+                const auto now = std::chrono::steady_clock::now();
+                for (size_t i = 0; i < pending.size(); ++i) {
+                    auto &request = pending[i];
+                    if (ready[i + 1].revents != 0 && read_request(request)) {
+                        handle(request.client, request.line);
+                        request.client = -1;
+                    } else if (request.client >= 0 && now > request.deadline) {
+                        close(request.client);
+                        request.client = -1;
+                    }
+                }
+                std::erase_if(pending, [](const auto &request) { return request.client < 0; });
+
+                if (ready[0].revents & POLLIN) {
+                    const int client = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+                    if (client >= 0) { pending.push_back({client, {}, now + std::chrono::seconds(5)}); }
+                }
+            }
+            for (const auto &request : pending) { close(request.client); }
+
+            scheduler.join();
+            close(listener);
+            ::unlink(socket_path.c_str());
+        }
+
+    private:
+        void handle(int client, const std::string &request) {
+            std::vector<std::string> words;
+            try {
+                words = server_detail::split(request);
+            } catch (const std::invalid_argument &e) {
+                const std::string reply = std::string("failed 0 ") + e.what() + '\n';
+                ::send(client, reply.data(), reply.size(), MSG_NOSIGNAL);
+            }
+            if (words.empty()) {
+                close(client);
+                return;
+            }
+
+            if (words.front() == "status") {
+                std::string status;
+                {
+                    std::lock_guard lock(mutex);
+                    if (running) { status += describe(*running, "running"); }
+                    for (const auto &job : queue) { status += describe(*job, "queued"); }
+                }
+                ::send(client, status.data(), status.size(), MSG_NOSIGNAL);
+                close(client);
+            } else if (words.front() == "shutdown") {
+                stop();
+                close(client);
+            } else if (words.front() == "render") {
+                auto job = std::make_shared<render_job>();
+                job->client = client;
+
+                job->arguments.assign(words.begin() + 1, words.end());
+                try {
+                    job->options = parse_options(job->arguments);
+                    job->samples_total = job->options.settings.sample_per_pixel;
+                    if (job->options.mode != run_mode::render || job->options.stream) {
+                        throw std::invalid_argument("The server only runs progressive renders");
+                    }
+                } catch (const std::invalid_argument &e) {
+                    job->finish(std::string("failed 0 ") + e.what());
+                    return;
+                }
+
+                {
+                    std::lock_guard lock(mutex);
+                    job->id = ++last_id;
+                    job->send("queued " + std::to_string(job->id));
+                    queue.push_back(job);
+                    if (running && job->options.priority > running->options.priority) { running->preempt = true; }
+                }
+                wake.notify_one();
+            } else {
+                const std::string reply = "failed 0 Unknown request: " + words.front() + '\n';
+                ::send(client, reply.data(), reply.size(), MSG_NOSIGNAL);
+                close(client);
+            }
+        }
+
+        // Runs the queued jobs, highest priority first and in arrival order among equals.
+        void schedule() {
+            while (true) {
+                std::shared_ptr<render_job> job;
+                {
+                    std::unique_lock lock(mutex);
+                    wake.wait(lock, [this] { return shutting_down || !queue.empty(); });
+                    if (shutting_down) { break; }
+
+                    const auto next = std::max_element(queue.begin(), queue.end(), [](const auto &a, const auto &b) {
+                        return a->options.priority < b->options.priority
+                            || (a->options.priority == b->options.priority && a->id > b->id);
+                    });
+                    job = *next;
+                    queue.erase(next);
+                    job->preempt = false;
+                    running = job;
+                }
+
+                if (!job->started) { job->started = std::chrono::steady_clock::now(); }
+                bool failed = false;
+                try {
+                    run(*job);
+                } catch (const std::exception &e) {
+                    job->finish("failed " + std::to_string(job->id) + ' ' + e.what());
+                    failed = true;
+                }
+
+                std::lock_guard lock(mutex);
+                running.reset();
+                if (failed) { continue; }
+                if (job->complete) {
+                    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - *job->started;
+                    job->finish("done " + std::to_string(job->id) + ' ' + std::to_string(elapsed.count()));
+                } else if (shutting_down) {
+                    job->finish("failed " + std::to_string(job->id) + " The server shut down");
+                } else {
+                    job->send("preempted " + std::to_string(job->id));
+                    queue.push_back(job);
+                }
+            }
+
+            std::lock_guard lock(mutex);
+            for (const auto &job : queue) { job->finish("failed " + std::to_string(job->id) + " The server shut down"); }
+            queue.clear();
+        }
+
+        std::string describe(const render_job &job, const std::string &state) const {
+            return state + ' ' + std::to_string(job.id) + " priority " + std::to_string(job.options.priority) + ' '
+                + std::to_string(job.samples_done) + '/' + std::to_string(job.samples_total) + '\n';
+        }
+
+        void stop() {
+            {
+                std::lock_guard lock(mutex);
+                shutting_down = true;
+                if (running) { running->preempt = true; }
+            }
+            wake.notify_one();
+        }
+
+        bool stopping() {
+            std::lock_guard lock(mutex);
+            return shutting_down;
+        }
+
+    private:
+        std::string socket_path;
+        job_runner run;
+        std::mutex mutex;
+        std::condition_variable wake;
+        std::vector<std::shared_ptr<render_job>> queue;
+        std::shared_ptr<render_job> running;
+        uint64_t last_id = 0;
+        bool shutting_down = false;
+};
@@ -3,8 +3,17 @@
 #include "material.h"
 #include "hittable.h"
 #include "vec3.h"
+#include <algorithm>
 #include <cmath>
 
+// Latitude and longitude of the outward unit normal, u going around the y axis
+// from -x and v from the bottom pole.
+inline void set_sphere_uv(hit_record &rec, const vec3 &outward_normal, double radius) {
+    rec.u = (std::atan2(-outward_normal.z, outward_normal.x) + pi) / tao;
+    rec.v = std::acos(std::clamp(-outward_normal.y, -1.0, 1.0)) / pi;
+    rec.uv_scale = 1.0 / (pi * radius);
+}
+
 class sphere : public hittable {
     public:
         sphere() {}
@@ -13,6 +22,8 @@ class sphere : public hittable {
 
         virtual bool hit(const ray &r, double t_min, double t_max, hit_record &rec) const override;
 
+        virtual aabb bounds() const override { return sphere_box(center, radius); }
+
     public:
         point3 center;
         double radius;
@@ -43,7 +54,9 @@ inline bool sphere::hit(const ray &r, double t_min, double t_max, hit_record &re
     rec.p = r.at(rec.t);
     vec3 outward_normal = (rec.p - center) / radius;
     rec.set_face_normal(r, outward_normal);
-    rec.material = material;
+    rec.material = material.get();
+    rec.object_id = object_id;
+    if (rec.material->textured) { set_sphere_uv(rec, outward_normal, radius); }
 
     return true;
 }
\ No newline at end of file
@@ -0,0 +1,545 @@
+#pragma once
+
+#include "aabb.h"
+#include "bvh.h"
+#include "hittable.h"
+#include "mapped_file.h"
+#include "material.h"
+#include "mesh_loader.h"
+#include "rtweekend.h"
+#include "thread_pool.h"
+#include "triangle_mesh.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+
+// Clustered mesh file (.rtcl), the form of a mesh too large to keep in memory.
+// A fixed header and the directory of the clusters, then the clusters, each on
+// a page boundary. The triangles are sorted along a Morton curve of their
+// centroids and cut into runs of cluster_triangles, so a cluster covers a
+// compact region. A cluster holds its own BVH nodes, the first packet of every
+// node and the triangle packets, each array 64 byte aligned, in the layout the
+// in-memory meshes intersect. The packets number their lanes within the
+// cluster instead of naming mesh triangles.
+struct cluster_file_header {
+    char magic[4] = {'R', 'T', 'C', 'L'};
+    uint32_t version = 1;
+    uint64_t key = 0;           // Of the mesh it was converted from, see cluster_key.
+    uint64_t triangle_count = 0;
+    uint32_t cluster_count = 0;
+    uint32_t cluster_triangles = 0;
+};
+
+struct cluster_record {
+    float min[3];
+    uint32_t node_count;
+    float max[3];
+    uint32_t packet_count;
+    uint64_t offset;            // Of the cluster in the file.
+    uint64_t size;              // Bytes of the cluster.
+};
+
+namespace cluster_detail {
+    constexpr size_t page = 4096;
+    constexpr size_t alignment = 64;
+
+    inline size_t align(size_t offset, size_t to) { return (offset + to - 1) / to * to; }
+
+    // Offsets of the arrays of a cluster from its start, and its size.
+    struct layout {
+        size_t nodes, leaf_packets, packets, size;
+    };
+
+    inline layout cluster_layout(size_t node_count, size_t packet_count) {
+        layout l;
+        l.nodes = 0;
+        l.leaf_packets = align(node_count * sizeof(bvh_node), alignment);
+        l.packets = align(l.leaf_packets + node_count * sizeof(uint32_t), alignment);
+        l.size = l.packets + packet_count * sizeof(triangle_packet);
+        return l;
+    }
+
+    // Spreads the low 10 bits of v three bits apart.
+    inline uint32_t spread_bits(uint32_t v) {
+        v = (v | (v << 16)) & 0x030000ff;
+        v = (v | (v << 8)) & 0x0300f00f;
+        v = (v | (v << 4)) & 0x030c30c3;
+        return (v | (v << 2)) & 0x09249249;
+    }
+}
+
+// Key of the clustered file of a mesh: its size and modification time, and
+// the layout it is converted to.
+inline uint64_t cluster_key(const std::string &mesh_path, uint32_t cluster_triangles) {
+    const cluster_file_header header;
+    auto key = hash_combine(header.version, cluster_triangles);
+    key = hash_combine(key, std::filesystem::file_size(mesh_path));
+    return hash_combine(key, static_cast<uint64_t>(std::filesystem::last_write_time(mesh_path).time_since_epoch().count()));
+}
+
+// Writes the clusters of a mesh to path. The mesh is in memory while it is
+// converted, after that only the clusters the renders touch ever are.
+inline void write_clusters(const mesh_buffers &mesh, const std::string &path, uint64_t key, uint32_t cluster_triangles) {
+    using namespace cluster_detail;
+
+    const auto triangle_count = mesh.triangle_count();
+    std::vector<aabb> bounds(triangle_count);
+    aabb centroid_box;
+    std::vector<float> centroids(triangle_count * 3);
+    for (size_t i = 0; i < triangle_count; ++i) {
+        for (int corner = 0; corner < 3; ++corner) {
+            const auto vertex = mesh.indices[i * 3 + corner];
+            const float position[3] = {mesh.x[vertex], mesh.y[vertex], mesh.z[vertex]};
+            bounds[i].grow(position);
+        }
+        for (int axis = 0; axis < 3; ++axis) { centroids[i * 3 + axis] = 0.5f * (bounds[i].min[axis] + bounds[i].max[axis]); }
+        centroid_box.grow(&centroids[i * 3]);
+    }
+
+    std::vector<std::pair<uint32_t, uint32_t>> order(triangle_count);     // Morton code and triangle.
+    for (size_t i = 0; i < triangle_count; ++i) {
+        uint32_t code = 0;
+        for (int axis = 0; axis < 3; ++axis) {
+            const auto extent = centroid_box.max[axis] - centroid_box.min[axis];
+            const auto cell = extent > 0.0f ? (centroids[i * 3 + axis] - centroid_box.min[axis]) / extent * 1023.0f : 0.0f;
+            code |= spread_bits(static_cast<uint32_t>(cell)) << axis;
+        }
+        order[i] = {code, static_cast<uint32_t>(i)};
+    }
+    std::sort(order.begin(), order.end());
+
+    cluster_file_header header;
+    header.key = key;
+    header.triangle_count = triangle_count;
+    header.cluster_count = static_cast<uint32_t>((triangle_count + cluster_triangles - 1) / cluster_triangles);
+    header.cluster_triangles = cluster_triangles;
+    std::vector<cluster_record> records(header.cluster_count);
+
+    const auto temp_path = path + ".tmp" + std::to_string(getpid());
+    {
+        std::ofstream out(temp_path, std::ios::binary | std::ios::trunc);
+        auto offset = align(sizeof(header) + records.size() * sizeof(cluster_record), page);
+        std::vector<uint32_t> triangles;
+        std::vector<aabb> cluster_bounds;
+        std::vector<uint32_t> leaf_packets;
+        std::vector<triangle_packet> packets;
+        for (size_t c = 0; c < records.size(); ++c) {
+            triangles.clear();
+            cluster_bounds.clear();
+            for (size_t i = c * cluster_triangles; i < std::min(triangle_count, (c + 1) * cluster_triangles); ++i) {
+                triangles.push_back(order[i].second);
+                cluster_bounds.push_back(bounds[order[i].second]);
+            }
+            const auto tree = build_bvh(cluster_bounds);
+            packets.clear();
+            mesh_detail::pack_leaves(mesh, tree, triangles, leaf_packets, packets);
+            for (size_t p = 0; p < packets.size(); ++p) {
+                for (uint32_t lane = 0; lane < 4; ++lane) { packets[p].triangle[lane] = static_cast<uint32_t>(p * 4 + lane); }
+            }
+
+            const auto l = cluster_layout(tree.nodes.size(), packets.size());
+            auto &record = records[c];
+            const auto box = tree.bounds();
+            std::copy(box.min, box.min + 3, record.min);
+            std::copy(box.max, box.max + 3, record.max);
+            record.node_count = static_cast<uint32_t>(tree.nodes.size());
+            record.packet_count = static_cast<uint32_t>(packets.size());
+            record.offset = offset;
+            record.size = l.size;
+
+            std::vector<char> bytes(l.size, 0);
+            std::memcpy(bytes.data() + l.nodes, tree.nodes.data(), tree.nodes.size_bytes());
+            std::memcpy(bytes.data() + l.leaf_packets, leaf_packets.data(), leaf_packets.size() * sizeof(uint32_t));
+            std::memcpy(bytes.data() + l.packets, packets.data(), packets.size() * sizeof(triangle_packet));
+            out.seekp(static_cast<std::streamoff>(offset));
+            out.write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+            offset = align(offset + l.size, page);
+        }
+        out.seekp(0);
+        out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        out.write(reinterpret_cast<const char *>(records.data()), static_cast<std::streamsize>(records.size() * sizeof(cluster_record)));
+        if (!out) {
+            std::remove(temp_path.c_str());
+            throw std::runtime_error("Unable to write the clustered mesh: " + path);
+        }
+    }
+    if (std::rename(temp_path.c_str(), path.c_str()) != 0) {
+        std::remove(temp_path.c_str());
+        throw std::runtime_error("Unable to write the clustered mesh: " + path);
+    }
+}
+
+// Arrays of a cluster, views of the mapped file.
+struct cluster_view {
+    bvh tree;
+    std::span<const uint32_t> leaf_packets;
+    std::span<const triangle_packet> packets;
+};
+
+struct geometry_cache_stats {
+    uint64_t visits = 0;        // Clusters entered by a ray or by a batch of rays.
+    uint64_t faults = 0;        // Visits to clusters that were not resident.
+    uint64_t evictions = 0;
+    size_t paged_bytes = 0;     // Of the clusters faulted in.
+    size_t resident_bytes = 0;
+    size_t peak_bytes = 0;
+};
+
+// Clusters of every streamed mesh of a scene, mapped from their files and kept
+// resident within a memory budget. Only the directories stay in memory. A visit
+// to a cluster that isn't resident faults it in whole, which asks the kernel to
+// read its pages ahead, and evicts clusters not visited lately past the budget
+// by dropping their pages. Resident visits take no lock, they only stamp the
+// cluster with the fault count, which a clock hand over the resident clusters
+// reads to pick the ones to evict. An evicted cluster stays mapped, so a thread
+// still reading it merely pages it in again, which can briefly take the
+// resident pages past the budget.
+class geometry_cache {
+    public:
+        static constexpr uint32_t cluster_triangles = 4096;
+        static constexpr size_t default_budget = size_t(1024) << 20;
+
+        explicit geometry_cache(size_t budget_bytes = default_budget) : budget(budget_bytes) { }
+
+        geometry_cache(const geometry_cache &) = delete;
+        geometry_cache &operator=(const geometry_cache &) = delete;
+
+        ~geometry_cache() {
+            for (const auto &file : files) { ::close(file.fd); }
+        }
+
+        // Opens the clustered file of a mesh, <mesh>.rtcl, converting the mesh
+        // first when that file is missing or stale, an OBJ file unless it ends
+        // in .ply. A clustered file whose mesh is gone is used as it is.
+        // Returns the handle of the mesh. Meshes must be added before
+        // rendering starts.
+        uint32_t add(const std::string &mesh_path, thread_pool &pool) {
+            const auto cluster_path = mesh_path + ".rtcl";
+            const auto header = read_header(cluster_path);
+            if (std::filesystem::exists(mesh_path) && (!header || header->key != cluster_key(mesh_path, cluster_triangles))) {
+                const auto mesh = std::filesystem::path(mesh_path).extension() == ".ply" ? load_ply(mesh_path) : load_obj(mesh_path, pool);
+                write_clusters(*mesh, cluster_path, cluster_key(mesh_path, cluster_triangles), cluster_triangles);
+                ++converted_count;
+            }
+            return open(cluster_path);
+        }
+
+        // Opens a clustered file as it is.
+        uint32_t open(const std::string &cluster_path) {
+            const auto header = read_header(cluster_path);
+            if (!header) { throw std::runtime_error("Not a clustered mesh: " + cluster_path); }
+
+            streamed_file file;
+            file.path = cluster_path;
+            file.mapping = std::make_unique<mapped_file>(cluster_path);
+            const auto *data = file.mapping->data();
+            const auto size = file.mapping->size();
+            file.triangle_count = header->triangle_count;
+            file.clusters.resize(header->cluster_count);
+            if (sizeof(*header) + file.clusters.size() * sizeof(cluster_record) > size) {
+                throw std::runtime_error("The clustered mesh " + cluster_path + " is truncated");
+            }
+            std::memcpy(file.clusters.data(), data + sizeof(*header), file.clusters.size() * sizeof(cluster_record));
+
+            for (const auto &record : file.clusters) {
+                const auto l = cluster_detail::cluster_layout(record.node_count, record.packet_count);
+                if (record.node_count == 0 || record.size != l.size || record.offset % cluster_detail::page != 0
+                        || record.offset > size || record.size > size - record.offset) {
+                    throw std::runtime_error("The clustered mesh " + cluster_path + " is corrupt");
+                }
+                const auto *start = data + record.offset;
+                cluster_view view;
+                view.tree.nodes = std::span(reinterpret_cast<const bvh_node *>(start + l.nodes), record.node_count);
+                view.leaf_packets = std::span(reinterpret_cast<const uint32_t *>(start + l.leaf_packets), record.node_count);
+                view.packets = std::span(reinterpret_cast<const triangle_packet *>(start + l.packets), record.packet_count);
+                file.views.push_back(view);
+            }
+            file.states = std::make_unique<cluster_state[]>(file.clusters.size());
+
+            file.fd = ::open(cluster_path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (file.fd < 0) { throw std::runtime_error("Unable to open " + cluster_path + ": " + std::strerror(errno)); }
+            files.push_back(std::move(file));
+            return static_cast<uint32_t>(files.size() - 1);
+        }
+
+        size_t size() const { return files.size(); }
+        size_t converted() const { return converted_count; }
+        uint64_t triangle_count(uint32_t handle) const { return files[handle].triangle_count; }
+        std::span<const cluster_record> clusters(uint32_t handle) const { return files[handle].clusters; }
+
+        void set_budget(size_t bytes) {
+            const std::lock_guard lock(mutex);
+            budget = bytes;
+            evict(nullptr);
+        }
+
+        geometry_cache_stats stats() const {
+            const std::lock_guard lock(mutex);
+            auto result = counters;
+            for (const auto &stripe : visit_counts) { result.visits += stripe.count.load(std::memory_order_relaxed); }
+            return result;
+        }
+
+        // The arrays of a cluster, faulting it in when it isn't resident.
+        const cluster_view &use(uint32_t handle, uint32_t cluster) const {
+            static thread_local const size_t stripe = next_stripe() % visit_stripes;
+            visit_counts[stripe].count.fetch_add(1, std::memory_order_relaxed);
+
+            const auto &file = files[handle];
+            auto &state = file.states[cluster];
+            if (!state.resident.load(std::memory_order_acquire)) { fault(file, cluster); }
+            const auto now = clock.load(std::memory_order_relaxed);
+            if (state.last_used.load(std::memory_order_relaxed) != now) { state.last_used.store(now, std::memory_order_relaxed); }
+            return file.views[cluster];
+        }
+
+        // The arrays of a cluster, which the caller used a moment ago.
+        const cluster_view &view(uint32_t handle, uint32_t cluster) const { return files[handle].views[cluster]; }
+
+    private:
+        static constexpr size_t visit_stripes = 16;
+
+        struct cluster_state {
+            std::atomic<bool> resident = false;
+            std::atomic<uint64_t> last_used = 0;    // The fault count at the last visit.
+        };
+
+        struct streamed_file {
+            std::string path;
+            std::unique_ptr<mapped_file> mapping;
+            int fd = -1;
+            uint64_t triangle_count = 0;
+            std::vector<cluster_record> clusters;
+            std::vector<cluster_view> views;
+            std::unique_ptr<cluster_state[]> states;
+        };
+
+        struct resident_cluster {
+            const streamed_file *file;
+            uint32_t cluster;
+            uint64_t seen = 0;      // The stamp of the cluster when the clock hand last passed it.
+        };
+
+        // Visits are counted on their own cache lines, spread over the threads.
+        struct alignas(64) visit_stripe {
+            std::atomic<uint64_t> count = 0;
+        };
+
+        static std::optional<cluster_file_header> read_header(const std::string &path) {
+            std::ifstream in(path, std::ios::binary);
+            cluster_file_header header;
+            if (!in.read(reinterpret_cast<char *>(&header), sizeof(header))) { return std::nullopt; }
+
+            const cluster_file_header expected;
+            if (std::memcmp(header.magic, expected.magic, sizeof(header.magic)) != 0 || header.version != expected.version
+                    || header.cluster_triangles != cluster_triangles) {
+                return std::nullopt;
+            }
+            return header;
+        }
+
+        // Pages of the cluster, rounded out to whole pages of the system when
+        // they are read ahead and in when they are dropped.
+        static std::pair<std::byte *, size_t> pages(const streamed_file &file, uint32_t cluster, bool outward) {
+            static const auto page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+            const auto &record = file.clusters[cluster];
+            const auto base = reinterpret_cast<uintptr_t>(file.mapping->data());
+            auto first = base + record.offset, last = first + record.size;
+            first = outward ? first / page_size * page_size : (first + page_size - 1) / page_size * page_size;
+            last = outward ? (last + page_size - 1) / page_size * page_size : last / page_size * page_size;
+            return {reinterpret_cast<std::byte *>(first), last > first ? last - first : 0};
+        }
+
+        void fault(const streamed_file &file, uint32_t cluster) const {
+            const std::lock_guard lock(mutex);
+            auto &state = file.states[cluster];
+            if (state.resident.load(std::memory_order_relaxed)) { return; }
+
+            const auto [address, length] = pages(file, cluster, true);
+            if (length > 0) { madvise(address, length, MADV_WILLNEED); }
+            const auto size = file.clusters[cluster].size;
+            state.last_used.store(clock.fetch_add(1, std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            state.resident.store(true, std::memory_order_release);
+            resident.push_back({&file, cluster});
+            ++counters.faults;
+            counters.paged_bytes += size;
+            counters.resident_bytes += size;
+            counters.peak_bytes = std::max(counters.peak_bytes, counters.resident_bytes);
+            evict(&state);
+        }
+
+        // With the lock held. The clock hand evicts the first cluster whose stamp
+        // hasn't changed since it last passed, and moves on past the others, so
+        // an eviction takes amortized constant time. The cluster kept, the one
+        // just faulted in, always stays.
+        void evict(const cluster_state *kept) const {
+            size_t passed = 0;
+            while (counters.resident_bytes > budget && resident.size() > (kept ? 1u : 0u)) {
+                if (hand >= resident.size()) { hand = 0; }
+                auto &candidate = resident[hand];
+                const auto &file = *candidate.file;
+                auto &state = file.states[candidate.cluster];
+                const auto last_used = state.last_used.load(std::memory_order_relaxed);
+                // Visits racing the hand could keep every cluster recent, after two turns it takes the next one.
+                if (&state == kept || (last_used != candidate.seen && passed < 2 * resident.size())) {
+                    candidate.seen = last_used;
+                    ++hand;
+                    ++passed;
+                    continue;
+                }
+
+                const auto &record = file.clusters[candidate.cluster];
+                state.resident.store(false, std::memory_order_release);
+                const auto [address, length] = pages(file, candidate.cluster, false);
+                if (length > 0) { madvise(address, length, MADV_DONTNEED); }
+                posix_fadvise(file.fd, static_cast<off_t>(record.offset), static_cast<off_t>(record.size), POSIX_FADV_DONTNEED);
+                counters.resident_bytes -= record.size;
+                ++counters.evictions;
+                candidate = resident.back();
+                resident.pop_back();
+                passed = 0;
+            }
+        }
+
+        static size_t next_stripe() {
+            static std::atomic<size_t> last_stripe = 0;
+            return last_stripe++;
+        }
+
+    private:
+        std::vector<streamed_file> files;
+        size_t converted_count = 0;
+
+        mutable std::mutex mutex;
+        size_t budget;
+        mutable std::atomic<uint64_t> clock = 0;    // Faults so far.
+        mutable std::vector<resident_cluster> resident;
+        mutable size_t hand = 0;                    // Of the clock, an index in resident.
+        mutable geometry_cache_stats counters;
+        mutable std::array<visit_stripe, visit_stripes> visit_counts;
+};
+
+struct streamed_hit {
+    float t;
+    uint32_t cluster;
+    uint32_t slot;      // Packet times four plus lane, within the cluster.
+};
+
+// A triangle mesh whose clusters stay on disk, read through a geometry cache.
+// A BVH over the bounds of the clusters is all that is resident. Single rays
+// visit the clusters they may hit nearest first, batches of rays visit each
+// cluster once.
+class streamed_mesh : public hittable {
+    public:
+        streamed_mesh(std::shared_ptr<const geometry_cache> cache, uint32_t handle, std::shared_ptr<material> mat)
+            : cache(std::move(cache)), handle(handle), mat(std::move(mat)) {
+            const auto records = this->cache->clusters(handle);
+            std::vector<aabb> bounds(records.size());
+            for (size_t i = 0; i < records.size(); ++i) {
+                std::copy(records[i].min, records[i].min + 3, bounds[i].min);
+                std::copy(records[i].max, records[i].max + 3, bounds[i].max);
+            }
+            top = build_bvh(bounds);
+        }
+
+        size_t triangle_count() const { return cache->triangle_count(handle); }
+        size_t cluster_count() const { return cache->clusters(handle).size(); }
+
+        // Closest triangle hit by r in (t_min, t_max), in single precision.
+        bool intersect(const ray &r, float t_min, float t_max, streamed_hit &closest) const {
+            closest = {t_max, 0, 0};
+            const auto records = cache->clusters(handle);
+            const box_ray box_r(r);
+            mesh_hit found{t_max, 0};
+            traverse_bvh(top, box_r, t_min, found.t, [&](const bvh_node &leaf) {
+                for (uint32_t i = leaf.first; i < leaf.first + leaf.count; ++i) {
+                    const auto cluster = top.indices[i];
+                    // The leaf box may cover clusters the ray misses, which are not paged in.
+                    if (box_r.entry(records[cluster].min, records[cluster].max, t_min, found.t) == std::numeric_limits<float>::infinity()) { continue; }
+                    const auto &view = cache->use(handle, cluster);
+                    const auto before = found.t;
+                    mesh_detail::intersect_leaves(view.tree, view.leaf_packets, view.packets, r, t_min, found, triangle_test::simd);
+                    if (found.t < before) { closest = {found.t, cluster, found.triangle}; }
+                }
+            });
+            return closest.t < t_max;
+        }
+
+        // Closest hits of a batch of rays in (t_min, t_max). The rays are binned to
+        // the clusters whose boxes they enter, then the clusters are visited once
+        // each, in file order, for all of their rays. That costs the culling of the
+        // nearest first order of single rays but pages a cluster in once per batch.
+        void intersect(std::span<const ray> rays, float t_min, float t_max, std::span<streamed_hit> hits) const {
+            const auto records = cache->clusters(handle);
+            std::vector<std::pair<uint32_t, uint32_t>> work;     // Cluster and ray.
+            for (uint32_t i = 0; i < rays.size(); ++i) {
+                hits[i] = {t_max, 0, 0};
+                const box_ray box_r(rays[i]);
+                traverse_bvh(top, box_r, t_min, t_max, [&](const bvh_node &leaf) {
+                    for (uint32_t j = leaf.first; j < leaf.first + leaf.count; ++j) {
+                        const auto cluster = top.indices[j];
+                        if (box_r.entry(records[cluster].min, records[cluster].max, t_min, t_max) != std::numeric_limits<float>::infinity()) {
+                            work.emplace_back(cluster, i);
+                        }
+                    }
+                });
+            }
+            std::sort(work.begin(), work.end());
+
+            for (size_t begin = 0, end; begin < work.size(); begin = end) {
+                const auto cluster = work[begin].first;
+                const auto &view = cache->use(handle, cluster);
+                for (end = begin; end < work.size() && work[end].first == cluster; ++end) {
+                    auto &hit = hits[work[end].second];
+                    mesh_hit found{hit.t, 0};
+                    mesh_detail::intersect_leaves(view.tree, view.leaf_packets, view.packets, rays[work[end].second], t_min, found, triangle_test::simd);
+                    if (found.t < hit.t) { hit = {found.t, cluster, found.triangle}; }
+                }
+            }
+        }
+
+        virtual aabb bounds() const override { return top.bounds(); }
+
+        virtual bool hit(const ray &r, double t_min, double t_max, hit_record &rec) const override {
+            streamed_hit closest;
+            const auto far = static_cast<float>(std::min(t_max, static_cast<double>(std::numeric_limits<float>::max())));
+            if (!intersect(r, static_cast<float>(t_min), far, closest)) { return false; }
+
+            const auto &packet = cache->view(handle, closest.cluster).packets[closest.slot / 4];
+            const auto lane = closest.slot % 4;
+            const point3 v0(packet.v0[0][lane], packet.v0[1][lane], packet.v0[2][lane]);
+            const vec3 e1(packet.e1[0][lane], packet.e1[1][lane], packet.e1[2][lane]);
+            const vec3 e2(packet.e2[0][lane], packet.e2[1][lane], packet.e2[2][lane]);
+
+            rec.material = mat.get();
+            rec.object_id = object_id;
+            mesh_detail::set_triangle_hit(rec, r, closest.t, v0, e1, e2);
+            return true;
+        }
+
+    private:
+        std::shared_ptr<const geometry_cache> cache;
+        uint32_t handle;
+        std::shared_ptr<material> mat;
+        bvh top;
+};
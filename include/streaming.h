@@ -0,0 +1,55 @@
+#pragma once
+
+#include "framebuffer.h"
+#include "png.h"
+#include "renderer.h"
+#include "thread_pool.h"
+#include <algorithm>
+#include <chrono>
+#include <future>
+#include <iostream>
+#include <string>
+
+
+// Renders the image one band of tile rows at a time with all of its samples and
+// streams every finished band to the PNG, so the resident framebuffer is two
+// bands instead of the whole image. A band is encoded, with its strips spread
+// over the pool, while the next one renders. Only the pixels of region are
+// rendered. Returns the encode time in seconds.
+inline double render_streamed(const renderer &r, thread_pool &pool, const std::string &path, const tonemap_settings &tonemap,
+                              const tile &region, int band_tile_rows = 1) {
+    using clock = std::chrono::steady_clock;
+
+    const auto &settings = r.settings;
+    const auto width = region.x1 - region.x0;
+    const auto height = region.y1 - region.y0;
+    const auto band_height = renderer::tile_size * band_tile_rows;
+    png_stream_writer png(path, width, height, tonemap.bit_depth);
+
+    framebuffer encoding;
+    std::future<double> pending;
+    auto wait_pending = [&] {
+        const auto seconds = pending.valid() ? pending.get() : 0.0;
+        std::cout << "\rRows written: " << png.rows_written() << '/' << height << std::flush;
+        return seconds;
+    };
+
+    double encode_seconds = 0.0;
+    for (int y = region.y0; y < region.y1; y += band_height) {
+        framebuffer band(width, std::min(band_height, region.y1 - y), region.x0, y);
+        r.render_pass(pool, band, 0, settings.sample_per_pixel);
+
+        encode_seconds += wait_pending();
+        encoding = std::move(band);
+        pending = std::async(std::launch::async, [&] {
+            const auto start = clock::now();
+            const auto pixels = encoding.to_display(tonemap, 0, encoding.height, &pool);
+            png.write_rows(pixels.data(), encoding.height, &pool);
+            return std::chrono::duration<double>(clock::now() - start).count();
+        });
+    }
+    encode_seconds += wait_pending();
+
+    png.finish();
+    return encode_seconds;
+}
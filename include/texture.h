@@ -0,0 +1,519 @@
+#pragma once
+
+#include "color.h"
+#include "hittable.h"
+#include "rtweekend.h"
+#include "stb/stb_image.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+
+class texture {
+    public:
+        virtual ~texture() = default;
+
+        // Color at the texture coordinates of the hit, filtered over its footprint.
+        virtual color value(const hit_record &rec) const = 0;
+};
+
+enum class texel_format : uint32_t {
+    srgb8,      // 8-bit sRGB encoded RGB, the colors of ordinary images.
+    linear8,    // 8-bit linear RGB, for images holding data rather than colors.
+    float32,    // Linear RGB floats, from HDR images.
+};
+
+// Tiled texture file (.rtt), the form of an image the cache reads. A fixed header
+// followed by the mip levels of the image from full size down to 1x1, each cut
+// into tiles of tile_size x tile_size texels stored row by row. Tiles at the
+// right and bottom edges are padded with the last texels, so every tile has the
+// same size and the offset of any of them follows from the header.
+struct texture_file_header {
+    char magic[4] = {'R', 'T', 'T', 'X'};
+    uint32_t version = 2;
+    uint64_t key = 0;           // Of the image it was converted from, see texture_key.
+    uint32_t width = 0;
+    uint32_t height = 0;
+    texel_format format = texel_format::srgb8;
+    uint32_t tile_size = 64;
+    uint32_t level_count = 0;
+    uint32_t padding = 0;
+};
+
+namespace texture_detail {
+    struct level {
+        uint32_t width, height;
+        uint32_t tiles_x;
+        uint64_t first_tile;    // Index of its first tile in the file.
+    };
+
+    inline std::vector<level> pyramid(uint32_t width, uint32_t height, uint32_t tile_size) {
+        std::vector<level> levels;
+        uint64_t tiles = 0;
+        while (true) {
+            const auto tiles_x = (width + tile_size - 1) / tile_size, tiles_y = (height + tile_size - 1) / tile_size;
+            levels.push_back({width, height, tiles_x, tiles});
+            tiles += static_cast<uint64_t>(tiles_x) * tiles_y;
+            if (width == 1 && height == 1) { return levels; }
+            width = std::max(1u, width / 2);
+            height = std::max(1u, height / 2);
+        }
+    }
+
+    // The texels of the level above that a texel covers along one axis, with
+    // the share of each. A level of an odd size covers 3 texels per texel, so
+    // the last row and column aren't dropped.
+    struct box_taps {
+        uint32_t first = 0;
+        uint32_t count = 0;
+        float weights[3] = {};
+    };
+
+    inline box_taps filter_taps(uint32_t i, uint32_t size, uint32_t above) {
+        // In units of 1 / size of a texel above, so the shares are exact.
+        const uint64_t x0 = static_cast<uint64_t>(i) * above, x1 = x0 + above;
+        box_taps taps;
+        taps.first = static_cast<uint32_t>(x0 / size);
+        for (uint64_t j = taps.first; j * size < x1 && taps.count < 3; ++j) {
+            const auto covered = std::min((j + 1) * size, x1) - std::max(j * size, x0);
+            taps.weights[taps.count++] = static_cast<float>(covered) / static_cast<float>(above);
+        }
+        return taps;
+    }
+
+    inline size_t texel_bytes(texel_format format) { return format == texel_format::float32 ? 3 * sizeof(float) : 3; }
+
+    inline const std::array<float, 256> &srgb_decode_table() {
+        static const auto table = [] {
+            std::array<float, 256> result{};
+            for (size_t i = 0; i < result.size(); ++i) {
+                const auto x = static_cast<float>(i) / 255.0f;
+                result[i] = x <= 0.04045f ? x / 12.92f : std::pow((x + 0.055f) / 1.055f, 2.4f);
+            }
+            return result;
+        }();
+        return table;
+    }
+
+    inline void encode_texel(const float *linear, texel_format format, uint8_t *out) {
+        if (format == texel_format::float32) {
+            std::memcpy(out, linear, 3 * sizeof(float));
+            return;
+        }
+        for (int c = 0; c < 3; ++c) {
+            const auto x = std::clamp(linear[c], 0.0f, 1.0f);
+            out[c] = static_cast<uint8_t>(std::lround((format == texel_format::srgb8 ? srgb_encode(x) : x) * 255.0f));
+        }
+    }
+
+    inline color decode_texel(const uint8_t *texel, texel_format format) {
+        if (format == texel_format::float32) {
+            float rgb[3];
+            std::memcpy(rgb, texel, sizeof(rgb));
+            return color(rgb[0], rgb[1], rgb[2]);
+        }
+        if (format == texel_format::linear8) { return color(texel[0], texel[1], texel[2]) / 255.0; }
+        const auto &table = srgb_decode_table();
+        return color(table[texel[0]], table[texel[1]], table[texel[2]]);
+    }
+}
+
+// Key of the tiled file of an image: its size and modification time, and the
+// layout it is converted to.
+inline uint64_t texture_key(const std::string &image_path, texel_format format, uint32_t tile_size) {
+    const texture_file_header header;
+    auto key = hash_combine(header.version, hash_combine(static_cast<uint64_t>(format), tile_size));
+    key = hash_combine(key, std::filesystem::file_size(image_path));
+    return hash_combine(key, static_cast<uint64_t>(std::filesystem::last_write_time(image_path).time_since_epoch().count()));
+}
+
+// Converts an image read by stb_image into a tiled file at tiled_path. 8-bit
+// images become srgb8 or linear8 tiles, HDR images float32 ones. The levels are
+// box filtered in linear space. The image is held in memory in float while it
+// is converted, after that only the tiles the renders touch ever are.
+inline void convert_texture(const std::string &image_path, const std::string &tiled_path, bool srgb, uint32_t tile_size = 64) {
+    using namespace texture_detail;
+
+    int width = 0, height = 0, channels = 0;
+    std::vector<float> texels;
+    texture_file_header header;
+    if (stbi_is_hdr(image_path.c_str())) {
+        float *data = stbi_loadf(image_path.c_str(), &width, &height, &channels, 3);
+        if (!data) { throw std::runtime_error("Unable to load the texture " + image_path + ": " + stbi_failure_reason()); }
+        texels.assign(data, data + static_cast<size_t>(width) * height * 3);
+        stbi_image_free(data);
+        header.format = texel_format::float32;
+    } else {
+        unsigned char *data = stbi_load(image_path.c_str(), &width, &height, &channels, 3);
+        if (!data) { throw std::runtime_error("Unable to load the texture " + image_path + ": " + stbi_failure_reason()); }
+        const auto &table = srgb_decode_table();
+        texels.resize(static_cast<size_t>(width) * height * 3);
+        for (size_t i = 0; i < texels.size(); ++i) { texels[i] = srgb ? table[data[i]] : data[i] / 255.0f; }
+        stbi_image_free(data);
+        header.format = srgb ? texel_format::srgb8 : texel_format::linear8;
+    }
+
+    header.key = texture_key(image_path, header.format, tile_size);
+    header.width = static_cast<uint32_t>(width);
+    header.height = static_cast<uint32_t>(height);
+    header.tile_size = tile_size;
+    const auto levels = pyramid(header.width, header.height, tile_size);
+    header.level_count = static_cast<uint32_t>(levels.size());
+
+    const auto temp_path = tiled_path + ".tmp" + std::to_string(getpid());
+    {
+        std::ofstream out(temp_path, std::ios::binary | std::ios::trunc);
+        out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+
+        const auto texel_size = texel_bytes(header.format);
+        std::vector<uint8_t> tile(static_cast<size_t>(tile_size) * tile_size * texel_size);
+        for (size_t l = 0; l < levels.size(); ++l) {
+            const auto &level = levels[l];
+            if (l > 0) {
+                // Each texel averages the area of the level above it covers, 2x2
+                // texels, or up to 3x3 along odd sizes.
+                const auto &above = levels[l - 1];
+                std::vector<box_taps> columns(level.width);
+                for (uint32_t x = 0; x < level.width; ++x) { columns[x] = filter_taps(x, level.width, above.width); }
+                std::vector<float> next(static_cast<size_t>(level.width) * level.height * 3);
+                for (uint32_t y = 0; y < level.height; ++y) {
+                    const auto rows = filter_taps(y, level.height, above.height);
+                    for (uint32_t x = 0; x < level.width; ++x) {
+                        const auto &cols = columns[x];
+                        for (uint32_t dy = 0; dy < rows.count; ++dy) {
+                            for (uint32_t dx = 0; dx < cols.count; ++dx) {
+                                const auto sx = cols.first + dx, sy = rows.first + dy;
+                                const auto weight = rows.weights[dy] * cols.weights[dx];
+                                for (int c = 0; c < 3; ++c) {
+                                    next[(static_cast<size_t>(y) * level.width + x) * 3 + c] += weight * texels[(static_cast<size_t>(sy) * above.width + sx) * 3 + c];
+                                }
+                            }
+                        }
+                    }
+                }
+                texels = std::move(next);
+            }
+
+            const auto tiles_y = (level.height + tile_size - 1) / tile_size;
+            for (uint32_t ty = 0; ty < tiles_y; ++ty) {
+                for (uint32_t tx = 0; tx < level.tiles_x; ++tx) {
+                    for (uint32_t y = 0; y < tile_size; ++y) {
+                        for (uint32_t x = 0; x < tile_size; ++x) {
+                            const auto sx = std::min(tx * tile_size + x, level.width - 1), sy = std::min(ty * tile_size + y, level.height - 1);
+                            encode_texel(&texels[(static_cast<size_t>(sy) * level.width + sx) * 3], header.format,
+                                         &tile[(static_cast<size_t>(y) * tile_size + x) * texel_size]);
+                        }
+                    }
+                    out.write(reinterpret_cast<const char *>(tile.data()), static_cast<std::streamsize>(tile.size()));
+                }
+            }
+        }
+        if (!out) {
+            std::remove(temp_path.c_str());
+            throw std::runtime_error("Unable to write the tiled texture: " + tiled_path);
+        }
+    }
+    if (std::rename(temp_path.c_str(), tiled_path.c_str()) != 0) {
+        std::remove(temp_path.c_str());
+        throw std::runtime_error("Unable to write the tiled texture: " + tiled_path);
+    }
+}
+
+struct texture_cache_stats {
+    uint64_t lookups = 0;       // Tiles looked up past the per-thread tables.
+    uint64_t reads = 0;         // Tiles read from the tiled files.
+    uint64_t evictions = 0;
+    size_t resident_bytes = 0;
+    size_t peak_bytes = 0;
+};
+
+// Tiles of every texture of a scene, read on demand from their tiled files and
+// kept within a memory budget. The resident tiles form one LRU list, the least
+// recently used are evicted past the budget. Each thread keeps the tiles it
+// used last in a small table in front of it, so most texel reads take no lock.
+// Those tables hold their tiles alive when they are evicted, which may keep
+// local_slots tiles per thread beyond the budget, until the cache is destroyed.
+class texture_cache {
+    public:
+        static constexpr uint32_t tile_size = 64;
+        static constexpr size_t local_slots = 64;
+        static constexpr size_t default_budget = size_t(512) << 20;
+
+        explicit texture_cache(size_t budget_bytes = default_budget) : budget(budget_bytes) { }
+
+        texture_cache(const texture_cache &) = delete;
+        texture_cache &operator=(const texture_cache &) = delete;
+
+        ~texture_cache() {
+            // Threads that looked up tiles last in this cache would keep them.
+            {
+                auto &registry = local_tables();
+                const std::lock_guard lock(registry.mutex);
+                for (auto *table : registry.tables) {
+                    if (table->owner.load(std::memory_order_relaxed) != id) { continue; }
+                    table->slots = {};
+                    table->owner.store(0, std::memory_order_relaxed);
+                }
+            }
+            for (const auto &texture : textures) { ::close(texture.fd); }
+        }
+
+        // Opens the tiled file of an image, <image>.rtt, converting the image
+        // first when that file is missing or stale. Returns the handle of the
+        // texture. Textures must be added before rendering starts.
+        uint32_t add(const std::string &image_path, bool srgb) {
+            using namespace texture_detail;
+
+            const auto tiled_path = image_path + ".rtt";
+            auto header = read_header(tiled_path);
+            const auto expected_format = [&] {
+                if (stbi_is_hdr(image_path.c_str())) { return texel_format::float32; }
+                return srgb ? texel_format::srgb8 : texel_format::linear8;
+            }();
+            if (!header || header->key != texture_key(image_path, expected_format, tile_size)) {
+                convert_texture(image_path, tiled_path, srgb, tile_size);
+                ++converted_count;
+                header = read_header(tiled_path);
+                if (!header) { throw std::runtime_error("Unable to read the tiled texture: " + tiled_path); }
+            }
+
+            cached_texture texture;
+            texture.fd = ::open(tiled_path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (texture.fd < 0) { throw std::runtime_error("Unable to open " + tiled_path + ": " + std::strerror(errno)); }
+            texture.path = tiled_path;
+            texture.format = header->format;
+            texture.size = std::max(header->width, header->height);
+            texture.levels = pyramid(header->width, header->height, tile_size);
+            texture.tile_bytes = static_cast<size_t>(tile_size) * tile_size * texel_bytes(header->format);
+            textures.push_back(std::move(texture));
+            return static_cast<uint32_t>(textures.size() - 1);
+        }
+
+        size_t size() const { return textures.size(); }
+        size_t converted() const { return converted_count; }
+
+        void set_budget(size_t bytes) {
+            const std::lock_guard lock(mutex);
+            budget = bytes;
+            evict();
+        }
+
+        texture_cache_stats stats() const {
+            const std::lock_guard lock(mutex);
+            return counters;
+        }
+
+        // Trilinear lookup at (u, v), repeating outside [0, 1], in the two levels
+        // whose texels are closest to the footprint, given in texture coordinates.
+        color sample(uint32_t handle, double u, double v, double footprint) const {
+            const auto &texture = textures[handle];
+            const auto last_level = static_cast<double>(texture.levels.size() - 1);
+            const auto lod = std::clamp(std::log2(std::max(footprint * texture.size, 1e-9)), 0.0, last_level);
+            const auto level = static_cast<uint32_t>(lod);
+            const auto blend = lod - level;
+
+            auto result = bilinear(texture, handle, level, u, v);
+            if (blend > 0.0) { result = (1.0 - blend) * result + blend * bilinear(texture, handle, level + 1, u, v); }
+            return result;
+        }
+
+    private:
+        struct cached_texture {
+            std::string path;
+            int fd = -1;
+            texel_format format = texel_format::srgb8;
+            uint32_t size = 0;      // Of the largest side.
+            std::vector<texture_detail::level> levels;
+            size_t tile_bytes = 0;
+        };
+
+        using tile_data = std::shared_ptr<const std::vector<uint8_t>>;
+
+        struct resident_tile {
+            tile_data texels;
+            std::list<uint64_t>::iterator position;
+        };
+
+        struct local_slot {
+            uint64_t key = ~uint64_t(0);
+            tile_data texels;
+        };
+
+        // Every thread's table, so a cache going away can drop its tiles from them.
+        struct local_table;
+        struct table_registry {
+            std::mutex mutex;
+            std::vector<local_table *> tables;
+        };
+
+        static table_registry &local_tables() {
+            static table_registry registry;
+            return registry;
+        }
+
+        // A thread only changes the owner of its table with the registry lock held.
+        struct local_table {
+            std::atomic<uint64_t> owner = 0;
+            std::array<local_slot, local_slots> slots;
+
+            local_table() {
+                auto &registry = local_tables();
+                const std::lock_guard lock(registry.mutex);
+                registry.tables.push_back(this);
+            }
+
+            ~local_table() {
+                auto &registry = local_tables();
+                const std::lock_guard lock(registry.mutex);
+                std::erase(registry.tables, this);
+            }
+        };
+
+        static std::optional<texture_file_header> read_header(const std::string &path) {
+            std::ifstream in(path, std::ios::binary);
+            texture_file_header header;
+            if (!in.read(reinterpret_cast<char *>(&header), sizeof(header))) { return std::nullopt; }
+
+            const texture_file_header expected;
+            if (std::memcmp(header.magic, expected.magic, sizeof(header.magic)) != 0 || header.version != expected.version
+                    || header.tile_size != tile_size || header.format > texel_format::float32 || header.width == 0 || header.height == 0) {
+                return std::nullopt;
+            }
+            const auto levels = texture_detail::pyramid(header.width, header.height, tile_size);
+            const auto tiles = levels.back().first_tile + 1;
+            const auto bytes = sizeof(header) + tiles * tile_size * tile_size * texture_detail::texel_bytes(header.format);
+            std::error_code error;
+            if (header.level_count != levels.size() || std::filesystem::file_size(path, error) != bytes || error) { return std::nullopt; }
+            return header;
+        }
+
+        color bilinear(const cached_texture &texture, uint32_t handle, uint32_t level, double u, double v) const {
+            const auto &l = texture.levels[level];
+            // Rows are stored from the top of the image, v grows upwards.
+            const auto x = (u - std::floor(u)) * l.width - 0.5;
+            const auto y = (1.0 - (v - std::floor(v))) * l.height - 0.5;
+            const auto x0 = std::floor(x), y0 = std::floor(y);
+            const auto fx = x - x0, fy = y - y0;
+
+            auto wrap = [](int64_t i, uint32_t n) { return static_cast<uint32_t>(((i % n) + n) % n); };
+            const auto ix0 = wrap(static_cast<int64_t>(x0), l.width), ix1 = wrap(static_cast<int64_t>(x0) + 1, l.width);
+            const auto iy0 = wrap(static_cast<int64_t>(y0), l.height), iy1 = wrap(static_cast<int64_t>(y0) + 1, l.height);
+            return (1.0 - fy) * ((1.0 - fx) * texel(texture, handle, l, ix0, iy0) + fx * texel(texture, handle, l, ix1, iy0))
+                 + fy * ((1.0 - fx) * texel(texture, handle, l, ix0, iy1) + fx * texel(texture, handle, l, ix1, iy1));
+        }
+
+        color texel(const cached_texture &texture, uint32_t handle, const texture_detail::level &l, uint32_t x, uint32_t y) const {
+            const auto index = l.first_tile + static_cast<uint64_t>(y / tile_size) * l.tiles_x + x / tile_size;
+            const auto *tile = find_tile(texture, (static_cast<uint64_t>(handle) << 40) | index, index);
+            const auto offset = (static_cast<size_t>(y % tile_size) * tile_size + x % tile_size) * texture_detail::texel_bytes(texture.format);
+            return texture_detail::decode_texel(tile + offset, texture.format);
+        }
+
+        // The texels of a tile, valid until the thread looks up another tile.
+        const uint8_t *find_tile(const cached_texture &texture, uint64_t key, uint64_t index) const {
+            static thread_local local_table table;
+            if (table.owner.load(std::memory_order_relaxed) != id) {
+                const std::lock_guard lock(local_tables().mutex);
+                table.slots = {};
+                table.owner.store(id, std::memory_order_relaxed);
+            }
+
+            auto &slot = table.slots[mix64(key) % local_slots];
+            if (slot.key != key) {
+                slot.texels = shared_tile(texture, key, index);
+                slot.key = key;
+            }
+            return slot.texels->data();
+        }
+
+        tile_data shared_tile(const cached_texture &texture, uint64_t key, uint64_t index) const {
+            {
+                const std::lock_guard lock(mutex);
+                ++counters.lookups;
+                const auto found = tiles.find(key);
+                if (found != tiles.end()) {
+                    lru.splice(lru.begin(), lru, found->second.position);
+                    return found->second.texels;
+                }
+            }
+
+            // Read without the lock, a thread that raced to the same tile wastes a read.
+            auto texels = std::make_shared<std::vector<uint8_t>>(texture.tile_bytes);
+            const auto offset = static_cast<off_t>(sizeof(texture_file_header) + index * texture.tile_bytes);
+            for (size_t done = 0; done < texels->size();) {
+                const auto count = ::pread(texture.fd, texels->data() + done, texels->size() - done, offset + static_cast<off_t>(done));
+                if (count < 0 && errno == EINTR) { continue; }
+                if (count <= 0) { throw std::runtime_error("Unable to read a tile of " + texture.path); }
+                done += static_cast<size_t>(count);
+            }
+
+            const std::lock_guard lock(mutex);
+            ++counters.reads;
+            const auto [position, inserted] = tiles.try_emplace(key);
+            if (inserted) {
+                lru.push_front(key);
+                position->second = {std::move(texels), lru.begin()};
+                counters.resident_bytes += texture.tile_bytes;
+                counters.peak_bytes = std::max(counters.peak_bytes, counters.resident_bytes);
+                evict();
+            }
+            return position->second.texels;
+        }
+
+        // With the lock held. The tile just added always stays.
+        void evict() const {
+            while (counters.resident_bytes > budget && lru.size() > 1) {
+                const auto found = tiles.find(lru.back());
+                counters.resident_bytes -= found->second.texels->size();
+                tiles.erase(found);
+                lru.pop_back();
+                ++counters.evictions;
+            }
+        }
+
+        static uint64_t next_id() {
+            static std::atomic<uint64_t> last_id = 0;
+            return ++last_id;
+        }
+
+    private:
+        const uint64_t id = next_id();     // Tells the per-thread tables of caches apart.
+        std::vector<cached_texture> textures;
+        size_t converted_count = 0;
+
+        mutable std::mutex mutex;
+        size_t budget;
+        mutable std::unordered_map<uint64_t, resident_tile> tiles;
+        mutable std::list<uint64_t> lru;    // Most recently used first.
+        mutable texture_cache_stats counters;
+};
+
+// An image read through a texture cache.
+class image_texture : public texture {
+    public:
+        image_texture(std::shared_ptr<const texture_cache> cache, uint32_t handle) : cache(std::move(cache)), handle(handle) { }
+
+        virtual color value(const hit_record &rec) const override { return cache->sample(handle, rec.u, rec.v, rec.footprint); }
+
+    private:
+        std::shared_ptr<const texture_cache> cache;
+        uint32_t handle;
+};
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+class thread_pool {
+    public:
+        explicit thread_pool(unsigned thread_count = std::thread::hardware_concurrency()) {
+            thread_count = std::max(1u, thread_count);
+            for (unsigned i = 0; i < thread_count; ++i) {
+                workers.emplace_back([this] { worker_loop(); });
+            }
+        }
+
+        ~thread_pool() {
+            {
+                std::lock_guard lock(mutex);
+                stopping = true;
+            }
+            wake.notify_all();
+            for (auto &worker : workers) {
+                worker.join();
+            }
+        }
+
+        thread_pool(const thread_pool &) = delete;
+        thread_pool &operator = (const thread_pool &) = delete;
+
+        unsigned size() const { return static_cast<unsigned>(workers.size()); }
+
+        void submit(std::function<void()> task) {
+            {
+                std::lock_guard lock(mutex);
+                tasks.push_back(std::move(task));
+            }
+            wake.notify_one();
+        }
+
+        // Calls body(i) for every i in [0, count). The calling thread takes part in
+        // the loop, so a parallel_for issued from inside a pool task cannot deadlock
+        // waiting for workers that are busy with the outer task.
+        template <typename F>
+        void parallel_for(size_t count, F &&body);
+
+    private:
+        void worker_loop() {
+            while (true) {
+                std::function<void()> task;
+                {
+                    std::unique_lock lock(mutex);
+                    wake.wait(lock, [this] { return stopping || !tasks.empty(); });
+                    if (stopping && tasks.empty()) { return; }
+                    task = std::move(tasks.front());
+                    tasks.pop_front();
+                }
+                task();
+            }
+        }
+
+    private:
+        std::vector<std::thread> workers;
+        std::deque<std::function<void()>> tasks;
+        std::mutex mutex;
+        std::condition_variable wake;
+        bool stopping = false;
+};
+
+template <typename F>
+void thread_pool::parallel_for(size_t count, F &&body) {
+    if (count == 0) { return; }
+
+    struct loop_state {
+        std::atomic<size_t> next = 0;
+        size_t done = 0;
+        size_t count = 0;
+        std::exception_ptr error;
+        std::mutex mutex;
+        std::condition_variable finished;
+    };
+
+    auto state = std::make_shared<loop_state>();
+    state->count = count;
+
+    // Helpers that start after the loop is exhausted return without touching body,
+    // which is why capturing it by reference is safe.
+    auto run = [state, &body] {
+        size_t i;
+        while ((i = state->next.fetch_add(1)) < state->count) {
+            std::exception_ptr error;
+            try {
+                body(i);
+            } catch (...) {
+                error = std::current_exception();
+            }
+
+            std::lock_guard lock(state->mutex);
+            if (error && !state->error) { state->error = error; }
+            if (++state->done == state->count) { state->finished.notify_all(); }
+        }
+    };
+
+    const auto helpers = std::min<size_t>(size(), count - 1);
+    for (size_t h = 0; h < helpers; ++h) {
+        submit(run);
+    }
+    run();
+
+    std::unique_lock lock(state->mutex);
+    state->finished.wait(lock, [&] { return state->done == state->count; });
+    if (state->error) { std::rethrow_exception(state->error); }
+}
@@ -0,0 +1,107 @@
+#pragma once
+
+#include "aabb.h"
+#include "rtweekend.h"
+#include <cmath>
+#include <stdexcept>
+
+
+// Affine transform, a 3x3 linear part and a translation in the last column.
+struct transform {
+    double m[3][4] = {{1.0, 0.0, 0.0, 0.0}, {0.0, 1.0, 0.0, 0.0}, {0.0, 0.0, 1.0, 0.0}};
+
+    static transform translation(const vec3 &offset) {
+        transform t;
+        t.m[0][3] = offset.x;
+        t.m[1][3] = offset.y;
+        t.m[2][3] = offset.z;
+        return t;
+    }
+
+    static transform scaling(const vec3 &factors) {
+        transform t;
+        t.m[0][0] = factors.x;
+        t.m[1][1] = factors.y;
+        t.m[2][2] = factors.z;
+        return t;
+    }
+
+    // Counterclockwise around axis 0, 1 or 2 when looking down the axis.
+    static transform rotation(int axis, double degrees) {
+        const auto radians = degree_to_radians(degrees);
+        const auto c = std::cos(radians), s = std::sin(radians);
+        const int a = (axis + 1) % 3, b = (axis + 2) % 3;
+        transform t;
+        t.m[a][a] = c;
+        t.m[a][b] = -s;
+        t.m[b][a] = s;
+        t.m[b][b] = c;
+        return t;
+    }
+
+    // This transform applied after other.
+    transform operator*(const transform &other) const {
+        transform result;
+        for (int row = 0; row < 3; ++row) {
+            for (int column = 0; column < 4; ++column) {
+                double sum = column == 3 ? m[row][3] : 0.0;
+                for (int k = 0; k < 3; ++k) { sum += m[row][k] * other.m[k][column]; }
+                result.m[row][column] = sum;
+            }
+        }
+        return result;
+    }
+
+    point3 apply_point(const point3 &p) const {
+        return point3(m[0][0]*p.x + m[0][1]*p.y + m[0][2]*p.z + m[0][3],
+                      m[1][0]*p.x + m[1][1]*p.y + m[1][2]*p.z + m[1][3],
+                      m[2][0]*p.x + m[2][1]*p.y + m[2][2]*p.z + m[2][3]);
+    }
+
+    vec3 apply_vector(const vec3 &v) const {
+        return vec3(m[0][0]*v.x + m[0][1]*v.y + m[0][2]*v.z,
+                    m[1][0]*v.x + m[1][1]*v.y + m[1][2]*v.z,
+                    m[2][0]*v.x + m[2][1]*v.y + m[2][2]*v.z);
+    }
+
+    // Normals go through the transpose of the inverse, call this on the inverse.
+    vec3 apply_normal_of_inverse(const vec3 &n) const {
+        return vec3(m[0][0]*n.x + m[1][0]*n.y + m[2][0]*n.z,
+                    m[0][1]*n.x + m[1][1]*n.y + m[2][1]*n.z,
+                    m[0][2]*n.x + m[1][2]*n.y + m[2][2]*n.z);
+    }
+
+    transform inverse() const {
+        const auto det = m[0][0] * (m[1][1]*m[2][2] - m[1][2]*m[2][1])
+                       - m[0][1] * (m[1][0]*m[2][2] - m[1][2]*m[2][0])
+                       + m[0][2] * (m[1][0]*m[2][1] - m[1][1]*m[2][0]);
+        if (std::fabs(det) < 1e-12) { throw std::runtime_error("The transform can't be inverted"); }
+        const auto inverse_det = 1.0 / det;
+
+        transform t;
+        t.m[0][0] = (m[1][1]*m[2][2] - m[1][2]*m[2][1]) * inverse_det;
+        t.m[0][1] = (m[0][2]*m[2][1] - m[0][1]*m[2][2]) * inverse_det;
+        t.m[0][2] = (m[0][1]*m[1][2] - m[0][2]*m[1][1]) * inverse_det;
+        t.m[1][0] = (m[1][2]*m[2][0] - m[1][0]*m[2][2]) * inverse_det;
+        t.m[1][1] = (m[0][0]*m[2][2] - m[0][2]*m[2][0]) * inverse_det;
+        t.m[1][2] = (m[0][2]*m[1][0] - m[0][0]*m[1][2]) * inverse_det;
+        t.m[2][0] = (m[1][0]*m[2][1] - m[1][1]*m[2][0]) * inverse_det;
+        t.m[2][1] = (m[0][1]*m[2][0] - m[0][0]*m[2][1]) * inverse_det;
+        t.m[2][2] = (m[0][0]*m[1][1] - m[0][1]*m[1][0]) * inverse_det;
+        const auto offset = t.apply_vector(vec3(m[0][3], m[1][3], m[2][3]));
+        t.m[0][3] = -offset.x;
+        t.m[1][3] = -offset.y;
+        t.m[2][3] = -offset.z;
+        return t;
+    }
+
+    aabb apply(const aabb &box) const {
+        aabb result;
+        if (box.empty()) { return result; }
+        for (int corner = 0; corner < 8; ++corner) {
+            const point3 p(corner & 1 ? box.max[0] : box.min[0], corner & 2 ? box.max[1] : box.min[1], corner & 4 ? box.max[2] : box.min[2]);
+            result.grow(sphere_box(apply_point(p), 0.0));
+        }
+        return result;
+    }
+};
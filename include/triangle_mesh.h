@@ -0,0 +1,287 @@
+#pragma once
+
+#include "aabb.h"
+#include "bvh.h"
+#include "hittable.h"
+#include "material.h"
+#include "rtweekend.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+
+// Vertex positions in structure of arrays layout and three vertex indices per
+// triangle. Meshes share their buffers instead of copying them.
+struct mesh_buffers {
+    std::vector<float> x;
+    std::vector<float> y;
+    std::vector<float> z;
+    std::vector<uint32_t> indices;
+
+    size_t vertex_count() const { return x.size(); }
+    size_t triangle_count() const { return indices.size() / 3; }
+};
+
+// Four triangles of a BVH leaf laid out for one 4-wide Möller-Trumbore test:
+// the first vertex and both edges of every lane, component by component.
+// Lanes past the end of the leaf are degenerate and never hit.
+struct triangle_packet {
+    float v0[3][4];
+    float e1[3][4];
+    float e2[3][4];
+    uint32_t triangle[4];
+};
+
+enum class triangle_test {
+    scalar,
+    simd,       // SSE2 when the target has it, the scalar test otherwise.
+};
+
+struct mesh_hit {
+    float t;
+    uint32_t triangle;
+};
+
+namespace mesh_detail {
+    // Determinants below this are rays parallel to the triangle.
+    constexpr float parallel_epsilon = 1e-12f;
+
+    inline void test_packet_scalar(const triangle_packet &p, const float origin[3], const float direction[3],
+                                   float t_min, mesh_hit &closest) {
+        for (int lane = 0; lane < 4; ++lane) {
+            const float e1[3] = {p.e1[0][lane], p.e1[1][lane], p.e1[2][lane]};
+            const float e2[3] = {p.e2[0][lane], p.e2[1][lane], p.e2[2][lane]};
+            const float pvec[3] = {direction[1]*e2[2] - direction[2]*e2[1], direction[2]*e2[0] - direction[0]*e2[2], direction[0]*e2[1] - direction[1]*e2[0]};
+            const float det = e1[0]*pvec[0] + e1[1]*pvec[1] + e1[2]*pvec[2];
+            if (!(std::fabs(det) > parallel_epsilon)) { continue; }
+            const float inverse_det = 1.0f / det;
+
+            const float tvec[3] = {origin[0] - p.v0[0][lane], origin[1] - p.v0[1][lane], origin[2] - p.v0[2][lane]};
+            const float u = (tvec[0]*pvec[0] + tvec[1]*pvec[1] + tvec[2]*pvec[2]) * inverse_det;
+            const float qvec[3] = {tvec[1]*e1[2] - tvec[2]*e1[1], tvec[2]*e1[0] - tvec[0]*e1[2], tvec[0]*e1[1] - tvec[1]*e1[0]};
+            const float v = (direction[0]*qvec[0] + direction[1]*qvec[1] + direction[2]*qvec[2]) * inverse_det;
+            const float t = (e2[0]*qvec[0] + e2[1]*qvec[1] + e2[2]*qvec[2]) * inverse_det;
+            if (u >= 0.0f && v >= 0.0f && u + v <= 1.0f && t > t_min && t < closest.t) {
+                closest = {t, p.triangle[lane]};
+            }
+        }
+    }
+
+#if defined(__SSE2__)
+    inline void test_packet_sse2(const triangle_packet &p, const __m128 origin[3], const __m128 direction[3],
+                                 __m128 t_min, mesh_hit &closest) {
+        const __m128 e1x = _mm_loadu_ps(p.e1[0]), e1y = _mm_loadu_ps(p.e1[1]), e1z = _mm_loadu_ps(p.e1[2]);
+        const __m128 e2x = _mm_loadu_ps(p.e2[0]), e2y = _mm_loadu_ps(p.e2[1]), e2z = _mm_loadu_ps(p.e2[2]);
+
+        const __m128 px = _mm_sub_ps(_mm_mul_ps(direction[1], e2z), _mm_mul_ps(direction[2], e2y));
+        const __m128 py = _mm_sub_ps(_mm_mul_ps(direction[2], e2x), _mm_mul_ps(direction[0], e2z));
+        const __m128 pz = _mm_sub_ps(_mm_mul_ps(direction[0], e2y), _mm_mul_ps(direction[1], e2x));
+        const __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+        const __m128 abs_det = _mm_andnot_ps(_mm_set1_ps(-0.0f), det);
+        const __m128 inverse_det = _mm_div_ps(_mm_set1_ps(1.0f), det);
+
+        const __m128 tx = _mm_sub_ps(origin[0], _mm_loadu_ps(p.v0[0]));
+        const __m128 ty = _mm_sub_ps(origin[1], _mm_loadu_ps(p.v0[1]));
+        const __m128 tz = _mm_sub_ps(origin[2], _mm_loadu_ps(p.v0[2]));
+        const __m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)), _mm_mul_ps(tz, pz)), inverse_det);
+
+        const __m128 qx = _mm_sub_ps(_mm_mul_ps(ty, e1z), _mm_mul_ps(tz, e1y));
+        const __m128 qy = _mm_sub_ps(_mm_mul_ps(tz, e1x), _mm_mul_ps(tx, e1z));
+        const __m128 qz = _mm_sub_ps(_mm_mul_ps(tx, e1y), _mm_mul_ps(ty, e1x));
+        const __m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(direction[0], qx), _mm_mul_ps(direction[1], qy)), _mm_mul_ps(direction[2], qz)), inverse_det);
+        const __m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), inverse_det);
+
+        const __m128 zero = _mm_setzero_ps();
+        __m128 mask = _mm_cmpgt_ps(abs_det, _mm_set1_ps(parallel_epsilon));
+        mask = _mm_and_ps(mask, _mm_cmpge_ps(u, zero));
+        mask = _mm_and_ps(mask, _mm_cmpge_ps(v, zero));
+        mask = _mm_and_ps(mask, _mm_cmple_ps(_mm_add_ps(u, v), _mm_set1_ps(1.0f)));
+        mask = _mm_and_ps(mask, _mm_cmpgt_ps(t, t_min));
+        mask = _mm_and_ps(mask, _mm_cmplt_ps(t, _mm_set1_ps(closest.t)));
+
+        auto hits = _mm_movemask_ps(mask);
+        if (!hits) { return; }
+        float lanes[4];
+        _mm_storeu_ps(lanes, t);
+        for (int lane = 0; lane < 4; ++lane, hits >>= 1) {
+            if ((hits & 1) && lanes[lane] < closest.t) { closest = {lanes[lane], p.triangle[lane]}; }
+        }
+    }
+#endif
+
+    // The surface of a hit of r at t on the triangle v0, v0 + e1, v0 + e2, once
+    // rec has its material.
+    inline void set_triangle_hit(hit_record &rec, const ray &r, double t, const point3 &v0, const vec3 &e1, const vec3 &e2) {
+        const auto normal = cross(e1, e2);
+        rec.t = t;
+        rec.p = r.at(t);
+        rec.set_face_normal(r, normalized(normal));
+        if (rec.material->textured) {
+            // The meshes have no texture coordinates, a triangle maps to the
+            // barycentric ones of its second and third corners.
+            const auto d = rec.p - v0;
+            const auto d11 = dot(e1, e1), d12 = dot(e1, e2), d22 = dot(e2, e2);
+            const auto d1 = dot(d, e1), d2 = dot(d, e2);
+            const auto denominator = d11*d22 - d12*d12;
+            rec.u = (d22*d1 - d12*d2) / denominator;
+            rec.v = (d11*d2 - d12*d1) / denominator;
+            rec.uv_scale = 1.0 / std::sqrt(normal.length());
+        }
+    }
+
+    inline uint32_t leaf_packet_count(const bvh_node &leaf) { return (leaf.count + 3) / 4; }
+
+    // Gathers the triangles of every leaf of tree into packets, in node order.
+    // The primitives of the tree are the triangles given, or those of the mesh
+    // when none are.
+    inline void pack_leaves(const mesh_buffers &mesh, const bvh &tree, std::span<const uint32_t> triangles,
+                            std::vector<uint32_t> &leaf_packets, std::vector<triangle_packet> &packets) {
+        leaf_packets.assign(tree.nodes.size(), 0);
+        for (size_t node = 0; node < tree.nodes.size(); ++node) {
+            const auto &leaf = tree.nodes[node];
+            if (leaf.count == 0) { continue; }
+            leaf_packets[node] = static_cast<uint32_t>(packets.size());
+
+            for (uint32_t i = 0; i < leaf.count; i += 4) {
+                triangle_packet p{};
+                for (uint32_t lane = 0; lane < 4 && i + lane < leaf.count; ++lane) {
+                    const auto primitive = tree.indices[leaf.first + i + lane];
+                    const auto triangle = triangles.empty() ? primitive : triangles[primitive];
+                    const auto *corners = &mesh.indices[static_cast<size_t>(triangle) * 3];
+                    const float *axes[3] = {mesh.x.data(), mesh.y.data(), mesh.z.data()};
+                    for (int axis = 0; axis < 3; ++axis) {
+                        p.v0[axis][lane] = axes[axis][corners[0]];
+                        p.e1[axis][lane] = axes[axis][corners[1]] - axes[axis][corners[0]];
+                        p.e2[axis][lane] = axes[axis][corners[2]] - axes[axis][corners[0]];
+                    }
+                    p.triangle[lane] = triangle;
+                }
+                packets.push_back(p);
+            }
+        }
+    }
+
+    // Lowers closest to the nearest hit of r in (t_min, closest.t) among the
+    // packets of the leaves of tree.
+    inline void intersect_leaves(const bvh &tree, std::span<const uint32_t> leaf_packets, std::span<const triangle_packet> packets,
+                                 const ray &r, float t_min, mesh_hit &closest, triangle_test test) {
+        const box_ray box_r(r);
+        const float origin[3] = {static_cast<float>(r.origin.x), static_cast<float>(r.origin.y), static_cast<float>(r.origin.z)};
+        const float direction[3] = {static_cast<float>(r.direction.x), static_cast<float>(r.direction.y), static_cast<float>(r.direction.z)};
+
+#if defined(__SSE2__)
+        if (test == triangle_test::simd) {
+            const __m128 origin4[3] = {_mm_set1_ps(origin[0]), _mm_set1_ps(origin[1]), _mm_set1_ps(origin[2])};
+            const __m128 direction4[3] = {_mm_set1_ps(direction[0]), _mm_set1_ps(direction[1]), _mm_set1_ps(direction[2])};
+            const __m128 t_min4 = _mm_set1_ps(t_min);
+            traverse_bvh(tree, box_r, t_min, closest.t, [&](const bvh_node &leaf) {
+                const auto first = leaf_packets[&leaf - tree.nodes.data()];
+                for (auto i = first; i < first + leaf_packet_count(leaf); ++i) {
+                    test_packet_sse2(packets[i], origin4, direction4, t_min4, closest);
+                }
+            });
+            return;
+        }
+#endif
+        traverse_bvh(tree, box_r, t_min, closest.t, [&](const bvh_node &leaf) {
+            const auto first = leaf_packets[&leaf - tree.nodes.data()];
+            for (auto i = first; i < first + leaf_packet_count(leaf); ++i) {
+                test_packet_scalar(packets[i], origin, direction, t_min, closest);
+            }
+        });
+    }
+}
+
+// Indexed triangle mesh with its own BVH. The leaves of the hierarchy hold up
+// to four packets of four triangles, tested four at a time.
+namespace mesh_detail {
+    inline void check_mesh(const mesh_buffers &mesh) {
+        if (mesh.indices.size() % 3 != 0 || mesh.y.size() != mesh.vertex_count() || mesh.z.size() != mesh.vertex_count()) {
+            throw std::runtime_error("Malformed triangle mesh");
+        }
+        if (std::ranges::any_of(mesh.indices, [&](uint32_t index) { return index >= mesh.vertex_count(); })) {
+            throw std::runtime_error("Triangle mesh index out of range");
+        }
+    }
+}
+
+// Hierarchy of the triangles of a mesh.
+inline bvh build_mesh_bvh(const mesh_buffers &mesh, const bvh_build_settings &settings = {}) {
+    mesh_detail::check_mesh(mesh);
+    std::vector<aabb> bounds(mesh.triangle_count());
+    for (size_t i = 0; i < bounds.size(); ++i) {
+        for (int corner = 0; corner < 3; ++corner) {
+            const auto vertex = mesh.indices[i * 3 + corner];
+            const float position[3] = {mesh.x[vertex], mesh.y[vertex], mesh.z[vertex]};
+            bounds[i].grow(position);
+        }
+    }
+    return build_bvh(bounds, settings);
+}
+
+// Key of the hierarchy of a mesh, see bvh_key.
+inline uint64_t mesh_bvh_key(const mesh_buffers &mesh, const bvh_build_settings &settings) {
+    const auto key = bvh_key({mesh.x, mesh.y, mesh.z}, settings);
+    return bvh_detail::hash_bytes(mesh.indices.data(), mesh.indices.size() * sizeof(uint32_t), key);
+}
+
+class triangle_mesh : public hittable {
+    public:
+        triangle_mesh(std::shared_ptr<const mesh_buffers> buffers, std::shared_ptr<material> mat, const bvh_build_settings &settings = {})
+            : triangle_mesh(buffers, std::move(mat), build_mesh_bvh(*buffers, settings)) { }
+
+        // With the hierarchy of build_mesh_bvh, built beforehand or mapped from a cache.
+        triangle_mesh(std::shared_ptr<const mesh_buffers> buffers, std::shared_ptr<material> mat, bvh hierarchy)
+            : buffers(std::move(buffers)), mat(std::move(mat)), tree(std::move(hierarchy)) {
+            const auto &mesh = *this->buffers;
+            mesh_detail::check_mesh(mesh);
+            if (tree.indices.size() != mesh.triangle_count()) { throw std::runtime_error("The hierarchy doesn't match the triangle mesh"); }
+            mesh_detail::pack_leaves(mesh, tree, {}, leaf_packets, packets);
+        }
+
+        size_t triangle_count() const { return buffers->triangle_count(); }
+        const bvh &hierarchy() const { return tree; }
+
+        // Closest triangle hit by r in (t_min, t_max), in single precision.
+        bool intersect(const ray &r, float t_min, float t_max, mesh_hit &closest, triangle_test test = triangle_test::simd) const {
+            closest = {t_max, 0};
+            mesh_detail::intersect_leaves(tree, leaf_packets, packets, r, t_min, closest, test);
+            return closest.t < t_max;
+        }
+
+        virtual aabb bounds() const override { return tree.bounds(); }
+
+        virtual bool hit(const ray &r, double t_min, double t_max, hit_record &rec) const override {
+            mesh_hit closest;
+            const auto far = static_cast<float>(std::min(t_max, static_cast<double>(std::numeric_limits<float>::max())));
+            if (!intersect(r, static_cast<float>(t_min), far, closest)) { return false; }
+
+            const auto &mesh = *buffers;
+            auto vertex = [&mesh](uint32_t index) { return point3(mesh.x[index], mesh.y[index], mesh.z[index]); };
+            const auto *corners = &mesh.indices[static_cast<size_t>(closest.triangle) * 3];
+            const auto v0 = vertex(corners[0]);
+            const auto e1 = vertex(corners[1]) - v0, e2 = vertex(corners[2]) - v0;
+
+            rec.material = mat.get();
+            rec.object_id = object_id;
+            mesh_detail::set_triangle_hit(rec, r, closest.t, v0, e1, e2);
+            return true;
+        }
+
+    private:
+        std::shared_ptr<const mesh_buffers> buffers;
+        std::shared_ptr<material> mat;
+        bvh tree;
+        std::vector<uint32_t> leaf_packets;     // First packet of every leaf node.
+        std::vector<triangle_packet> packets;
+};
@@ -2,37 +2,62 @@
 #include "hittable.h"
 #include "rtweekend.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <filesystem>
+#include <fstream>
 #include <iostream>
+#include <map>
+#include <sstream>
 #include <memory>
+#include <stdexcept>
+#include <string>
 #include "hittable_list.h"
 #include "sphere.h"
 #include "vec3.h"
 #include "camera.h"
 #include "materials.h"
+#include "medium.h"
+#include "checkpoint.h"
+#include "merge.h"
+#include "mesh_loader.h"
+#include "noise.h"
+#include "bvh_refit.h"
+#include "camera_path.h"
+#include "denoiser.h"
+#include "farm.h"
+#include "framebuffer.h"
+#include "image_writer.h"
+#include "instance.h"
+#include "options.h"
+#include "progressive.h"
+#include "renderer.h"
+#include "scene.h"
+#include "scene_binary.h"
+#include "scene_parser.h"
+#include "server.h"
+#include "streamed_mesh.h"
+#include "streaming.h"
+#include "texture.h"
+#include "thread_pool.h"
+#include "triangle_mesh.h"
 
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb/stb_image_write.h"
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb/stb_image.h"
 
 using std::make_shared;
 
+static std::atomic<bool> interrupt_requested = false;
 
-color ray_color(const ray &r, const hittable &world, int depth) {
-    // If we've exceeded the ray bounce limit, no more light is gathered.
-    if(depth <= 0) { return color(0.0); }
-
-    hit_record rec;
-    if(world.hit(r, 0.001, infinity, rec)) {
-        ray scattered;
-        color attenuation;
-        if(rec.material->scatter(r, rec, attenuation, scattered)) {
-            return attenuation * ray_color(scattered, world, depth - 1);
-        }
-        return color(0.0);
-    }
-    auto t = 0.5 * (r.direction.y + 1.0);
-    return (1.0 - t)*color(1.0) + t*color(0.5, 0.7, 1.0);
+extern "C" void request_interrupt(int) {
+    interrupt_requested = true;
 }
 
+
 hittable_list random_scene() {
     hittable_list world;
 
@@ -76,54 +101,1009 @@ hittable_list random_scene() {
     auto material3 = make_shared<metal>(color(0.7, 0.6, 0.5), 0.0);
     world.add(make_shared<sphere>(point3(4, 1, 0), 1.0, material3));
 
+    // Every sphere has its own material, both are numbered from 1 in the order they were added.
+    for (size_t i = 0; i < world.objects.size(); ++i) {
+        auto &ball = static_cast<sphere &>(*world.objects[i]);
+        ball.object_id = ball.material->material_id = static_cast<uint32_t>(i + 1);
+    }
+    return world;
+}
+
+// Import statistics of a mesh of a scene file.
+struct mesh_import {
+    std::string path;
+    size_t triangles = 0;
+    size_t bytes = 0;           // Of the mesh file, streamed meshes may not have it anymore.
+    double load_seconds = 0.0;
+    double bvh_seconds = 0.0;
+    bool bvh_from_cache = false;
+    bool streamed = false;
+};
+
+// The geometry of a render, the random scene of the first book or the spheres
+// and meshes of a scene file.
+struct scene_world {
+    hittable_list objects;
+    scene_description description;
+    size_t bvh_nodes = 0;
+    bool bvh_from_cache = false;
+    double bvh_seconds = 0.0;
+    std::vector<mesh_import> meshes;
+    uint64_t scene_key = 0;     // Of the description, 0 for the random scene.
+    double tlas_seconds = 0.0;
+    std::shared_ptr<texture_cache> textures = std::make_shared<texture_cache>();
+    double texture_seconds = 0.0;
+    std::shared_ptr<geometry_cache> geometry = std::make_shared<geometry_cache>();
+    double media_seconds = 0.0;
+
+    const hittable &root() const { return objects; }
+};
+
+std::shared_ptr<scene_world> random_world(uint64_t seed) {
+    auto world = std::make_shared<scene_world>();
+    seed_random(seed);
+    world->objects = random_scene();
+    return world;
+}
+
+// Loads a scene file. The hierarchy of its spheres is cached next to it, in
+// <path>.bvh, and only rebuilt when the spheres or the build settings change.
+// Textures are converted to tiled files next to their images the first time,
+// see texture_cache. Meshes are imported with the pool, their objects ids follow the spheres,
+// and the hierarchy of each is cached next to it in <mesh>.bvh the same way.
+// Streamed meshes are converted to clustered files next to them instead, see geometry_cache.
+// Instances share the hierarchy of their object under one top-level BVH, their
+// object ids follow the meshes. Media come last, after the surfaces which bound
+// their tracking, and their object ids follow the instances. Materials are
+// numbered from 1 in file order, the phase materials of the media after them.
+std::shared_ptr<scene_world> load_world(const std::string &path, thread_pool &pool) {
+    auto world = std::make_shared<scene_world>();
+    const auto &scene = world->description = file_extension(path) == "rtsc" ? map_scene(path) : load_scene(path);
+    world->scene_key = scene_key(scene);
+
+    const auto bvh_start = std::chrono::steady_clock::now();
+    const bvh_build_settings settings;
+    auto [tree, from_cache] = load_or_build_bvh(path + ".bvh", sphere_bvh_key(scene, settings), scene.sphere_count(), [&] {
+        return build_sphere_bvh(scene, settings);
+    });
+    world->bvh_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - bvh_start).count();
+    world->bvh_nodes = tree.nodes.size();
+    world->bvh_from_cache = from_cache;
+
+    const auto directory = std::filesystem::path(path).parent_path();
+    const auto texture_start = std::chrono::steady_clock::now();
+    std::vector<std::shared_ptr<const texture>> textures;
+    for (const auto &reference : scene.textures) {
+        if (reference.type == texture_type::noise) {
+            textures.push_back(make_shared<noise_texture>(reference.scale, static_cast<int>(reference.octaves), reference.marble));
+            continue;
+        }
+        const auto handle = world->textures->add((directory / reference.path).string(), reference.srgb);
+        textures.push_back(make_shared<image_texture>(world->textures, handle));
+    }
+    world->texture_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - texture_start).count();
+
+    std::vector<std::shared_ptr<material>> materials;
+    for (const auto &desc : scene.materials) {
+        materials.push_back(make_material(desc, textures));
+        materials.back()->material_id = static_cast<uint32_t>(materials.size());
+    }
+    world->objects.add(make_shared<sphere_array>(scene, std::move(tree), materials));
+
+    std::vector<std::shared_ptr<hittable>> meshes;
+    for (size_t i = 0; i < scene.meshes.size(); ++i) {
+        mesh_import import;
+        import.path = (directory / scene.meshes[i].path).string();
+        const auto extension = file_extension(import.path);
+        if (extension != "obj" && extension != "ply") { throw std::runtime_error("Unsupported mesh format: " + import.path); }
+
+        const auto load_start = std::chrono::steady_clock::now();
+        std::shared_ptr<hittable> mesh;
+        if (scene.meshes[i].streamed) {
+            const auto handle = world->geometry->add(import.path, pool);
+            const auto bvh_start = std::chrono::steady_clock::now();
+            auto streamed = make_shared<streamed_mesh>(world->geometry, handle, materials[scene.meshes[i].material]);
+            import.load_seconds = std::chrono::duration<double>(bvh_start - load_start).count();
+            import.bvh_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - bvh_start).count();
+            import.triangles = streamed->triangle_count();
+            import.streamed = true;
+            mesh = std::move(streamed);
+        } else {
+            auto buffers = extension == "obj" ? load_obj(import.path, pool) : load_ply(import.path);
+            const auto bvh_start = std::chrono::steady_clock::now();
+            auto [mesh_tree, mesh_from_cache] = load_or_build_bvh(import.path + ".bvh", mesh_bvh_key(*buffers, settings), buffers->triangle_count(),
+                                                                  [&] { return build_mesh_bvh(*buffers, settings); });
+            auto resident = make_shared<triangle_mesh>(buffers, materials[scene.meshes[i].material], std::move(mesh_tree));
+            import.bvh_from_cache = mesh_from_cache;
+            import.load_seconds = std::chrono::duration<double>(bvh_start - load_start).count();
+            import.bvh_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - bvh_start).count();
+            import.triangles = resident->triangle_count();
+            import.bytes = std::filesystem::file_size(import.path);
+            mesh = std::move(resident);
+        }
+
+        mesh->object_id = static_cast<uint32_t>(scene.sphere_count() + 1 + i);
+        if (scene.meshes[i].placed) { world->objects.add(mesh); }
+        meshes.push_back(std::move(mesh));
+        world->meshes.push_back(import);
+    }
+
+    if (!scene.instances.empty()) {
+        const auto tlas_start = std::chrono::steady_clock::now();
+        auto instances = make_shared<instance_list>();
+        for (size_t i = 0; i < scene.instances.size(); ++i) {
+            const auto &desc = scene.instances[i];
+            instance placed(meshes[desc.mesh], instance_transform(desc), vec3(desc.motion[0], desc.motion[1], desc.motion[2]));
+            placed.object_id = static_cast<uint32_t>(scene.sphere_count() + scene.meshes.size() + 1 + i);
+            instances->add(std::move(placed));
+        }
+        instances->rebuild();
+        world->tlas_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - tlas_start).count();
+        world->objects.add(instances);
+    }
+
+    const auto media_start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < scene.media.size(); ++i) {
+        auto fill = make_medium(scene.media[i], static_cast<uint32_t>(scene.materials.size() + 1 + i));
+        fill->object_id = static_cast<uint32_t>(scene.sphere_count() + scene.meshes.size() + scene.instances.size() + 1 + i);
+        world->objects.add(std::move(fill));
+    }
+    world->media_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - media_start).count();
     return world;
 }
 
-int main(int, char**) {
-    const char *result_path = "result.png";
+// The memory budgets of the options, given once the scene defaults are known.
+void set_cache_budgets(scene_world &world, const render_options &options) {
+    world.textures->set_budget(options.texture_cache_mb << 20);
+    world.geometry->set_budget(options.geometry_cache_mb << 20);
+}
+
+// A unit sphere with ripples, tessellated into about triangle_count triangles.
+std::shared_ptr<mesh_buffers> bumpy_sphere(unsigned triangle_count) {
+    const auto rings = std::max(2u, static_cast<unsigned>(std::sqrt(triangle_count / 4.0)));
+    const auto segments = std::max(3u, triangle_count / (2 * rings));
+    auto mesh = std::make_shared<mesh_buffers>();
+
+    for (unsigned ring = 0; ring <= rings; ++ring) {
+        const auto theta = pi * ring / rings;
+        for (unsigned segment = 0; segment < segments; ++segment) {
+            const auto phi = tao * segment / segments;
+            const auto radius = 1.0 + 0.05 * std::sin(13.0 * theta) * std::sin(11.0 * phi);
+            mesh->x.push_back(static_cast<float>(radius * std::sin(theta) * std::cos(phi)));
+            mesh->y.push_back(static_cast<float>(radius * std::cos(theta)));
+            mesh->z.push_back(static_cast<float>(radius * std::sin(theta) * std::sin(phi)));
+        }
+    }
+    for (unsigned ring = 0; ring < rings; ++ring) {
+        for (unsigned segment = 0; segment < segments; ++segment) {
+            const auto a = ring * segments + segment, b = ring * segments + (segment + 1) % segments;
+            const auto c = a + segments, d = b + segments;
+            mesh->indices.insert(mesh->indices.end(), {a, c, b, b, c, d});
+        }
+    }
+    return mesh;
+}
+
+camera scene_camera(const render_settings &settings) {
+    return make_camera(settings.camera, static_cast<double>(settings.image_width) / settings.image_height);
+}
+
+// Renders tiles for a farm coordinator, see farm.h. Stdout carries the results,
+// nothing else may be printed to it.
+int run_worker(const render_options &options) {
+    try {
+        const auto job = read_farm_job(STDIN_FILENO);
+        render_settings settings;
+        settings.image_width = job.width;
+        settings.image_height = job.height;
+        settings.sample_per_pixel = job.sample_per_pixel;
+        settings.max_depth = job.max_depth;
+        settings.seed = job.seed;
+        settings.camera = job.camera;
+
+        thread_pool pool(job.threads);
+        const auto world = options.scene_path.empty() ? random_world(settings.seed) : load_world(options.scene_path, pool);
+        set_cache_budgets(*world, options);
+        const auto cam = scene_camera(settings);
+        renderer r(world->root(), cam, settings);
+        serve_tiles(r, pool, aov_set(job.aovs), STDIN_FILENO, STDOUT_FILENO);
+    } catch (const std::exception &e) {
+        std::cerr << "Worker: " << e.what() << '\n';
+        return 1;
+    }
+    return 0;
+}
+
+// Writes every output of the frame. The .rtfb slices keep the raw samples, the
+// images are denoised first when asked to, which replaces fb.
+void write_outputs(const render_options &options, const render_settings &settings, thread_pool &pool,
+                   framebuffer &fb, int samples_done, const png_band_encoder *png = nullptr) {
+    const auto encode_start = std::chrono::steady_clock::now();
+    for (const auto &path : options.output_paths) {
+        if (file_extension(path) == "rtfb") { save_checkpoint(path, fb, settings, samples_done); }
+    }
+
+    if (options.denoise) {
+        const auto denoise_start = std::chrono::steady_clock::now();
+        fb = denoise(fb, options.denoiser, pool);
+        const std::chrono::duration<double> denoise_time = std::chrono::steady_clock::now() - denoise_start;
+        std::cout << "\nDenoise: " << denoise_time.count() << " s";
+    }
+
+    // Every image is converted from the same float framebuffer.
+    for (const auto &path : options.output_paths) {
+        if (file_extension(path) == "rtfb") { continue; }
+        if (file_extension(path) == "png" && png && png->complete()) {
+            png->write(path);
+        } else {
+            write_image(path, fb, options.tonemap, &pool, options.aovs);
+        }
+    }
+    const std::chrono::duration<double> encode_tail = std::chrono::steady_clock::now() - encode_start;
+
+    std::cout << "\nEncode: " << (png ? png->seconds() : 0.0) << " s overlapped with rendering, " << encode_tail.count() << " s after it";
+    for (const auto &path : options.output_paths) {
+        std::cout << "\nWrote " << path << " with " << samples_done << " samples per pixel";
+    }
+}
+
+// Traffic of the texture and geometry caches over the render, for the scenes which use them.
+void print_cache_stats(const scene_world &world) {
+    if (world.textures->size() > 0) {
+        const auto stats = world.textures->stats();
+        std::cout << "\nTextures: " << stats.lookups << " tile lookups past the thread tables, " << stats.reads << " tiles read, "
+                  << stats.evictions << " evicted, peak " << stats.peak_bytes / 1e6 << " MB resident";
+    }
+    if (world.geometry->size() > 0) {
+        const auto stats = world.geometry->stats();
+        std::cout << "\nGeometry: " << stats.visits << " cluster visits, " << stats.faults << " faults (" << stats.paged_bytes / 1e6
+                  << " MB paged in), " << stats.evictions << " evicted, peak " << stats.peak_bytes / 1e6 << " MB resident";
+    }
+}
+
+// Renders the frames of a camera path. The world stays loaded across frames and
+// each frame is written on a background thread while the next one renders.
+int run_sequence(const render_options &options, const scene_world &world, thread_pool &pool) {
+    using clock = std::chrono::steady_clock;
+
+    const auto keys = load_camera_path(options.camera_path, options.settings.camera);
+    const auto first_frame = keys.front().frame, last_frame = keys.back().frame;
+    const auto frame_count = last_frame - first_frame + 1;
+    const auto &region = options.region;
+    auto aovs = options.aovs;
+    if (options.denoise) { aovs.add({aov::albedo, aov::normal}); }
+
+    frame_writer writer(options.tonemap, options.aovs);
+    const auto sequence_start = clock::now();
+    double render_seconds = 0.0, stall_seconds = 0.0;
+    for (int frame = first_frame; frame <= last_frame; ++frame) {
+        auto settings = options.settings;
+        settings.camera = camera_at(keys, frame);
+        const auto cam = scene_camera(settings);
+        const renderer r(world.root(), cam, settings);
+
+        const auto frame_start = clock::now();
+        framebuffer fb(region.x1 - region.x0, region.y1 - region.y0, region.x0, region.y0, aovs);
+        r.render_pass(pool, fb, 0, settings.sample_per_pixel);
+        if (options.denoise) { fb = denoise(fb, options.denoiser, pool); }
+        const std::chrono::duration<double> frame_time = clock::now() - frame_start;
+        render_seconds += frame_time.count();
+
+        std::vector<std::string> paths;
+        for (const auto &pattern : options.output_paths) { paths.push_back(frame_path(pattern, frame)); }
+        const auto stall = writer.post(std::move(fb), paths);
+        stall_seconds += stall;
+
+        const auto samples = static_cast<double>(region.x1 - region.x0) * (region.y1 - region.y0) * settings.sample_per_pixel;
+        std::cout << "Frame " << frame << " (" << frame - first_frame + 1 << '/' << frame_count << "): " << frame_time.count()
+                  << " s, " << samples / frame_time.count() / 1e6 << " M samples/s, waited " << stall << " s for the writer\n";
+    }
+    writer.finish();
+
+    const std::chrono::duration<double> total = clock::now() - sequence_start;
+    const auto samples = static_cast<double>(region.x1 - region.x0) * (region.y1 - region.y0) * options.settings.sample_per_pixel * frame_count;
+    std::cout << "Sequence: " << frame_count << " frames in " << total.count() << " s, " << frame_count / total.count() << " frames/s, "
+              << samples / total.count() / 1e6 << " M samples/s\n"
+              << "Rendering " << render_seconds << " s, writing " << writer.seconds() << " s of which "
+              << std::max(0.0, total.count() - render_seconds) << " s were not hidden behind rendering ("
+              << stall_seconds << " s waiting for the writer)";
+    print_cache_stats(world);
+    std::cout << '\n';
+    return 0;
+}
+
+// The straightforward OBJ reader the importer is measured against, a string
+// stream per line.
+std::shared_ptr<mesh_buffers> naive_load_obj(const std::string &path) {
+    std::ifstream in(path);
+    if (!in) { throw std::runtime_error("Unable to open " + path); }
+
+    auto mesh = std::make_shared<mesh_buffers>();
+    for (std::string line; std::getline(in, line);) {
+        std::istringstream words(line);
+        std::string keyword;
+        words >> keyword;
+        if (keyword == "v") {
+            float x, y, z;
+            words >> x >> y >> z;
+            mesh->x.push_back(x);
+            mesh->y.push_back(y);
+            mesh->z.push_back(z);
+        } else if (keyword == "f") {
+            std::vector<uint32_t> corners;
+            for (std::string corner; words >> corner;) {
+                const auto index = std::stoll(corner);
+                corners.push_back(static_cast<uint32_t>(index < 0 ? static_cast<long long>(mesh->vertex_count()) + index : index - 1));
+            }
+            for (size_t i = 2; i < corners.size(); ++i) { mesh->indices.insert(mesh->indices.end(), {corners[0], corners[i - 1], corners[i]}); }
+        }
+    }
+    return mesh;
+}
+
+// Times the import of the mesh files given to bench, against the naive reader for OBJ.
+int run_import_bench(const render_options &options) {
+    using clock = std::chrono::steady_clock;
+    thread_pool pool(options.thread_count);
+
+    for (const auto &path : options.input_paths) {
+        const auto extension = file_extension(path);
+        if (extension != "obj" && extension != "ply") { throw std::runtime_error("Unsupported mesh format: " + path); }
+        const auto megabytes = std::filesystem::file_size(path) / 1e6;
+
+        const auto start = clock::now();
+        const auto mesh = extension == "obj" ? load_obj(path, pool) : load_ply(path);
+        const std::chrono::duration<double> seconds = clock::now() - start;
+        std::cout << path << ": " << mesh->triangle_count() << " triangles, " << megabytes << " MB in " << seconds.count()
+                  << " s, " << megabytes / seconds.count() << " MB/s with " << pool.size() << " threads\n";
+
+        if (extension == "obj") {
+            const auto naive_start = clock::now();
+            const auto naive = naive_load_obj(path);
+            const std::chrono::duration<double> naive_seconds = clock::now() - naive_start;
+            std::cout << path << ": " << megabytes / naive_seconds.count() << " MB/s with iostreams, "
+                      << naive_seconds.count() / seconds.count() << "x slower"
+                      << (naive->x == mesh->x && naive->indices == mesh->indices ? "" : ", and a different mesh") << '\n';
+        }
+    }
+    return 0;
+}
+
+// Closest hits of the bench mesh with the scalar and the SIMD triangle tests.
+void bench_triangle_tests(const triangle_mesh &mesh, const std::vector<ray> &camera_rays, const std::vector<ray> &random_rays) {
+    using clock = std::chrono::steady_clock;
+
+    for (const auto &[name, rays] : {std::pair{"Camera rays", &camera_rays}, std::pair{"Random rays", &random_rays}}) {
+        std::vector<mesh_hit> scalar_hits(rays->size()), simd_hits(rays->size());
+        double seconds[2];
+        size_t hit_count = 0;
+        for (auto test : {triangle_test::scalar, triangle_test::simd}) {
+            auto &hits = test == triangle_test::scalar ? scalar_hits : simd_hits;
+            const auto start = clock::now();
+            for (size_t i = 0; i < rays->size(); ++i) {
+                if (!mesh.intersect((*rays)[i], 0.001f, std::numeric_limits<float>::infinity(), hits[i], test)) { hits[i].t = -1.0f; }
+            }
+            seconds[test == triangle_test::simd] = std::chrono::duration<double>(clock::now() - start).count();
+        }
+
+        size_t mismatches = 0;
+        for (size_t i = 0; i < rays->size(); ++i) {
+            hit_count += scalar_hits[i].t >= 0.0f;
+            mismatches += std::fabs(scalar_hits[i].t - simd_hits[i].t) > 1e-4f * std::max(1.0f, scalar_hits[i].t);
+        }
+        const auto mrays = [&](double s) { return rays->size() / s / 1e6; };
+        std::cout << name << ": " << rays->size() << ", " << 100.0 * hit_count / rays->size() << "% hit, scalar "
+                  << mrays(seconds[0]) << " Mrays/s, SIMD " << mrays(seconds[1]) << " Mrays/s ("
+                  << seconds[0] / seconds[1] << "x), " << mismatches << " differing hits\n";
+    }
+#if !defined(__SSE2__)
+    std::cout << "This build has no SSE2, the SIMD test falls back to the scalar one\n";
+#endif
+}
+
+// Animation frames of drifting spheres, whose hierarchy is refit until its
+// cost passes that of the last build by the rebuild ratio.
+void bench_refit(const std::vector<point3> &centers, const std::vector<point3> &velocities, thread_pool &pool) {
+    using clock = std::chrono::steady_clock;
+
+    std::vector<aabb> bounds(centers.size());
+    dynamic_bvh animated;
+    for (int frame = 0; frame < 10; ++frame) {
+        for (size_t i = 0; i < bounds.size(); ++i) { bounds[i] = sphere_box(centers[i] + frame * velocities[i], 0.05); }
+
+        const auto update_start = clock::now();
+        const auto rebuilt = animated.update(bounds, pool);
+        const std::chrono::duration<double> update_time = clock::now() - update_start;
+        const auto build_start = clock::now();
+        const auto fresh = build_bvh(bounds);
+        const std::chrono::duration<double> fresh_time = clock::now() - build_start;
+
+        std::cout << "Frame " << frame << ": " << (rebuilt ? "rebuilt" : "refit") << " in " << update_time.count()
+                  << " s, a full build takes " << fresh_time.count() << " s, SAH cost " << animated.cost() / bvh_sah_cost(fresh)
+                  << "x that of the full build\n";
+    }
+}
+
+// The drifting spheres blown sideways during a frame, traced through boxes that
+// cover their motion and through boxes interpolated at the time of the ray.
+void bench_motion_blur(const std::vector<point3> &centers, const std::vector<point3> &velocities, const std::vector<ray> &random_rays) {
+    using clock = std::chrono::steady_clock;
+
+    auto arrays = std::make_shared<scene_arrays>();
+    for (size_t i = 0; i < centers.size(); ++i) {
+        const auto motion = vec3(0.5, 0.0, 0.0) + 5.0 * velocities[i];
+        arrays->center_x.push_back(static_cast<float>(centers[i].x));
+        arrays->center_y.push_back(static_cast<float>(centers[i].y));
+        arrays->center_z.push_back(static_cast<float>(centers[i].z));
+        arrays->radius.push_back(0.05f);
+        arrays->material.push_back(0);
+        arrays->motion_x.push_back(static_cast<float>(motion.x));
+        arrays->motion_y.push_back(static_cast<float>(motion.y));
+        arrays->motion_z.push_back(static_cast<float>(motion.z));
+    }
+    arrays->materials.emplace_back();
+    const scene_description moving(arrays);
+    const std::vector<std::shared_ptr<material>> materials = {make_material(moving.materials[0])};
+
+    auto swept_bounds = sphere_bounds(moving, 0.0);
+    const auto end_bounds = sphere_bounds(moving, 1.0);
+    for (size_t i = 0; i < swept_bounds.size(); ++i) { swept_bounds[i].grow(end_bounds[i]); }
+    const sphere_array swept(moving, build_bvh(swept_bounds), materials);
+    const sphere_array interpolated(moving, build_sphere_bvh(moving, {}), materials);
+
+    std::vector<ray> blurred_rays;
+    for (const auto &r : random_rays) { blurred_rays.emplace_back(10.0 * r.origin, r.direction, random_double()); }
+    std::vector<double> hit_t[2];
+    double seconds[2];
+    for (int motion_bvh = 0; motion_bvh < 2; ++motion_bvh) {
+        const auto &spheres = motion_bvh ? interpolated : swept;
+        const auto start = clock::now();
+        for (const auto &r : blurred_rays) {
+            hit_record rec;
+            hit_t[motion_bvh].push_back(spheres.hit(r, 0.001, infinity, rec) ? rec.t : -1.0);
+        }
+        seconds[motion_bvh] = std::chrono::duration<double>(clock::now() - start).count();
+    }
+    std::cout << "Motion blur: " << blurred_rays.size() << " rays, boxes over the motion " << blurred_rays.size() / seconds[0] / 1e6
+              << " Mrays/s, interpolated boxes " << blurred_rays.size() / seconds[1] / 1e6 << " Mrays/s ("
+              << seconds[0] / seconds[1] << "x), " << (hit_t[0] == hit_t[1] ? "same" : "differing") << " hits\n";
+}
+
+// Perlin noise of random points one at a time and in batches, then turbulence
+// whose octaves are evaluated one at a time or as a batch.
+void bench_noise(size_t point_count) {
+    using clock = std::chrono::steady_clock;
+
+    const perlin noise;
+    std::vector<float> xs(point_count), ys(point_count), zs(point_count), single(point_count), batched(point_count);
+    for (size_t i = 0; i < point_count; ++i) {
+        xs[i] = static_cast<float>(random_double(-64.0, 64.0));
+        ys[i] = static_cast<float>(random_double(-64.0, 64.0));
+        zs[i] = static_cast<float>(random_double(-64.0, 64.0));
+    }
+    auto start = clock::now();
+    for (size_t i = 0; i < point_count; ++i) { single[i] = noise.noise(xs[i], ys[i], zs[i]); }
+    const std::chrono::duration<double> single_time = clock::now() - start;
+    start = clock::now();
+    noise.noise(xs, ys, zs, batched);
+    const std::chrono::duration<double> batch_time = clock::now() - start;
+    float largest_difference = 0.0f;
+    for (size_t i = 0; i < point_count; ++i) { largest_difference = std::max(largest_difference, std::fabs(single[i] - batched[i])); }
+    std::cout << "Noise: " << point_count << " points, scalar " << point_count / single_time.count() / 1e6 << " M samples/s, batches of "
+              << perlin::lanes << ' ' << point_count / batch_time.count() / 1e6 << " M samples/s (" << single_time.count() / batch_time.count()
+              << "x), largest difference " << largest_difference << '\n';
+
+    constexpr int octaves = 7;
+    start = clock::now();
+    for (size_t i = 0; i < point_count; ++i) {
+        float sum = 0.0f, weight = 1.0f, frequency = 1.0f;
+        for (int octave = 0; octave < octaves; ++octave, weight *= 0.5f, frequency *= 2.0f) {
+            sum += weight * noise.noise(xs[i] * frequency, ys[i] * frequency, zs[i] * frequency);
+        }
+        single[i] = std::fabs(sum);
+    }
+    const std::chrono::duration<double> single_turbulence = clock::now() - start;
+    start = clock::now();
+    for (size_t i = 0; i < point_count; ++i) { batched[i] = noise.turbulence(point3(xs[i], ys[i], zs[i]), octaves); }
+    const std::chrono::duration<double> batch_turbulence = clock::now() - start;
+    largest_difference = 0.0f;
+    for (size_t i = 0; i < point_count; ++i) { largest_difference = std::max(largest_difference, std::fabs(single[i] - batched[i])); }
+    std::cout << "Turbulence: " << octaves << " octaves, scalar " << point_count / single_turbulence.count() / 1e6 << " M samples/s, octave batches "
+              << point_count / batch_turbulence.count() / 1e6 << " M samples/s (" << single_turbulence.count() / batch_turbulence.count()
+              << "x), largest difference " << largest_difference << '\n';
+}
+
+// The random scene of the first book, clear, in fog and in smoke, about a
+// quarter of the bench rays as camera samples.
+void bench_media(const render_options &options, thread_pool &pool) {
+    using clock = std::chrono::steady_clock;
+
+    seed_random(options.settings.seed);
+    auto clear = random_scene();
+    auto foggy = clear, smoky = clear;
+    const point3 fog_min(-14.0, 0.0, -14.0), fog_max(14.0, 3.0, 14.0);
+    foggy.add(make_shared<medium>(fog_min, fog_max, 0.05, make_shared<isotropic>(color(0.8))));
+    const auto grid_start = clock::now();
+    smoky.add(make_shared<medium>(noise_density(fog_min, fog_max, 1.0, 0.5, 4), make_shared<isotropic>(color(0.8))));
+    const std::chrono::duration<double> grid_time = clock::now() - grid_start;
+
+    auto settings = options.settings;
+    settings.image_width = 160;
+    settings.image_height = 106;
+    settings.sample_per_pixel = static_cast<int>(std::max(1u, options.bench_rays / 4 / (settings.image_width * settings.image_height)));
+    const auto cam = scene_camera(settings);
+    const auto samples = static_cast<double>(settings.image_width) * settings.image_height * settings.sample_per_pixel;
+    std::cout << "Media: random scene at " << settings.image_width << 'x' << settings.image_height << ", " << settings.sample_per_pixel << " spp";
+    for (const auto &[name, scene] : {std::pair{"clear", &clear}, std::pair{"fog", &foggy}, std::pair{"smoke", &smoky}}) {
+        const renderer r(*scene, cam, settings);
+        framebuffer fb(settings.image_width, settings.image_height);
+        const auto start = clock::now();
+        r.render_pass(pool, fb, 0, settings.sample_per_pixel);
+        const std::chrono::duration<double> render_time = clock::now() - start;
+        std::cout << ", " << name << ' ' << samples / render_time.count() / 1e6 << " M samples/s";
+    }
+    std::cout << " (smoke density grid built in " << grid_time.count() << " s)\n";
+}
+
+// The bench mesh streamed from a clustered file with an eighth of it in
+// memory, random rays one at a time and in batches that visit each cluster
+// once. Single random rays fault on most visits, a sixty-fourth of the rays will do.
+void bench_streaming(const mesh_buffers &buffers, const triangle_mesh &mesh, const std::vector<ray> &random_rays) {
+    using clock = std::chrono::steady_clock;
+
+    const auto cluster_path = (std::filesystem::temp_directory_path() / ("raytracer_bench_" + std::to_string(getpid()) + ".rtcl")).string();
+    write_clusters(buffers, cluster_path, 0, geometry_cache::cluster_triangles);
+    auto geometry = std::make_shared<geometry_cache>();
+    const streamed_mesh streamed(geometry, geometry->open(cluster_path), make_shared<lambertian>(color(0.5)));
+    const auto budget = std::filesystem::file_size(cluster_path) / 8;
+    std::filesystem::remove(cluster_path);      // Stays readable through the mapping.
+
+    constexpr size_t batch_size = 4096;
+    constexpr auto far = std::numeric_limits<float>::infinity();
+    const std::span<const ray> streamed_rays(random_rays.data(), std::max<size_t>(1, random_rays.size() / 64));
+    std::vector<streamed_hit> single_hits(streamed_rays.size()), batch_hits(streamed_rays.size());
+    std::cout << "Streaming: " << streamed.cluster_count() << " clusters, " << budget / 1e6 << " MB resident at most, "
+              << streamed_rays.size() << " random rays";
+    for (const auto batched : {false, true}) {
+        geometry->set_budget(0);
+        geometry->set_budget(budget);
+        const auto faults = geometry->stats().faults;
+        const auto start = clock::now();
+        if (batched) {
+            for (size_t i = 0; i < streamed_rays.size(); i += batch_size) {
+                const auto count = std::min(batch_size, streamed_rays.size() - i);
+                streamed.intersect(streamed_rays.subspan(i, count), 0.001f, far, std::span(batch_hits).subspan(i, count));
+            }
+        } else {
+            for (size_t i = 0; i < streamed_rays.size(); ++i) { streamed.intersect(streamed_rays[i], 0.001f, far, single_hits[i]); }
+        }
+        const std::chrono::duration<double> trace_time = clock::now() - start;
+        std::cout << ", " << (batched ? "batches of " + std::to_string(batch_size) : std::string("single rays")) << ' '
+                  << streamed_rays.size() / trace_time.count() / 1e6 << " Mrays/s with " << geometry->stats().faults - faults << " faults";
+    }
+    size_t mismatches = 0;
+    for (size_t i = 0; i < streamed_rays.size(); ++i) {
+        mesh_hit resident;
+        mesh.intersect(streamed_rays[i], 0.001f, far, resident);
+        for (const auto t : {single_hits[i].t, batch_hits[i].t}) { mismatches += t != resident.t; }
+    }
+    std::cout << ", " << mismatches << " hits differing from the resident mesh\n";
+}
+
+// Times the closest hit queries of a generated mesh, with the scalar and the
+// SIMD triangle tests, for rays from a camera and for rays in random directions,
+// then the BVH refits, motion blur, noise, media and streaming.
+int run_bench(const render_options &options) {
+    using clock = std::chrono::steady_clock;
+
+    const auto build_start = clock::now();
+    const auto bench_buffers = bumpy_sphere(options.bench_triangles);
+    const triangle_mesh mesh(bench_buffers, make_shared<lambertian>(color(0.5)));
+    const std::chrono::duration<double> build_time = clock::now() - build_start;
+    std::cout << "Mesh: " << mesh.triangle_count() << " triangles, BVH of " << mesh.hierarchy().nodes.size()
+              << " nodes built in " << build_time.count() << " s\n";
+
+    // Camera rays cover the mesh and some sky, random rays cross its bounds.
+    const auto side = std::max(1u, static_cast<unsigned>(std::sqrt(static_cast<double>(options.bench_rays))));
+    std::vector<ray> camera_rays, random_rays;
+    for (unsigned y = 0; y < side; ++y) {
+        for (unsigned x = 0; x < side; ++x) {
+            const point3 target(-1.2 + 2.4 * (x + 0.5) / side, -1.2 + 2.4 * (y + 0.5) / side, 0.0);
+            camera_rays.emplace_back(point3(0.0, 0.0, 3.0), target - point3(0.0, 0.0, 3.0));
+        }
+    }
+    seed_random(options.settings.seed);
+    for (size_t i = 0; i < camera_rays.size(); ++i) {
+        const auto origin = 3.0 * normalized(random_vec3(-1.0, 1.0));
+        random_rays.emplace_back(origin, random_vec3(-1.0, 1.0) - origin);
+    }
+    bench_triangle_tests(mesh, camera_rays, random_rays);
+
+    // As many spheres as triangles, drifting a little every frame.
+    thread_pool pool(options.thread_count);
+    std::vector<point3> centers, velocities;
+    for (unsigned i = 0; i < options.bench_triangles; ++i) {
+        centers.push_back(random_vec3(-10.0, 10.0));
+        velocities.push_back(random_vec3(-0.02, 0.02));
+    }
+    bench_refit(centers, velocities, pool);
+    bench_motion_blur(centers, velocities, random_rays);
+    bench_noise(options.bench_rays);
+    bench_media(options, pool);
+    bench_streaming(*bench_buffers, mesh, random_rays);
+    return 0;
+}
+
+// Render server. Scenes are built on first use and kept for the following
+// jobs, a scene file is loaded again once it changes. The thread pool is shared
+// by all the jobs.
+int run_server(const render_options &options) {
+    struct scene_file {
+        std::shared_ptr<scene_world> world;
+        std::filesystem::file_time_type modified;
+    };
+
+    thread_pool pool(options.thread_count);
+    std::map<uint64_t, std::shared_ptr<scene_world>> random_worlds;
+    std::map<std::string, scene_file> scene_files;
+
+    render_server server(options.socket_path, [&](render_job &job) {
+        std::shared_ptr<scene_world> world;
+        if (!job.options.scene_path.empty()) {
+            const auto &path = job.options.scene_path;
+            const auto modified = std::filesystem::last_write_time(path);
+            auto &cached = scene_files[path];
+            if (!cached.world || cached.modified != modified) {
+                cached = {load_world(path, pool), modified};
+                std::cout << "Loaded " << path << '\n';
+            }
+            world = cached.world;
+
+            // A preempted job keeps the options it started with.
+            if (!job.resolved) { job.resolved = parse_options(job.arguments, world->description.default_args); }
+        } else {
+            auto &cached = random_worlds[job.options.settings.seed];
+            if (!cached) { cached = random_world(job.options.settings.seed); }
+            world = cached;
+            if (!job.resolved) { job.resolved = job.options; }
+        }
+        resolve_region(*job.resolved);
+        job.samples_total = job.resolved->settings.sample_per_pixel;
+
+        auto job_options = *job.resolved;
+        job_options.settings.key = render_key(world->scene_key, job_options.settings.camera);
+        set_cache_budgets(*world, job_options);
+        const auto &settings = job_options.settings;
+        const auto cam = scene_camera(settings);
+        renderer r(world->root(), cam, settings);
+
+        if (!job.fb) {
+            auto aovs = job_options.aovs;
+            if (job_options.denoise) { aovs.add({aov::albedo, aov::normal}); }
+            const auto &region = job_options.region;
+            job.fb.emplace(region.x1 - region.x0, region.y1 - region.y0, region.x0, region.y0, aovs);
+            if (!job_options.resume_path.empty()) {
+                job.samples_done = load_checkpoint(job_options.resume_path, *job.fb, settings);
+            }
+        }
+        if (job_options.time_budget > 0.0) {
+            job_options.progressive.deadline = *job.started + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                std::chrono::duration<double>(job_options.time_budget));
+        }
+
+        job_options.progressive.interrupt = &job.preempt;
+        job_options.progressive.pass_done = [&job, &settings](int done) {
+            job.samples_done = done;
+            job.send("progress " + std::to_string(job.id) + ' ' + std::to_string(done) + ' ' + std::to_string(settings.sample_per_pixel));
+        };
+        png_band_encoder png(*job.fb, job_options.tonemap);
+        const auto has_png = std::ranges::any_of(job_options.output_paths, [](const auto &path) { return file_extension(path) == "png"; });
+        if (has_png && !job_options.denoise) {
+            job_options.progressive.final_rows_done = [&png](int y0, int y1) { png.encode(y0, y1); };
+        }
+
+        preview_writer previews(job_options.tonemap);
+        job.samples_done = render_progressive(r, pool, *job.fb, job_options.progressive, previews, job.samples_done);
+        if (job.preempt && job.samples_done < settings.sample_per_pixel) { return; }
+
+        write_outputs(job_options, settings, pool, *job.fb, job.samples_done, &png);
+        std::cout << '\n';
+        job.fb.reset();
+        job.complete = true;
+    });
+    server.serve(&interrupt_requested);
+    return 0;
+}
+
+// Sends the render of the command line to a server and prints its replies
+// until the job ends. Paths are made absolute, the server has another working
+// directory.
+int run_submit(int argc, char **argv, const render_options &options) {
+    std::string request = "render";
+    for (int i = 2; i < argc; ++i) {
+        const std::string_view arg = argv[i];
+        if (arg == "--socket") {
+            ++i;
+            continue;
+        }
+        request += ' ' + server_detail::quote(argv[i]);
+        if ((arg == "-o" || arg == "--output" || arg == "--preview-path" || arg == "--checkpoint" || arg == "--resume"
+                || arg == "--scene") && i + 1 < argc) {
+            request += ' ' + server_detail::quote(std::filesystem::absolute(argv[++i]).string());
+        }
+    }
+    request += '\n';
+
+    const auto address = server_detail::socket_address(options.socket_path);
+    const int server = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (server < 0 || connect(server, reinterpret_cast<const sockaddr *>(&address), sizeof(address)) != 0
+            || ::send(server, request.data(), request.size(), MSG_NOSIGNAL) != static_cast<ssize_t>(request.size())) {
+        std::cerr << "Unable to reach the render server at " << options.socket_path << '\n';
+        if (server >= 0) { close(server); }
+        return 1;
+    }
+
+    std::string last_line, line;
+    char buffer[4096];
+    for (ssize_t size; (size = ::recv(server, buffer, sizeof(buffer), 0)) > 0;) {
+        for (ssize_t i = 0; i < size; ++i) {
+            if (buffer[i] != '\n') {
+                line.push_back(buffer[i]);
+                continue;
+            }
+            std::cout << line << std::endl;
+            last_line = std::move(line);
+            line.clear();
+        }
+    }
+    close(server);
+    return last_line.starts_with("done") ? 0 : 1;
+}
+
+int main(int argc, char **argv) {
+    const auto frame_start = std::chrono::steady_clock::now();
+
+    render_options options;
+    try {
+        options = parse_options(argc, argv);
+    } catch (const std::invalid_argument &e) {
+        std::cerr << e.what() << "\n\n";
+        print_usage(std::cerr);
+        return 1;
+    }
+    if (options.show_help) {
+        print_usage(std::cout);
+        return 0;
+    }
+
+    if (options.mode == run_mode::worker) {
+        return run_worker(options);
+    }
+    if (options.mode == run_mode::submit) {
+        return run_submit(argc, argv, options);
+    }
+    if (options.mode == run_mode::serve) {
+        std::signal(SIGINT, request_interrupt);
+        std::signal(SIGTERM, request_interrupt);
+        try {
+            return run_server(options);
+        } catch (const std::exception &e) {
+            std::cerr << '\n' << e.what() << '\n';
+            return 1;
+        }
+    }
+
+    if (options.mode == run_mode::bench) {
+        try {
+            return options.input_paths.empty() ? run_bench(options) : run_import_bench(options);
+        } catch (const std::exception &e) {
+            std::cerr << e.what() << '\n';
+            return 1;
+        }
+    }
+
+    if (options.mode == run_mode::convert) {
+        try {
+            const auto &input = options.input_paths.front();
+            const auto parse_start = std::chrono::steady_clock::now();
+            const auto scene = load_scene(input);
+            const std::chrono::duration<double> parse_time = std::chrono::steady_clock::now() - parse_start;
+            save_scene_binary(options.output_paths.front(), scene);
+            std::cout << "Converted " << input << ": " << scene.sphere_count() << " spheres, " << scene.materials.size()
+                      << " materials, parsed in " << parse_time.count() << " s\n";
+        } catch (const std::exception &e) {
+            std::cerr << e.what() << '\n';
+            return 1;
+        }
+        return 0;
+    }
+
+    if (options.mode == run_mode::merge) {
+        try {
+            auto merged = merge_slices(options.input_paths);
+            if (merged.missing_pixels) {
+                std::cout << merged.missing_pixels << " pixels are not covered by any slice\n";
+            }
+            if (options.denoise && !(merged.fb.aovs.has(aov::albedo) && merged.fb.aovs.has(aov::normal))) {
+                throw std::runtime_error("The slices have no denoiser guides, render them with --denoise");
+            }
+            thread_pool pool(options.thread_count);
+            write_outputs(options, merged.settings, pool, merged.fb, merged.samples_done);
+        } catch (const std::exception &e) {
+            std::cerr << '\n' << e.what() << '\n';
+            return 1;
+        }
+        std::cout << "\nDone!\n";
+        return 0;
+    }
+
+    thread_pool pool(options.thread_count);
+
+    // World, the settings and camera of a scene file are defaults for the command line.
+    std::shared_ptr<scene_world> world;
+    if (!options.scene_path.empty()) {
+        try {
+            const auto load_start = std::chrono::steady_clock::now();
+            world = load_world(options.scene_path, pool);
+            double load_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - load_start).count() - world->bvh_seconds
+                               - world->tlas_seconds - world->texture_seconds - world->media_seconds;
+            for (const auto &mesh : world->meshes) {
+                load_time -= mesh.load_seconds + mesh.bvh_seconds;
+                if (mesh.streamed) {
+                    std::cout << "Streamed " << mesh.path << ": " << mesh.triangles << " triangles, clusters opened in " << mesh.load_seconds
+                              << " s, their BVH built in " << mesh.bvh_seconds << " s\n";
+                    continue;
+                }
+                std::cout << "Loaded " << mesh.path << ": " << mesh.triangles << " triangles, " << mesh.bytes / 1e6 << " MB in "
+                          << mesh.load_seconds << " s (" << mesh.bytes / 1e6 / mesh.load_seconds << " MB/s), BVH "
+                          << (mesh.bvh_from_cache ? "mapped from the cache" : "built") << " in " << mesh.bvh_seconds << " s\n";
+            }
+            std::cout << "Loaded " << options.scene_path << ": " << world->description.sphere_count() << " spheres, "
+                      << world->description.materials.size() << " materials in " << load_time << " s\n"
+                      << "BVH: " << world->bvh_nodes << " nodes " << (world->bvh_from_cache ? "mapped from the cache" : "built")
+                      << " in " << world->bvh_seconds << " s\n";
+            if (!world->description.instances.empty()) {
+                std::cout << "Instances: " << world->description.instances.size() << ", top-level BVH built in " << world->tlas_seconds << " s\n";
+            }
+            if (world->textures->size() > 0) {
+                std::cout << "Textures: " << world->textures->size() << " opened in " << world->texture_seconds << " s, "
+                          << world->textures->converted() << " converted to tiled mip pyramids\n";
+            }
+            if (world->geometry->size() > 0) {
+                std::cout << "Geometry: " << world->geometry->size() << " streamed meshes, " << world->geometry->converted()
+                          << " converted to clustered files\n";
+            }
+            if (!world->description.media.empty()) {
+                const auto smoke = std::ranges::count_if(world->description.media, [](const medium_desc &desc) { return desc.noise_scale > 0.0f; });
+                std::cout << "Media: " << world->description.media.size() << ", " << smoke << " with density grids built in "
+                          << world->media_seconds << " s\n";
+            }
+
+            options = parse_options(argc, argv, world->description.default_args);
+            set_cache_budgets(*world, options);
+        } catch (const std::invalid_argument &e) {
+            std::cerr << e.what() << "\n\n";
+            print_usage(std::cerr);
+            return 1;
+        } catch (const std::exception &e) {
+            std::cerr << e.what() << '\n';
+            return 1;
+        }
+    }
+
+    options.settings.key = render_key(world ? world->scene_key : 0, options.settings.camera);
+    try {
+        resolve_region(options);
+    } catch (const std::invalid_argument &e) {
+        std::cerr << e.what() << "\n\n";
+        print_usage(std::cerr);
+        return 1;
+    }
 
     // Image
-    constexpr auto aspect_ratio = 3.0 / 2.0;
-    constexpr int image_width = 1200;
-    constexpr int image_height = static_cast<int>(image_width / aspect_ratio);
-    constexpr int sample_per_pixel = 500;
-    constexpr int max_depth = 50;
+    if (options.time_budget > 0.0) {
+        options.progressive.deadline = frame_start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<double>(options.time_budget));
+    }
+    const auto &settings = options.settings;
 
-    // World
-    auto world = random_scene();
+    // The denoiser is guided by the albedo and normal planes.
+    auto aovs = options.aovs;
+    if (options.denoise) { aovs.add({aov::albedo, aov::normal}); }
+    const auto &region = options.region;
 
-    // Camera
-    point3 lookfrom(13.0, 2.0, 3.0);
-    point3 lookat(0.0);
-    vec3 vup(0.0, 1.0, 0.0);
-    auto depth_of_field = 10.0;
-    auto aperture = 0.1;
+    if (options.mode == run_mode::farm) {
+        try {
+            framebuffer fb(region.x1 - region.x0, region.y1 - region.y0, region.x0, region.y0, aovs);
+            std::vector<std::string> worker_arguments{"--texture-cache", std::to_string(options.texture_cache_mb),
+                                                      "--geometry-cache", std::to_string(options.geometry_cache_mb)};
+            if (world) { worker_arguments.insert(worker_arguments.end(), {"--scene", options.scene_path}); }
+            const auto stats = render_farm("/proc/self/exe", worker_arguments, options.farm, settings, fb);
+            for (size_t i = 0; i < stats.size(); ++i) {
+                const auto &worker = stats[i];
+                const auto samples = static_cast<double>(worker.pixels) * settings.sample_per_pixel;
+                std::cout << "\nWorker " << i << ": " << worker.tiles << " tiles, "
+                          << (worker.seconds > 0.0 ? samples / worker.seconds / 1e6 : 0.0) << " M samples/s"
+                          << (worker.crashed ? ", crashed" : "");
+            }
+
+            write_outputs(options, settings, pool, fb, settings.sample_per_pixel);
+        } catch (const std::exception &e) {
+            std::cerr << '\n' << e.what() << '\n';
+            return 1;
+        }
+        std::cout << "\nDone!\n";
+        return 0;
+    }
+
+    if (!world) { world = random_world(settings.seed); }
+
+    if (options.mode == run_mode::sequence) {
+        try {
+            return run_sequence(options, *world, pool);
+        } catch (const std::exception &e) {
+            std::cerr << '\n' << e.what() << '\n';
+            return 1;
+        }
+    }
 
-    camera cam(lookfrom, lookat, vup, 20.0, aspect_ratio, aperture, depth_of_field);
+    // Camera
+    const auto cam = scene_camera(settings);
 
     // Render
-    constexpr int channels = 3;
-    stbi_flip_vertically_on_write(true);
-    std::unique_ptr<char[]> img = std::make_unique<char[]>(image_width * image_height * channels);
+    renderer r(world->root(), cam, settings);
 
-    for(int j = image_height - 1; j >= 0 ; --j) {
-        std::cout << "\rScanlines remaining: " << j << std::flush;
-        for (int i = 0; i < image_width; ++i) {
-            color pixel_color(0);
-            
-            for (int s = 0; s < sample_per_pixel; ++s) {
-                auto u = (i + random_double()) / (image_width - 1);
-                auto v = (j + random_double()) / (image_height - 1);
-                ray r = cam.get_ray(u, v);
-                pixel_color += ray_color(r, world, max_depth);
-            }
+    if (options.stream) {
+        try {
+            const auto encode_seconds = render_streamed(r, pool, options.output_paths.front(), options.tonemap, options.region);
+            std::cout << "\nEncode: " << encode_seconds << " s, overlapped with rendering";
+            print_cache_stats(*world);
+        } catch (const std::exception &e) {
+            std::cerr << '\n' << e.what() << '\n';
+            return 1;
+        }
+        std::cout << "\nDone!\n";
+        return 0;
+    }
+
+    framebuffer fb(region.x1 - region.x0, region.y1 - region.y0, region.x0, region.y0, aovs);
+
+    std::signal(SIGINT, request_interrupt);
+    std::signal(SIGTERM, request_interrupt);
+    options.progressive.interrupt = &interrupt_requested;
 
-            auto start_color_index((j * channels * image_width) + i*channels);
-            write_color(img.get(), start_color_index, pixel_color, sample_per_pixel);
+    try {
+        int first_sample = 0;
+        if (!options.resume_path.empty()) {
+            first_sample = load_checkpoint(options.resume_path, fb, settings);
+            std::cout << "Resuming " << options.resume_path << " at " << first_sample << " samples per pixel\n";
         }
+
+        // PNG strips are encoded while the last pass is still rendering other tiles.
+        // A denoised image only exists after the render, write_outputs encodes it then.
+        png_band_encoder png(fb, options.tonemap);
+        const auto has_png = std::ranges::any_of(options.output_paths, [](const auto &path) { return file_extension(path) == "png"; });
+        if (has_png && !options.denoise) {
+            options.progressive.final_rows_done = [&png](int y0, int y1) { png.encode(y0, y1); };
+        }
+
+        preview_writer previews(options.tonemap);
+        const auto achieved_spp = render_progressive(r, pool, fb, options.progressive, previews, first_sample);
+        if (interrupt_requested && achieved_spp < settings.sample_per_pixel) {
+            std::cout << "\nInterrupted";
+            if (!options.progressive.checkpoint_path.empty()) {
+                std::cout << ", continue with --resume " << options.progressive.checkpoint_path;
+            }
+            std::cout << '\n';
+            return 2;
+        }
+
+        write_outputs(options, settings, pool, fb, achieved_spp, &png);
+        print_cache_stats(*world);
+    } catch (const std::exception &e) {
+        std::cerr << '\n' << e.what() << '\n';
+        return 1;
     }
 
-    stbi_write_png(result_path, image_width, image_height, channels, img.get(), image_width * channels);
-    
     std::cout << "\nDone!\n";
 }
\ No newline at end of file